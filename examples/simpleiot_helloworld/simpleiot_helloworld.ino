@@ -56,8 +56,13 @@ void onDataFromCloud(SimpleIOT *iot, String name, String value, SimpleIOTType ty
 void onConnectionReady(SimpleIOT *iot, int status, String message)
 {
   Serial.print("SimpleIOT: ");
-  Serial.print(message);
+  Serial.println(message);
 
+  // A non-zero status means a connect attempt failed. The SDK retries on its own.
+  //
+  if (status != 0) {
+    return;
+  }
   showHelloWorldBackground();
 }
 
@@ -109,8 +114,9 @@ void loop()
   M5.update();
 
   // NOTE: this needs to be called to let SimpleIOT and MQTT send and receive data. 
-  // The delay is how many  milliseconds you want to wait between each call. 
-  // A smaller number will yield more accurate delta values, but could overload the I2C bus.
+  // The idle time is how many milliseconds you want to wait at most between each call, so
+  // the buttons are still checked often enough.
   //
-  iot->loop(100);
+  iot->loop();
+  iot->idle(100);
 }
@@ -111,7 +111,13 @@ void setLedColor(uint8_t r, uint8_t g, uint8_t b)
 void onConnectionReady(SimpleIOT *iot, int status, String message)
 {
   Serial.print("SimpleIOT: ");
-  Serial.print(message);
+  Serial.println(message);
+
+  // A non-zero status means a connect attempt failed. The SDK retries on its own.
+  //
+  if (status != 0) {
+    return;
+  }
   hideConnecting();
   delay(100);
   yield();
@@ -190,6 +196,11 @@ void setup() {
   Serial.println(F("\n dSimpleIOT setup done"));
 }
 
+static bool gpsWaiting(SimpleIOT *iot)
+{
+  return ss.available() > 0;
+}
+
 static void smartDelay(unsigned long ms)
 {
   unsigned long start = millis();
@@ -197,6 +208,10 @@ static void smartDelay(unsigned long ms)
   {
     while (ss.available())
       gps.encode(ss.read());
+
+    // Sleep until SimpleIOT or the GPS has something for us
+    //
+    iot->idle(ms - min(ms, millis() - start), gpsWaiting);
   } while (millis() - start < ms);
 }
 //////////////////////////////////////////////////////
@@ -317,8 +332,7 @@ char strBuf[20];
   }
 
   // NOTE: this needs to be called to let SimpleIOT and MQTT send and receive data. 
-  // The delay is how many  milliseconds you want to wait between each call. 
-  // A smaller number will yield more accurate delta values, but could overload the I2C bus.
+  // It doesn't sleep, so the rest of the scan time goes to reading the GPS.
   //
   iot->loop();
 
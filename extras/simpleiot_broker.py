@@ -0,0 +1,874 @@
+#!/usr/bin/python3
+#
+# © 2022 Amazon Web Services, Inc. or its affiliates. All Rights Reserved.
+#
+# Stand-in MQTT broker for testing how SimpleIOT devices ride out broker restarts.
+#
+# A minimal MQTT 3.1.1 broker (CONNECT, SUBSCRIBE, PUBLISH at QoS 0 and 1, PINGREQ,
+# DISCONNECT, wildcard routing, optional persistent sessions) that "flaps": every so often
+# it drops every connection and then refuses new ones (CONNACK 3, server unavailable) for a
+# while, the way a broker failover looks from the device. It logs each client's connects and
+# checks them against what SimpleIOT::_connectFailed() promises:
+#
+#   - the n-th retry after a drop waits between half and all of min(BASE << n, MAX)
+#   - the waits are jittered, not always the same fraction of the ceiling
+#   - every reconnect that doesn't resume a session subscribes to the same topics again
+#   - every connection that stays up publishes (the connect report and anything queued)
+#
+# It can also stand in for Greengrass discovery (GET /greengrass/discover/thing/<thing> on
+# port 8443), naming itself as the group's core. A gateway device saves the discovered core,
+# so the report also checks that a device only runs discovery again after it failed to
+# connect to the core.
+#
+# "serve" runs it for real devices over TLS. Set the device's endpoint to this machine, and
+# since the device checks the broker's certificate against its root CA, use a bench CA as the
+# root CA. The report is printed when it's stopped with Ctrl-C or killed.
+#
+# "selftest" runs it locally against scripted clients with the same reconnect logic as the
+# device, with times scaled down, plus clients that get it wrong, to check that the report
+# passes the first and catches the others.
+#
+# "rtt" times round trips through any broker the way sendRoundTripProbe() does: publish to a
+# topic it's subscribed to and wait for the message to come back. Run it against AWS IOT and
+# against a Greengrass core from the same network to compare the two.
+#
+# BASE and MAX below must match SIMPLEIOT_BACKOFF_BASE_MS and SIMPLEIOT_BACKOFF_MAX_MS.
+#
+
+'''
+# Examples:
+> python simpleiot_broker.py selftest
+> python simpleiot_broker.py serve --cert broker.crt --key broker.key --flap 300 --outage 60
+> python simpleiot_broker.py serve --cert broker.crt --key broker.key --keep-sessions --seed 3
+> python simpleiot_broker.py rtt abc123-ats.iot.us-west-2.amazonaws.com --ca AmazonRootCA1.pem --cert device.crt --key device.key --client-id model-serial
+> python simpleiot_broker.py rtt 192.168.1.20 --ca group-ca.pem --cert device.crt --key device.key
+> python simpleiot_broker.py serve --cert broker.crt --key broker.key --discovery-port 8443 --core 192.168.1.20:8883 --group-ca bench-ca.pem
+'''
+
+import sys, argparse, http.server, json, random, signal, socket, socketserver, ssl, struct, threading, time, urllib.request
+
+BASE = 1.0                  # SIMPLEIOT_BACKOFF_BASE_MS, in seconds
+MAX = 120.0                 # SIMPLEIOT_BACKOFF_MAX_MS
+
+CONNECT, CONNACK, PUBLISH, PUBACK, SUBSCRIBE, SUBACK, PINGREQ, PINGRESP, DISCONNECT = 1, 2, 3, 4, 8, 9, 12, 13, 14
+SERVER_UNAVAILABLE = 3
+
+
+# MQTT packets
+#
+
+def packet(kind, flags, body):
+    out = bytearray([kind << 4 | flags])
+    length = len(body)
+    while True:
+        byte = length & 0x7f
+        length >>= 7
+        out.append(byte | (0x80 if length else 0))
+        if not length:
+            break
+    return bytes(out) + body
+
+
+def string(text):
+    data = text.encode('utf-8')
+    return struct.pack('>H', len(data)) + data
+
+
+def read_exact(sock, count):
+    data = b''
+    while len(data) < count:
+        chunk = sock.recv(count - len(data))
+        if not chunk:
+            raise EOFError()
+        data += chunk
+    return data
+
+
+def read_packet(sock):
+    first = read_exact(sock, 1)[0]
+    length = 0
+    shift = 0
+    while True:
+        byte = read_exact(sock, 1)[0]
+        length |= (byte & 0x7f) << shift
+        shift += 7
+        if not byte & 0x80:
+            break
+    return first >> 4, first & 0x0f, read_exact(sock, length)
+
+
+def read_string(body, pos):
+    length, = struct.unpack_from('>H', body, pos)
+    return body[pos + 2:pos + 2 + length].decode('utf-8'), pos + 2 + length
+
+
+def matches(pattern, topic):
+    want = pattern.split('/')
+    have = topic.split('/')
+    for i, level in enumerate(want):
+        if level == '#':
+            return True
+        if i >= len(have) or (level != '+' and level != have[i]):
+            return False
+    return len(want) == len(have)
+
+
+# Broker
+#
+
+class Broker:
+    def __init__(self, keep_sessions=False):
+        self.keep_sessions = keep_sessions
+        self.refusing_until = 0.0
+        self.connections = {}       # client ID -> Connection
+        self.sessions = {}          # client ID -> subscribed topics, for persistent sessions
+        self.failures = {}          # address -> refused connects since its last discovery
+        self.events = []            # (time, client ID, event, detail)
+        self.lock = threading.Lock()
+
+    def event(self, client, name, detail=None):
+        with self.lock:
+            self.events.append((time.monotonic(), client, name, detail))
+
+    def flap(self, outage):
+        '''Drop everyone and refuse connects for outage seconds'''
+
+        with self.lock:
+            self.refusing_until = time.monotonic() + outage
+            connections = list(self.connections.values())
+        for connection in connections:
+            connection.drop()
+
+    def refusing(self):
+        return time.monotonic() < self.refusing_until
+
+    def route(self, topic, payload):
+        with self.lock:
+            targets = [c for c in self.connections.values() if any(matches(t, topic) for t in c.topics)]
+        for target in targets:
+            target.send(packet(PUBLISH, 0, string(topic) + payload))
+
+
+class Connection(socketserver.BaseRequestHandler):
+    def setup(self):
+        self.client = None
+        self.topics = set()
+        self.dropped = False
+        self.send_lock = threading.Lock()
+
+    def send(self, data):
+        with self.send_lock:
+            try:
+                self.request.sendall(data)
+            except OSError:
+                pass
+
+    def drop(self):
+        if not self.dropped:
+            self.dropped = True
+            self.server.broker.event(self.client, 'dropped')
+        try:
+            self.request.shutdown(socket.SHUT_RDWR)
+        except OSError:
+            pass
+
+    def handle(self):
+        broker = self.server.broker
+        try:
+            kind, flags, body = read_packet(self.request)
+        except (EOFError, OSError, ssl.SSLError):
+            return
+        if kind != CONNECT:
+            return
+        name, pos = read_string(body, 0)
+        connect_flags = body[pos + 1]
+        self.client, _ = read_string(body, pos + 4)
+        clean = bool(connect_flags & 0x02)
+
+        if broker.refusing():
+            broker.event(self.client, 'refused')
+            with broker.lock:
+                address = self.client_address[0]
+                broker.failures[address] = broker.failures.get(address, 0) + 1
+            self.send(packet(CONNACK, 0, bytes([0, SERVER_UNAVAILABLE])))
+            return
+
+        with broker.lock:
+            old = broker.connections.get(self.client)
+            broker.connections[self.client] = self
+            present = broker.keep_sessions and not clean and self.client in broker.sessions
+            if present:
+                self.topics = set(broker.sessions[self.client])
+            elif clean:
+                broker.sessions.pop(self.client, None)
+        if old:
+            old.drop()
+        broker.event(self.client, 'connect', present)
+        self.send(packet(CONNACK, 0, bytes([1 if present else 0, 0])))
+
+        try:
+            while True:
+                kind, flags, body = read_packet(self.request)
+                if kind == SUBSCRIBE:
+                    packet_id = body[:2]
+                    pos = 2
+                    granted = bytearray()
+                    while pos < len(body):
+                        topic, pos = read_string(body, pos)
+                        granted.append(min(body[pos], 1))
+                        pos += 1
+                        self.topics.add(topic)
+                        broker.event(self.client, 'subscribe', topic)
+                    if broker.keep_sessions and not clean:
+                        with broker.lock:
+                            broker.sessions[self.client] = set(self.topics)
+                    self.send(packet(SUBACK, 0, packet_id + bytes(granted)))
+                elif kind == PUBLISH:
+                    topic, pos = read_string(body, 0)
+                    if flags & 0x06:
+                        self.send(packet(PUBACK, 0, body[pos:pos + 2]))
+                        pos += 2
+                    broker.event(self.client, 'publish', topic)
+                    broker.route(topic, body[pos:])
+                elif kind == PINGREQ:
+                    self.send(packet(PINGRESP, 0, b''))
+                elif kind == DISCONNECT:
+                    broker.event(self.client, 'disconnect')
+                    return
+        except (EOFError, OSError, ssl.SSLError):
+            pass
+        finally:
+            with broker.lock:
+                if broker.connections.get(self.client) is self:
+                    del broker.connections[self.client]
+        if not self.dropped:
+            broker.event(self.client, 'lost')
+
+
+class Server(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+    def __init__(self, broker, port=0, context=None):
+        socketserver.ThreadingTCPServer.__init__(self, ('', port), Connection)
+        self.broker = broker
+        self.context = context
+
+    def get_request(self):
+        sock, address = socketserver.ThreadingTCPServer.get_request(self)
+        if self.context:
+            sock = self.context.wrap_socket(sock, server_side=True)
+        return sock, address
+
+
+# Greengrass discovery
+#
+
+class Discovery(http.server.BaseHTTPRequestHandler):
+    '''Answers discovery with one group whose core is at the given addresses'''
+
+    def do_GET(self):
+        site = self.server
+        prefix = '/greengrass/discover/thing/'
+        if not self.path.startswith(prefix):
+            self.send_error(404)
+            return
+        thing = self.path[len(prefix):]
+        with site.broker.lock:
+            failures = site.broker.failures.pop(self.client_address[0], 0)
+            answer = site.fail <= 0 or site.rng.random() >= site.fail
+        site.broker.event(thing, 'discover', (failures, answer))
+        if not answer:
+            self.send_error(503)
+            return
+
+        body = json.dumps({'GGGroups': [{
+            'GGGroupId': 'simpleiot-standin',
+            'Cores': [{
+                'thingArn': 'arn:aws:iot:local:000000000000:thing/simpleiot-standin-core',
+                'Connectivity': [{'Id': str(i), 'HostAddress': host, 'PortNumber': port, 'Metadata': ''}
+                                 for i, (host, port) in enumerate(site.cores)],
+            }],
+            'CAs': [site.ca],
+        }]}).encode('utf-8')
+        self.send_response(200)
+        self.send_header('Content-Type', 'application/json')
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, format, *args):
+        pass
+
+
+class DiscoveryServer(http.server.ThreadingHTTPServer):
+    daemon_threads = True
+
+    def __init__(self, broker, cores, ca, port=0, context=None, fail=0.0, seed=None):
+        http.server.ThreadingHTTPServer.__init__(self, ('', port), Discovery)
+        self.broker = broker
+        self.cores = cores
+        self.ca = ca
+        self.context = context
+        self.fail = fail
+        self.rng = random.Random(seed)
+
+    def get_request(self):
+        sock, address = http.server.ThreadingHTTPServer.get_request(self)
+        if self.context:
+            sock = self.context.wrap_socket(sock, server_side=True)
+        return sock, address
+
+
+# Report
+#
+
+def report(events, base=BASE, maximum=MAX, slack=3.0, settle=5.0, noise=None, verbose=True):
+    '''Check each client's connects against the backoff schedule. Returns a list of problems.
+
+    slack is how much later than the schedule a retry may come: the time to notice the drop
+    and for the TCP and TLS handshakes before the CONNECT. settle is how long a connection has
+    to stay up before it's expected to have subscribed and published. Retry windows narrower
+    than noise (the slack by default) are left out of the jitter check.
+    '''
+
+    noise = slack if noise is None else noise
+
+    problems = []
+    clients = sorted(set(e[1] for e in events if e[1] and e[2] != 'discover'))
+    for client in clients:
+        mine = [e for e in events if e[1] == client and e[2] != 'discover']
+        waits = []              # (retry, seconds, low, high)
+        baseline = None
+        since = None            # when the last drop or refusal was seen
+        retry = 0
+        connection = None       # [start, session present, topics, publishes]
+
+        def close(at):
+            nonlocal baseline
+            if connection is None or at - connection[0] < settle:
+                return
+            start, present, topics, publishes = connection
+            if baseline is None and not present:
+                baseline = topics
+            elif not present and not baseline <= topics:
+                problems.append('%s: reconnect at %.1f s didn\'t subscribe to %s' %
+                                (client, start - events[0][0], ', '.join(sorted(baseline - topics))))
+            if publishes == 0:
+                problems.append('%s: connection at %.1f s didn\'t publish' % (client, start - events[0][0]))
+
+        for at, _, name, detail in mine:
+            if name in ('refused', 'connect') and since is not None:
+                ceiling = min(base * (1 << min(retry, 16)), maximum)
+                waits.append((retry, at - since, ceiling / 2, ceiling))
+                retry += 1
+            if name == 'refused':
+                since = at
+            elif name == 'connect':
+                close(at)
+                connection = [at, detail, set(), 0]
+                since = None
+                retry = 0
+            elif name == 'subscribe' and connection:
+                connection[2].add(detail)
+            elif name == 'publish' and connection:
+                connection[3] += 1
+            elif name == 'dropped':
+                close(at)
+                connection = None
+                since = at
+            elif name in ('lost', 'disconnect'):
+                # The device went away by itself, maybe to reboot, so the schedule starts over
+                close(at)
+                connection = None
+                since = None
+        close(mine[-1][0])
+
+        for retry, wait, low, high in waits:
+            if wait < low - 0.01 * base:
+                problems.append('%s: retry %d after %.3f s, sooner than %.3f s' % (client, retry, wait, low))
+            elif wait > high + slack:
+                problems.append('%s: retry %d after %.3f s, later than %.3f s' % (client, retry, wait, high + slack))
+
+        # Where each wait fell between half and all of its ceiling. Jittered, they spread over the
+        # whole window, otherwise they bunch up. Windows narrower than the slack are mostly noise.
+        spread = sorted((wait - low) / (high - low) for retry, wait, low, high in waits
+                        if high - low >= noise and wait <= high + slack)
+        if len(spread) >= 8:
+            if spread[-2] - spread[1] < 0.1:
+                problems.append('%s: retries aren\'t jittered (%d waits all near %.0f%% of the window)' %
+                                (client, len(spread), 100 * spread[len(spread) // 2]))
+        if verbose:
+            connects = sum(1 for e in mine if e[2] == 'connect')
+            refused = sum(1 for e in mine if e[2] == 'refused')
+            print('%s: %d connects, %d refused, waits %s' %
+                  (client, connects, refused, ' '.join('%.2f' % w[1] for w in waits[:12]) +
+                   (' ...' if len(waits) > 12 else '')))
+
+    # How a fleet spread its first reconnect after each flap
+    if verbose and len(clients) > 1:
+        firsts = {}
+        for client in clients:
+            since = None
+            for at, _, name, _ in [e for e in events if e[1] == client]:
+                if name == 'dropped':
+                    since = at
+                elif name in ('refused', 'connect') and since is not None:
+                    firsts.setdefault(round(since, 0), []).append(at - since)
+                    since = None
+        for flap, waits in sorted(firsts.items()):
+            print('flap at %.0f s: %d clients came back over %.3f s' % (flap - events[0][0], len(waits),
+                                                                       max(waits) - min(waits)))
+
+    # Once a device has its core, it keeps it over reboots until it can't connect to it
+    for thing in sorted(set(e[1] for e in events if e[2] == 'discover')):
+        found = [e for e in events if e[1] == thing and e[2] == 'discover']
+        for previous, current in zip(found, found[1:]):
+            failures, _ = current[3]
+            if previous[3][1] and failures == 0:
+                problems.append('%s: discovery at %.1f s with no failed connect to the core since the last one' %
+                                (thing, current[0] - events[0][0]))
+        if verbose:
+            print('%s: %d discoveries' % (thing, len(found)))
+    return problems
+
+
+# Round trips
+#
+
+def open_client(host, port, context, client_id):
+    '''Connect, and subscribe to nothing yet. Returns the socket and the seconds it took.'''
+
+    start = time.perf_counter()
+    sock = socket.create_connection((host, port), timeout=10)
+    if context:
+        sock = context.wrap_socket(sock, server_hostname=host)
+    sock.sendall(packet(CONNECT, 0, string('MQTT') + bytes([4, 0x02]) + struct.pack('>H', 60) + string(client_id)))
+    kind, _, body = read_packet(sock)
+    if kind != CONNACK or body[1] != 0:
+        raise OSError('connect refused with code %d' % body[1])
+    return sock, time.perf_counter() - start
+
+
+def round_trips(sock, topic, count, interval):
+    '''Publish count probes to a topic we're subscribed to, the way sendRoundTripProbe() does,
+    and time each one coming back. Returns the times in seconds, None for any that didn't.'''
+
+    sock.sendall(packet(SUBSCRIBE, 2, b'\x00\x01' + string(topic) + b'\x00'))
+    while read_packet(sock)[0] != SUBACK:
+        pass
+    times = []
+    for seq in range(1, count + 1):
+        payload = ('{"rtt":%d}' % seq).encode('utf-8')
+        start = time.perf_counter()
+        sock.sendall(packet(PUBLISH, 0, string(topic) + payload))
+        try:
+            while True:
+                kind, flags, body = read_packet(sock)
+                if kind == PUBLISH and body[read_string(body, 0)[1]:] == payload:
+                    times.append(time.perf_counter() - start)
+                    break
+        except socket.timeout:
+            times.append(None)
+        time.sleep(interval)
+    return times
+
+
+def rtt(args):
+    context = None
+    if args.ca or args.cert:
+        context = ssl.create_default_context(cafile=args.ca)
+        if args.cert:
+            context.load_cert_chain(args.cert, args.key)
+        if args.alpn:
+            context.set_alpn_protocols(['x-amzn-mqtt-ca'])
+    client_id = args.client_id or 'simpleiot-rtt-%06d' % random.randrange(1000000)
+    topic = args.topic or 'simpleiot_v1/sys/diag/rtt/%s/rtt' % client_id
+
+    sock, connect = open_client(args.host, args.port, context, client_id)
+    sock.settimeout(args.timeout)
+    try:
+        times = round_trips(sock, topic, args.count, args.interval)
+        sock.sendall(packet(DISCONNECT, 0, b''))
+    finally:
+        sock.close()
+
+    got = sorted(t for t in times if t is not None)
+    print('%s:%d connect %.1f ms' % (args.host, args.port, connect * 1000))
+    if not got:
+        print('ERROR: no probes came back')
+        return 1
+    print('%d of %d probes back, round trip ms: min %.1f median %.1f p95 %.1f max %.1f' %
+          (len(got), len(times), got[0] * 1000, got[len(got) // 2] * 1000,
+           got[min(len(got) - 1, len(got) * 95 // 100)] * 1000, got[-1] * 1000))
+    return 0
+
+
+# Self test
+#
+
+class Client(threading.Thread):
+    '''The device's reconnect logic: _connectFailed(), _connectionLost() and the subscribe
+    phase, with a policy that can be broken on purpose'''
+
+    def __init__(self, port, name, topics, scale, rng, jitter=True, backoff=True, resubscribe=True, clean=True):
+        threading.Thread.__init__(self, daemon=True)
+        self.port = port
+        self.name = name
+        self.topics = topics
+        self.base = BASE * scale
+        self.maximum = MAX * scale
+        self.rng = rng
+        self.jitter = jitter
+        self.backoff = backoff
+        self.resubscribe = resubscribe
+        self.clean = clean
+        self.stopping = False
+        self.subscribed = False
+
+    def run(self):
+        retry = 0
+        while not self.stopping:
+            if self.session():
+                retry = 0           # was ready, so the next drop starts the schedule over
+            if self.stopping:
+                break
+            ceiling = min(self.base * (1 << min(retry, 16)), self.maximum) if self.backoff else self.base
+            retry += 1
+            time.sleep(ceiling / 2 + self.rng.uniform(0, ceiling / 2) if self.jitter else ceiling)
+
+    def session(self):
+        '''One connect. Returns True if it got as far as ready.'''
+
+        try:
+            sock = socket.create_connection(('127.0.0.1', self.port))
+        except OSError:
+            return False
+        ready = False
+        try:
+            flags = 0x02 if self.clean else 0x00
+            sock.sendall(packet(CONNECT, 0, string('MQTT') + bytes([4, flags]) + struct.pack('>H', 60) +
+                                string(self.name)))
+            kind, _, body = read_packet(sock)
+            if kind != CONNACK or body[1] != 0:
+                return False
+            if not (not self.clean and body[0] == 1) and (self.resubscribe or not self.subscribed):
+                body = b'\x00\x01' + b''.join(string(t) + b'\x01' for t in self.topics)
+                sock.sendall(packet(SUBSCRIBE, 2, body))
+                if read_packet(sock)[0] != SUBACK:
+                    return False
+                self.subscribed = True
+            sock.sendall(packet(PUBLISH, 0, string('simpleiot_v1/app/data/' + self.name) + b'{}'))
+            ready = True
+            sock.settimeout(0.05)
+            while not self.stopping:
+                try:
+                    read_packet(sock)
+                except socket.timeout:
+                    continue
+            return True
+        except (EOFError, OSError):
+            return ready
+        finally:
+            sock.close()
+
+
+SCENARIOS = [
+    # name, client policy, broker keeps sessions, problem the report should find
+    ('device logic', {}, False, None),
+    ('persistent sessions', {'clean': False}, True, None),
+    ('no jitter', {'jitter': False}, False, 'jittered'),
+    ('no backoff', {'backoff': False}, False, 'sooner than'),
+    ('no resubscribe', {'resubscribe': False}, False, 'didn\'t subscribe'),
+]
+
+
+def run(policy, keep_sessions, clients, flaps, scale, seed):
+    rng = random.Random(seed)
+    broker = Broker(keep_sessions)
+    server = Server(broker)
+    threading.Thread(target=server.serve_forever, args=(0.05,), daemon=True).start()
+    port = server.server_address[1]
+    topics = ['simpleiot_v1/app/monitor/{}', 'simpleiot_v1/adm/update/{}', 'simpleiot_v1/adm/update/proj/model']
+
+    fleet = []
+    for i in range(clients):
+        name = 'model-%04d' % i
+        fleet.append(Client(port, name, [t.format(name) for t in topics], scale, random.Random(rng.random()), **policy))
+    for client in fleet:
+        client.start()
+
+    # Each outage is long enough for several retries. After it, there's time for the longest
+    # of those to run out and for the connection to settle.
+    try:
+        time.sleep(40 * scale)
+        for i in range(flaps):
+            outage = rng.uniform(60, 120) * scale
+            broker.flap(outage)
+            time.sleep(2 * outage + 40 * scale)
+    finally:
+        for client in fleet:
+            client.stopping = True
+        for client in fleet:
+            client.join()
+        server.shutdown()
+        server.server_close()
+    return report(broker.events, BASE * scale, MAX * scale, slack=10 * scale, settle=10 * scale, noise=5 * scale,
+                  verbose=False)
+
+
+class Gateway:
+    '''The gateway side of the device: _discover(), the saved core, and moving on to the next
+    saved address after each failed connect, with discovery again once they've all failed'''
+
+    def __init__(self, discovery, thing, save=True):
+        self.discovery = discovery
+        self.thing = thing
+        self.save = save
+        self.saved = None           # the core in NVS, kept over reboots
+
+    def boot(self, tries):
+        '''Power up and try to connect. Returns True once connected.'''
+
+        core = self.saved if self.save else None
+        index = 0
+        failures = 0
+        for attempt in range(tries):
+            if core is None:
+                core = self.discover()
+                if core is None:
+                    continue
+                self.saved = core
+                index = 0
+                failures = 0
+            if self.connect(*core[index]):
+                return True
+            failures += 1
+            if failures >= len(core):
+                core = self.saved = None
+            else:
+                index = (index + 1) % len(core)
+        return False
+
+    def discover(self):
+        url = 'http://127.0.0.1:%d/greengrass/discover/thing/%s' % (self.discovery, self.thing)
+        try:
+            with urllib.request.urlopen(url) as response:
+                group = json.load(response)['GGGroups'][0]
+        except OSError:
+            return None
+        return [(c['HostAddress'], c['PortNumber']) for c in group['Cores'][0]['Connectivity']]
+
+    def connect(self, host, port):
+        try:
+            sock = socket.create_connection((host, port))
+        except OSError:
+            return False
+        try:
+            sock.sendall(packet(CONNECT, 0, string('MQTT') + bytes([4, 0x02]) + struct.pack('>H', 60) +
+                                string(self.thing)))
+            kind, _, body = read_packet(sock)
+            if kind != CONNACK or body[1] != 0:
+                return False
+            sock.sendall(packet(DISCONNECT, 0, b''))
+            return True
+        except (EOFError, OSError):
+            return False
+        finally:
+            sock.close()
+
+
+GATEWAY_SCENARIOS = [
+    # name, gateway keeps the discovered core, problem the report should find
+    ('saved core', True, None),
+    ('no saved core', False, 'no failed connect'),
+]
+
+
+def run_gateway(save):
+    broker = Broker()
+    server = Server(broker)
+    threading.Thread(target=server.serve_forever, args=(0.05,), daemon=True).start()
+
+    # The first core address has nothing listening, so every connect starts with a failure
+    unused = socket.socket()
+    unused.bind(('127.0.0.1', 0))
+    dead = unused.getsockname()[1]
+    unused.close()
+    cores = [('127.0.0.1', dead), ('127.0.0.1', server.server_address[1])]
+    discovery = DiscoveryServer(broker, cores, '-----BEGIN CERTIFICATE-----\n...', fail=1.0)
+    threading.Thread(target=discovery.serve_forever, args=(0.05,), daemon=True).start()
+    gateway = Gateway(discovery.server_address[1], 'standin-thing', save)
+
+    try:
+        # The first boot can't reach cloud discovery. Then the device boots a few times with the
+        # core up, once with it down, and twice more with it back.
+        results = [gateway.boot(4)]
+        discovery.fail = 0.0
+        results += [gateway.boot(4) for i in range(3)]
+        broker.refusing_until = time.monotonic() + 3600
+        results.append(gateway.boot(4))
+        broker.refusing_until = 0
+        results += [gateway.boot(4) for i in range(2)]
+    finally:
+        discovery.shutdown()
+        discovery.server_close()
+        server.shutdown()
+        server.server_close()
+
+    # This model doesn't back off between tries, so only the discovery check applies
+    problems = report([e for e in broker.events if e[2] == 'discover'], verbose=False)
+    if results != [False, True, True, True, False, True, True]:
+        problems.append('boots connected as %s' % results)
+    return problems
+
+
+def run_round_trips():
+    broker = Broker()
+    server = Server(broker)
+    threading.Thread(target=server.serve_forever, args=(0.05,), daemon=True).start()
+    try:
+        sock, _ = open_client('127.0.0.1', server.server_address[1], None, 'rtt-test')
+        sock.settimeout(1)
+        times = round_trips(sock, 'simpleiot_v1/sys/diag/proj/model/rtt-test/rtt', 20, 0)
+        sock.close()
+    finally:
+        server.shutdown()
+        server.server_close()
+    if None in times or max(times) > 0.5:
+        return ['probes came back as %s' % times]
+    return []
+
+
+def selftest(clients, flaps, scale, seed):
+    failed = 0
+    problems = run_round_trips()
+    print('%-20s %s' % ('round trips', 'FAIL: ' + problems[0] if problems else 'OK: 20 probes echoed'))
+    if problems:
+        failed += 1
+    for name, save, expected in GATEWAY_SCENARIOS:
+        problems = run_gateway(save)
+        ok = not problems if expected is None else any(expected in p for p in problems)
+        print('%-20s %s' % (name, ('OK: ' if ok else 'FAIL: ') +
+                            ('no problems' if not problems else '%d problems, e.g. %s' % (len(problems), problems[0]))))
+        if not ok:
+            failed += 1
+            for problem in problems[:10]:
+                print('  ' + problem)
+    # Each has its own broker and clients, so they run side by side
+    results = {}
+    threads = [threading.Thread(target=lambda i=i, policy=policy, keep_sessions=keep_sessions:
+                                results.__setitem__(i, run(policy, keep_sessions, clients, flaps, scale, seed)))
+               for i, (name, policy, keep_sessions, expected) in enumerate(SCENARIOS)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+
+    for i, (name, policy, keep_sessions, expected) in enumerate(SCENARIOS):
+        problems = results[i]
+        ok = not problems if expected is None else any(expected in p for p in problems)
+        print('%-20s %s' % (name, ('OK: ' if ok else 'FAIL: ') +
+                            ('no problems' if not problems else '%d problems, e.g. %s' % (len(problems), problems[0]))))
+        if not ok:
+            failed += 1
+            for problem in problems[:10]:
+                print('  ' + problem)
+    if failed:
+        print('ERROR: %d of %d scenarios failed' % (failed, len(SCENARIOS) + len(GATEWAY_SCENARIOS) + 1))
+        return 1
+    print('OK: the report passes the device logic and catches each broken policy')
+    return 0
+
+
+def serve(args):
+    rng = random.Random(args.seed)
+    broker = Broker(args.keep_sessions)
+    context = None
+    if args.cert:
+        context = ssl.create_default_context(ssl.Purpose.CLIENT_AUTH)
+        context.load_cert_chain(args.cert, args.key)
+    server = Server(broker, args.port, context)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    print('Broker on port %d over %s, flapping every %.0f s or so for %.0f s' %
+          (args.port, 'TLS' if context else 'plain TCP', args.flap, args.outage))
+
+    if args.discovery_port:
+        if not args.core or not args.group_ca:
+            print('ERROR: discovery needs --core and --group-ca')
+            return 1
+        cores = [(core.rpartition(':')[0], int(core.rpartition(':')[2])) for core in args.core]
+        with open(args.group_ca) as f:
+            ca = f.read()
+        discovery = DiscoveryServer(broker, cores, ca, args.discovery_port, context, args.discovery_fail, args.seed)
+        threading.Thread(target=discovery.serve_forever, daemon=True).start()
+        print('Discovery on port %d, core at %s' % (args.discovery_port, ', '.join(args.core)))
+
+    signal.signal(signal.SIGTERM, signal.default_int_handler)      # report when killed, too
+    try:
+        while True:
+            time.sleep(rng.uniform(0.5, 1.5) * args.flap)
+            print('%s: dropping %d connections' % (time.strftime('%H:%M:%S'), len(broker.connections)))
+            broker.flap(args.outage)
+    except KeyboardInterrupt:
+        pass
+    server.shutdown()
+
+    problems = report(broker.events, slack=args.slack)
+    for problem in problems:
+        print(problem)
+    print('OK: every client followed the reconnect schedule' if not problems else
+          'ERROR: %d problems' % len(problems))
+    return 1 if problems else 0
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(prog=argv[0], description='Stand-in MQTT broker that flaps')
+    commands = parser.add_subparsers(dest='command')
+
+    test = commands.add_parser('selftest', help='run the broker against scripted clients')
+    test.add_argument('--clients', type=int, default=4)
+    test.add_argument('--flaps', type=int, default=4)
+    test.add_argument('--scale', type=float, default=0.01, help='how much faster than real time to run')
+    test.add_argument('--seed', type=int, default=1)
+
+    server = commands.add_parser('serve', help='run the broker for devices')
+    server.add_argument('--port', type=int, default=8883)
+    server.add_argument('--cert', help='serve TLS with this certificate chain')
+    server.add_argument('--key')
+    server.add_argument('--flap', type=float, default=300, help='average seconds between drops')
+    server.add_argument('--outage', type=float, default=60, help='seconds to refuse connects after a drop')
+    server.add_argument('--keep-sessions', action='store_true', help='keep persistent sessions over reconnects')
+    server.add_argument('--slack', type=float, default=3.0, help='seconds a retry may run late by')
+    server.add_argument('--seed', type=int)
+    server.add_argument('--discovery-port', type=int, default=0, help='also stand in for Greengrass discovery')
+    server.add_argument('--core', action='append', help='host:port discovery gives for the core, may be repeated')
+    server.add_argument('--group-ca', help='PEM file discovery gives as the group CA')
+    server.add_argument('--discovery-fail', type=float, default=0.0, help='chance a discovery gets a 503')
+
+    probe = commands.add_parser('rtt', help='time round trips through a broker, the cloud or a core')
+    probe.add_argument('host')
+    probe.add_argument('--port', type=int, default=8883)
+    probe.add_argument('--ca', help='CA to check the broker against, the root CA or a group CA')
+    probe.add_argument('--cert', help='client certificate, for AWS IOT or a Greengrass core')
+    probe.add_argument('--key')
+    probe.add_argument('--alpn', action='store_true', help='MQTT over port 443 with ALPN')
+    probe.add_argument('--client-id', help='needs to be one the IOT policy allows')
+    probe.add_argument('--topic', help='topic to publish and subscribe to')
+    probe.add_argument('--count', type=int, default=50)
+    probe.add_argument('--interval', type=float, default=0.2)
+    probe.add_argument('--timeout', type=float, default=5.0)
+
+    args = parser.parse_args(argv[1:])
+    if args.command == 'rtt':
+        return rtt(args)
+    if args.command == 'selftest':
+        return selftest(args.clients, args.flaps, args.scale, args.seed)
+    if args.command == 'serve':
+        return serve(args)
+    parser.print_usage()
+    return 1
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,157 @@
+#!/usr/bin/python3
+#
+# © 2022 Amazon Web Services, Inc. or its affiliates. All Rights Reserved.
+#
+# Make and check delta patches for SimpleIOT OTA updates.
+#
+# A patch rebuilds a new firmware image from the one running on the device. It is a list of
+# COPY operations (take bytes from the running image) and ADD operations (new bytes), which
+# the device streams into the update partition. See SimpleIOTOTAPatcher in src/SimpleIOTOTA.h.
+#
+# Layout, all numbers little-endian uint32:
+#
+#   "SIDP" | base size | base SHA-256 (32 bytes) | target size
+#   0x01 offset length           COPY from the base
+#   0x02 length bytes...         ADD
+#   0x00                         END
+#
+# The base SHA-256 is the one the device reports for its running image: the digest appended
+# to the .bin by the build if there is one, otherwise the SHA-256 of the whole file.
+#
+
+'''
+# Examples:
+> python simpleiot_delta.py make firmware-1.0.0.bin firmware-1.1.0.bin patch.bin
+> python simpleiot_delta.py verify firmware-1.0.0.bin firmware-1.1.0.bin patch.bin
+> gzip -9 patch.bin
+'''
+
+import sys, struct, hashlib
+
+MAGIC = b'SIDP'
+OP_END = 0
+OP_COPY = 1
+OP_ADD = 2
+BLOCK = 32                  # base is indexed on blocks of this size
+MIN_COPY = 24               # shorter matches cost more as a COPY than as an ADD
+IMAGE_HASH_APPENDED = 23    # offset of the hash_appended flag in esp_image_header_t
+
+
+def image_sha256(image):
+    if len(image) > 32 and image[IMAGE_HASH_APPENDED] == 1:
+        return image[-32:]
+    return hashlib.sha256(image).digest()
+
+
+def make_patch(base, target):
+    index = {}
+    for offset in range(0, len(base) - BLOCK + 1, BLOCK):
+        index.setdefault(base[offset:offset + BLOCK], offset)
+
+    out = bytearray(MAGIC)
+    out += struct.pack('<I', len(base))
+    out += image_sha256(base)
+    out += struct.pack('<I', len(target))
+
+    pending = bytearray()
+
+    def flush_add():
+        if pending:
+            out.extend(struct.pack('<BI', OP_ADD, len(pending)))
+            out.extend(pending)
+            pending.clear()
+
+    i = 0
+    while i < len(target):
+        match = index.get(target[i:i + BLOCK])
+        if match is None:
+            pending.append(target[i])
+            i += 1
+            continue
+
+        # Grow the match backwards into bytes we were about to ADD, then forwards
+        start, base_start = i, match
+        while start > 0 and base_start > 0 and pending and target[start - 1] == base[base_start - 1]:
+            start -= 1
+            base_start -= 1
+            pending.pop()
+        end = i + BLOCK
+        base_end = match + BLOCK
+        while end < len(target) and base_end < len(base) and target[end] == base[base_end]:
+            end += 1
+            base_end += 1
+
+        if end - start < MIN_COPY:
+            pending.extend(target[start:i + 1])
+            i += 1
+            continue
+        flush_add()
+        out += struct.pack('<BII', OP_COPY, base_start, end - start)
+        i = end
+
+    flush_add()
+    out.append(OP_END)
+    return bytes(out)
+
+
+def apply_patch(base, patch):
+    if patch[:4] != MAGIC:
+        raise ValueError('not a SimpleIOT delta patch')
+    base_size, = struct.unpack_from('<I', patch, 4)
+    if patch[8:40] != image_sha256(base) or base_size != len(base):
+        raise ValueError('patch was made from a different base image')
+    target_size, = struct.unpack_from('<I', patch, 40)
+
+    out = bytearray()
+    pos = 44
+    while True:
+        op = patch[pos]
+        pos += 1
+        if op == OP_END:
+            break
+        if op == OP_COPY:
+            offset, length = struct.unpack_from('<II', patch, pos)
+            pos += 8
+            out += base[offset:offset + length]
+        elif op == OP_ADD:
+            length, = struct.unpack_from('<I', patch, pos)
+            pos += 4
+            out += patch[pos:pos + length]
+            pos += length
+        else:
+            raise ValueError('bad op %d at %d' % (op, pos - 1))
+    if len(out) != target_size:
+        raise ValueError('patch produced %d bytes, expected %d' % (len(out), target_size))
+    return bytes(out)
+
+
+def read(name):
+    with open(name, 'rb') as f:
+        return f.read()
+
+
+def main(argv):
+    if len(argv) != 5 or argv[1] not in ('make', 'verify'):
+        print('Usage: %s make|verify base.bin target.bin patch.bin' % argv[0])
+        return 1
+
+    base = read(argv[2])
+    target = read(argv[3])
+    if argv[1] == 'make':
+        patch = make_patch(base, target)
+        with open(argv[4], 'wb') as f:
+            f.write(patch)
+        print('Patch: %d bytes for a %d byte image (%.1f%%)' % (len(patch), len(target), 100.0 * len(patch) / len(target)))
+    else:
+        patch = read(argv[4])
+
+    if apply_patch(base, patch) != target:
+        print('ERROR: patch does not rebuild the target image')
+        return 1
+    print('OK: patch rebuilds the target, md5 %s' % hashlib.md5(target).hexdigest())
+    print('sha256 %s' % hashlib.sha256(target).hexdigest())
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,622 @@
+#!/usr/bin/python3
+#
+# © 2022 Amazon Web Services, Inc. or its affiliates. All Rights Reserved.
+#
+# Test server for resumable SimpleIOT OTA downloads.
+#
+# Serves a firmware image with Range and If-Range support and cuts connections off at random
+# offsets, the way a weak WiFi link does. Point a device at it with an update message to watch
+# performOTA() pick up where it left off, or run the self test.
+#
+# The self test runs the server locally against a model of the device side of performOTA():
+# the same requests as _otaDownload(), the resume point saved every OTA_RESUME_SAVE_BYTES, the
+# hash state kept with it, and reboots that lose whatever hadn't been saved. The flash is
+# modelled as NOR flash (a write can only clear bits, an erase sets a sector back to 0xFF)
+# with the sector rounding in SimpleIOTOTAFlash::begin(), so bytes written past the saved
+# point before a reboot are written over again on resume. Every download has to come out
+# byte for byte the same as the image the server finished sending.
+#
+# The bench times downloads from the server over a link capped at a given speed, reading the
+# way the old performOTA() loop did (128 bytes at a time, 1 ms delay, each piece written to
+# flash before the next read) and the way SimpleIOTOTAWriter does (large buffers, one filling
+# while the writer task flashes the other). Flash writes take the time they would at the
+# given flash speed. Real numbers come from otaKBps() on the device, also against "serve".
+#
+# Constants below must match src/SimpleIOT.cpp and src/SimpleIOTOTA.h.
+#
+
+'''
+# Examples:
+> python simpleiot_ota_server.py selftest
+> python simpleiot_ota_server.py selftest --runs 50 --seed 7
+> python simpleiot_ota_server.py serve firmware.bin --port 8443 --cert server.crt --key server.key --drop 0.3
+> python simpleiot_ota_server.py serve firmware.bin --next firmware-b.bin --change-after 3
+> python simpleiot_ota_server.py bench --link-kbps 800 --flash-kbps 400
+> python simpleiot_ota_server.py serve firmware.bin --drop 0 --link-kbps 500
+'''
+
+import sys, argparse, hashlib, queue, random, socket, socketserver, ssl, struct, threading, time
+
+SAVE_BYTES = 65536          # OTA_RESUME_SAVE_BYTES
+RETRIES = 5                 # OTA_RESUME_RETRIES
+SECTOR = 4096               # SIMPLEIOT_OTA_SECTOR_SIZE
+BUFFER = 8192               # SIMPLEIOT_OTA_BUFFER_SIZE
+PARTITION = 0x180000        # a default 1.5 MB app partition
+MAX_CALLS = 200             # performOTA calls before a self test run gives up
+TCP_WINDOW = 5744           # lwIP receive window in the ESP32 Arduino core
+
+
+# Server
+#
+
+class Site:
+    def __init__(self, image, drop=0.0, seed=None, next_image=None, change_after=0,
+                 ranges=True, length=True, verbose=False, rate=0):
+        self.images = [image] + ([next_image] if next_image else [])
+        self.current = 0
+        self.drop = drop
+        self.rng = random.Random(seed)
+        self.change_after = change_after
+        self.ranges = ranges
+        self.length = length
+        self.verbose = verbose
+        self.rate = rate            # link speed cap in KB/s, 0 for none
+        self.requests = 0
+        self.log = []
+        self.lock = threading.Lock()
+
+    def image(self):
+        return self.images[self.current]
+
+    def etag(self):
+        return '"%s"' % hashlib.md5(self.image()).hexdigest()
+
+    def next_request(self):
+        with self.lock:
+            self.requests += 1
+            if self.change_after and self.requests > self.change_after and self.current + 1 < len(self.images):
+                self.current += 1
+            # Where to cut this response off: None for not at all, -1 for before the headers
+            cut = None
+            if self.rng.random() < self.drop:
+                cut = -1 if self.rng.random() < 0.1 else self.rng.random()
+            return self.image(), self.etag(), cut, self.rng.random() < 0.5
+
+
+class Handler(socketserver.StreamRequestHandler):
+    def handle(self):
+        site = self.server.site
+        request = self.rfile.readline().decode('latin-1').split()
+        headers = {}
+        while True:
+            line = self.rfile.readline().decode('latin-1').strip()
+            if not line:
+                break
+            name, _, value = line.partition(':')
+            headers[name.strip().lower()] = value.strip()
+        if len(request) < 2 or request[0] != 'GET':
+            self.wfile.write(b'HTTP/1.0 405 Method Not Allowed\r\n\r\n')
+            return
+
+        image, etag, cut, reset = site.next_request()
+        start = 0
+        status = 200
+        wanted = headers.get('range', '')
+        if_range = headers.get('if-range')
+        if site.ranges and wanted.startswith('bytes=') and wanted.endswith('-') and (if_range is None or if_range == etag):
+            start = int(wanted[6:-1])
+            status = 206
+            if start >= len(image):
+                self.wfile.write(b'HTTP/1.0 416 Range Not Satisfiable\r\n\r\n')
+                self.record(wanted, if_range, 416, 0, None)
+                return
+
+        body = image[start:]
+        out = ['HTTP/1.0 %d %s' % (status, 'OK' if status == 200 else 'Partial Content'),
+               'ETag: %s' % etag, 'Accept-Ranges: bytes', 'Connection: close']
+        if status == 206:
+            out.append('Content-Range: bytes %d-%d/%d' % (start, len(image) - 1, len(image)))
+        if site.length:
+            out.append('Content-Length: %d' % len(body))
+        head = ('\r\n'.join(out) + '\r\n\r\n').encode('latin-1')
+
+        started = time.monotonic()
+        if cut == -1:
+            sent = 0
+            self.wfile.write(head[:len(head) // 2])
+        else:
+            sent = len(body) if cut is None else int(len(body) * cut)
+            try:
+                self.wfile.write(head)
+                self.send(body[:sent])
+                self.wfile.flush()
+            except OSError:
+                pass
+        if cut is not None and reset:
+            # Close with a RST instead of a FIN, like an access point that has gone away
+            self.connection.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack('ii', 1, 0))
+        self.record(wanted, if_range, status, sent, cut, time.monotonic() - started)
+
+    def send(self, data):
+        rate = self.server.site.rate
+        if not rate:
+            self.wfile.write(data)
+            return
+        # Keep only about a TCP window queued (Linux doubles the size), and don't catch up
+        # after the reader has stalled, or the link would run faster than its cap
+        self.connection.setsockopt(socket.SOL_SOCKET, socket.SO_SNDBUF, TCP_WINDOW // 2)
+        for offset in range(0, len(data), 4096):
+            started = time.monotonic()
+            self.wfile.write(data[offset:offset + 4096])
+            self.wfile.flush()
+            left = 4096 / (rate * 1024.0) - (time.monotonic() - started)
+            if left > 0:
+                time.sleep(left)
+
+    def record(self, wanted, if_range, status, sent, cut, seconds=0.0):
+        site = self.server.site
+        entry = (wanted or None, if_range, status, sent, cut)
+        with site.lock:
+            site.log.append(entry)
+        if site.verbose:
+            print('%s %s range=%s if-range=%s -> %d, sent %d in %.1f s (%.0f KB/s)%s' %
+                  (self.client_address[0], site.etag(), wanted or '-', if_range or '-', status, sent, seconds,
+                   sent / 1024.0 / seconds if seconds > 0 else 0,
+                   '' if cut is None else (', cut before headers' if cut == -1 else ', cut off')))
+
+
+class Server(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+    def __init__(self, site, port=0, context=None):
+        socketserver.ThreadingTCPServer.__init__(self, ('', port), Handler)
+        self.site = site
+        self.context = context
+
+    def get_request(self):
+        sock, address = socketserver.ThreadingTCPServer.get_request(self)
+        if self.context:
+            sock = self.context.wrap_socket(sock, server_side=True)
+        return sock, address
+
+
+# Device model
+#
+
+class Reboot(Exception):
+    pass
+
+
+class Flash:
+    '''SimpleIOTOTAFlash on NOR flash'''
+
+    def __init__(self, memory):
+        self.memory = memory
+        self.started = False
+
+    def begin(self, offset):
+        self.offset = offset
+        self.erased_to = (offset + SECTOR - 1) // SECTOR * SECTOR
+        self.started = True
+
+    def write(self, data):
+        end = self.offset + len(data)
+        if end > len(self.memory):
+            raise ValueError('image is bigger than the partition')
+        while self.erased_to < end:
+            self.memory[self.erased_to:self.erased_to + SECTOR] = b'\xff' * SECTOR
+            self.erased_to += SECTOR
+        old = int.from_bytes(self.memory[self.offset:end], 'big')
+        self.memory[self.offset:end] = (old & int.from_bytes(data, 'big')).to_bytes(len(data), 'big')
+        self.offset = end
+
+
+class Device:
+    def __init__(self, port, sha256, rng, reboot=0.0):
+        self.port = port
+        self.expected = sha256      # from the update message
+        self.rng = rng
+        self.reboot = reboot
+        self.memory = bytearray(b'\xff' * PARTITION)
+        self.nvs = None             # the saved resume point, kept over reboots
+        self.wire = 0               # body bytes received
+        self.reboots = 0
+        self.rejected = 0           # downloads that failed the hash check
+        self.ranges = []            # (If-Range, Range start, MD5 of the flash before it)
+
+    def perform(self):
+        '''One performOTA() call. Returns the image, or None if the download didn't finish.'''
+
+        self.flash = Flash(self.memory)
+        if self.nvs and 0 < self.nvs['offset'] < self.nvs['total']:
+            self.resume = self.copy(self.nvs)
+            self.received = self.saved = self.resume['offset']
+        else:
+            self.resume = {'etag': '', 'total': 0, 'offset': 0, 'md5': None, 'sha256': None}
+            self.received = self.saved = 0
+        try:
+            for attempt in range(RETRIES + 1):
+                ret = self.download()
+                if ret <= 0:
+                    break
+        except Reboot:
+            self.reboots += 1
+            return None
+        if ret != 0:
+            return None
+        self.nvs = None
+        length = self.received
+        image = bytes(self.memory[:length])
+        if self.md5.hexdigest() != hashlib.md5(image).hexdigest() or \
+           self.sha256.hexdigest() != hashlib.sha256(image).hexdigest():
+            raise AssertionError('hashed stream and flash disagree at %d bytes' % length)
+        if self.sha256.hexdigest() != self.expected:
+            self.rejected += 1
+            return None
+        return image
+
+    def download(self):
+        '''_otaDownload(): 0 done, 1 cut off and can be resumed, -1 failed'''
+
+        resume = self.resume
+        resuming = resume['offset'] > 0 and resume['etag'] != ''
+        request = 'GET /firmware.bin HTTP/1.0\r\nHost: localhost\r\n'
+        if resuming:
+            request += 'Range: bytes=%d-\r\nIf-Range: %s\r\n' % (resume['offset'], resume['etag'])
+            self.ranges.append((resume['etag'], resume['offset'], hashlib.md5(self.memory[:resume['offset']]).digest()))
+        sock = socket.create_connection(('127.0.0.1', self.port))
+        try:
+            sock.sendall((request + '\r\n').encode('latin-1'))
+            status, headers, body = self.read_head(sock)
+            if status is None:
+                return 1
+            if status != 200 and not (resuming and status == 206):
+                return -1
+            length = int(headers.get('content-length', -1))
+
+            if status == 206:
+                if not self.flash.started:
+                    self.flash.begin(resume['offset'])
+                    self.md5, self.sha256 = resume['md5'].copy(), resume['sha256'].copy()
+            else:
+                self.flash.begin(0)
+                self.md5, self.sha256 = hashlib.md5(), hashlib.sha256()
+                resume.update(etag=headers.get('etag', ''), total=max(length, 0), offset=0)
+                self.received = self.saved = 0
+
+            # Power can go at any point. The buffer that hasn't reached the writer is lost.
+            reboot_at = None
+            if self.rng.random() < self.reboot:
+                reboot_at = self.rng.randrange(1, max(length, SAVE_BYTES) + 1)
+
+            buffer = bytearray()
+            got = 0
+            while length != 0:
+                if not body:
+                    try:
+                        body = sock.recv(4096)
+                    except ConnectionResetError:
+                        break
+                    if not body:
+                        break
+                if length > 0:
+                    body = body[:length]
+                    length -= len(body)
+                self.wire += len(body)
+                got += len(body)
+                buffer += body
+                body = b''
+                if reboot_at is not None and got >= reboot_at:
+                    raise Reboot()
+                while len(buffer) >= BUFFER:
+                    self.sink(bytes(buffer[:BUFFER]))
+                    del buffer[:BUFFER]
+            if buffer:
+                self.sink(bytes(buffer))
+        finally:
+            sock.close()
+
+        if self.received == resume['total'] and resume['total'] > 0:
+            return 0
+        if resume['total'] == 0 and self.received > 0:
+            return 0
+        self.save()
+        return 1 if resume['total'] > 0 and resume['etag'] else -1
+
+    def read_head(self, sock):
+        data = b''
+        while b'\r\n\r\n' not in data:
+            try:
+                chunk = sock.recv(4096)
+            except ConnectionResetError:
+                chunk = b''
+            if not chunk:
+                return None, None, None
+            data += chunk
+        head, _, body = data.partition(b'\r\n\r\n')
+        lines = head.decode('latin-1').split('\r\n')
+        headers = {}
+        for line in lines[1:]:
+            name, _, value = line.partition(':')
+            headers[name.strip().lower()] = value.strip()
+        return int(lines[0].split()[1]), headers, body
+
+    def sink(self, data):
+        '''_otaFlashSink()'''
+
+        self.md5.update(data)
+        self.sha256.update(data)
+        self.flash.write(data)
+        self.received += len(data)
+        if self.received - self.saved >= SAVE_BYTES:
+            self.save()
+
+    def save(self):
+        '''_otaResumeSave()'''
+
+        self.resume.update(offset=self.received, md5=self.md5.copy(), sha256=self.sha256.copy())
+        self.saved = self.received
+        if self.resume['etag'] and self.resume['total']:
+            self.nvs = self.copy(self.resume)
+
+    @staticmethod
+    def copy(resume):
+        out = dict(resume)
+        for name in ('md5', 'sha256'):
+            if out[name]:
+                out[name] = out[name].copy()
+        return out
+
+
+# Self test
+#
+
+SCENARIOS = [
+    # name, server options, reboot chance
+    ('clean', {}, 0.0),
+    ('drops', {'drop': 0.6}, 0.0),
+    ('drops and reboots', {'drop': 0.5}, 0.3),
+    ('image changes', {'drop': 0.6, 'change_after': 2}, 0.2),
+    ('no Range support', {'drop': 0.3, 'ranges': False}, 0.1),
+    ('no Content-Length', {'drop': 0.3, 'length': False}, 0.1),
+]
+
+
+def run(name, options, reboot, seed):
+    rng = random.Random(seed)
+    size = rng.randrange(200000, 600000)
+    image = rng.randbytes(size)
+    options = dict(options)
+    if options.get('change_after'):
+        options['next_image'] = rng.randbytes(rng.randrange(200000, 600000))
+    site = Site(image, seed=seed, **options)
+    server = Server(site)
+    threading.Thread(target=server.serve_forever, args=(0.05,), daemon=True).start()
+
+    # With the image changing, the update message is for the new one
+    device = Device(server.server_address[1], hashlib.sha256(site.images[-1]).hexdigest(), rng, reboot)
+
+    try:
+        result = None
+        calls = 0
+        while result is None and calls < MAX_CALLS:
+            calls += 1
+            result = device.perform()
+    except AssertionError as e:
+        return str(e)
+    finally:
+        server.shutdown()
+        server.server_close()
+
+    expected = site.image()
+    if result is None:
+        return 'no complete download in %d calls' % calls
+    if result != expected:
+        return 'image differs from the one served (%d vs %d bytes)' % (len(result), len(expected))
+
+    # Only a download cut off with no length to check it against, or one of an image that has
+    # since been replaced, should fail the hash check
+    if device.rejected and site.length and len(site.images) == 1:
+        return '%d downloads failed the hash check' % device.rejected
+
+    # Whenever a download is resumed, the flash up to that point has to hold the image it was
+    # started from
+    images = dict(('"%s"' % hashlib.md5(image).hexdigest(), image) for image in site.images)
+    for etag, start, flashed in device.ranges:
+        if hashlib.md5(images[etag][:start]).digest() != flashed:
+            return 'flash is wrong before the resume point %d' % start
+
+    # Each reboot can lose up to a save interval plus what was buffered. Without any, nothing
+    # is downloaded twice.
+    if site.ranges and site.length and site.current == 0:
+        waste = device.wire - len(expected)
+        if waste > device.reboots * (SAVE_BYTES + 2 * BUFFER):
+            return '%d bytes downloaded twice with %d reboots' % (waste, device.reboots)
+
+    partial = sum(1 for entry in site.log if entry[2] == 206)
+    return 'OK: %d bytes, %d requests (%d resumed), %d reboots, %d rejected, %.2fx downloaded' % \
+           (len(expected), len(site.log), partial, device.reboots, device.rejected,
+            float(device.wire) / len(expected))
+
+
+def selftest(runs, seed):
+    failed = 0
+    for name, options, reboot in SCENARIOS:
+        for i in range(runs):
+            result = run(name, options, reboot, seed * 1000 + i)
+            if not result.startswith('OK'):
+                failed += 1
+                print('FAIL %s, seed %d: %s' % (name, seed * 1000 + i, result))
+            elif i == runs - 1:
+                print('%-20s %s' % (name, result))
+    if failed:
+        print('ERROR: %d of %d runs failed' % (failed, runs * len(SCENARIOS)))
+        return 1
+    print('OK: %d runs, every download matches the image served' % (runs * len(SCENARIOS)))
+    return 0
+
+
+# Bench
+#
+
+def bench_download(port, read_size, buffers, flash_kbps):
+    '''Download the image with the old loop (buffers 0) or the writer pipeline. Returns seconds.'''
+
+    flash_seconds = lambda length: length / (flash_kbps * 1024.0)
+
+    # The device's TCP window is small (CONFIG_TCP_WND_DEFAULT), so the link stalls while
+    # nobody reads. A host socket would otherwise soak up hundreds of KB. Linux doubles the
+    # size it's given.
+    sock = socket.socket()
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, TCP_WINDOW // 2)
+    sock.connect(('127.0.0.1', port))
+    sock.sendall(b'GET /firmware.bin HTTP/1.0\r\nHost: localhost\r\n\r\n')
+    start = time.monotonic()
+    data = b''
+    while b'\r\n\r\n' not in data:
+        data += sock.recv(4096)
+    head, _, body = data.partition(b'\r\n\r\n')
+    length = int([line.split(b':')[1] for line in head.split(b'\r\n') if line.lower().startswith(b'content-length')][0])
+    remaining = length - len(body)
+
+    if buffers == 0:
+        # Read a little, write it, sleep a millisecond, repeat
+        time.sleep(flash_seconds(len(body)))
+        while remaining > 0:
+            chunk = sock.recv(min(read_size, remaining))
+            if not chunk:
+                break
+            remaining -= len(chunk)
+            time.sleep(flash_seconds(len(chunk)) + 0.001)
+    else:
+        # The writer takes full buffers off a queue, so reading goes on into the others
+        free = queue.Queue()
+        full = queue.Queue()
+        for i in range(buffers):
+            free.put(bytearray(read_size))
+
+        def writer():
+            while True:
+                item = full.get()
+                if item is None:
+                    return
+                buffer, used = item
+                time.sleep(flash_seconds(used))
+                free.put(buffer)
+
+        thread = threading.Thread(target=writer)
+        thread.start()
+        full.put((bytearray(len(body)), len(body)))
+        while remaining > 0:
+            buffer = free.get()
+            view = memoryview(buffer)
+            used = 0
+            while used < len(buffer) and remaining > 0:
+                got = sock.recv_into(view[used:], min(len(buffer) - used, remaining))
+                if not got:
+                    remaining = 0
+                    break
+                used += got
+                remaining -= got
+            full.put((buffer, used))
+        full.put(None)
+        thread.join()
+    sock.close()
+    return time.monotonic() - start
+
+
+BENCH = [
+    # name, read size, buffers
+    ('old loop, 128 B reads', 128, 0),
+    ('16 KB, one buffer', 16384, 1),
+    ('4 KB double-buffered', 4096, 2),
+    ('8 KB double-buffered', 8192, 2),
+    ('16 KB double-buffered', 16384, 2),
+]
+
+
+def bench(args):
+    image = read(args.image) if args.image else random.Random(1).randbytes(args.size * 1024)
+    site = Site(image, rate=args.link_kbps)
+    server = Server(site)
+    threading.Thread(target=server.serve_forever, args=(0.05,), daemon=True).start()
+    print('%d KB image, link %s, flash %d KB/s' % (len(image) // 1024,
+                                                   '%d KB/s' % args.link_kbps if args.link_kbps else 'uncapped',
+                                                   args.flash_kbps))
+    try:
+        for name, read_size, buffers in BENCH:
+            seconds = bench_download(server.server_address[1], read_size, buffers, args.flash_kbps)
+            print('%-24s %6.1f s %6.0f KB/s' % (name, seconds, len(image) / 1024.0 / seconds))
+    finally:
+        server.shutdown()
+        server.server_close()
+    return 0
+
+
+def serve(args):
+    image = read(args.image)
+    site = Site(image, drop=args.drop, seed=args.seed, next_image=read(args.next) if args.next else None,
+                change_after=args.change_after, ranges=not args.no_range, length=not args.no_length,
+                verbose=True, rate=args.link_kbps)
+    context = None
+    if args.cert:
+        context = ssl.create_default_context(ssl.Purpose.CLIENT_AUTH)
+        context.load_cert_chain(args.cert, args.key)
+    server = Server(site, args.port, context)
+    print('Serving %s (%d bytes) on port %d over %s' % (args.image, len(image), args.port,
+                                                        'HTTPS' if context else 'HTTP'))
+    print('md5 %s' % hashlib.md5(image).hexdigest())
+    print('sha256 %s' % hashlib.sha256(image).hexdigest())
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    return 0
+
+
+def read(name):
+    with open(name, 'rb') as f:
+        return f.read()
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(prog=argv[0], description='Test server for resumable OTA downloads')
+    commands = parser.add_subparsers(dest='command')
+
+    test = commands.add_parser('selftest', help='run the server against a model of the device')
+    test.add_argument('--runs', type=int, default=10, help='runs per scenario')
+    test.add_argument('--seed', type=int, default=1)
+
+    server = commands.add_parser('serve', help='serve an image to a device')
+    server.add_argument('image')
+    server.add_argument('--port', type=int, default=8080)
+    server.add_argument('--drop', type=float, default=0.3, help='chance a response is cut off')
+    server.add_argument('--seed', type=int)
+    server.add_argument('--cert', help='serve HTTPS with this certificate chain')
+    server.add_argument('--key')
+    server.add_argument('--next', help='switch to this image after --change-after requests')
+    server.add_argument('--change-after', type=int, default=0)
+    server.add_argument('--no-range', action='store_true', help='ignore Range and always send the whole image')
+    server.add_argument('--no-length', action='store_true', help='leave out Content-Length')
+    server.add_argument('--link-kbps', type=int, default=0, help='cap the link speed in KB/s')
+
+    timing = commands.add_parser('bench', help='time the old download loop against the buffered one')
+    timing.add_argument('image', nargs='?', help='image to download, random bytes if not given')
+    timing.add_argument('--size', type=int, default=512, help='KB of random bytes')
+    timing.add_argument('--link-kbps', type=int, default=800, help='link speed in KB/s, 0 for uncapped')
+    timing.add_argument('--flash-kbps', type=int, default=400, help='flash write speed in KB/s')
+
+    args = parser.parse_args(argv[1:])
+    if args.command == 'bench':
+        return bench(args)
+    if args.command == 'selftest':
+        return selftest(args.runs, args.seed)
+    if args.command == 'serve':
+        return serve(args)
+    parser.print_usage()
+    return 1
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
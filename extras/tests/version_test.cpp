@@ -0,0 +1,86 @@
+/*
+ *  © 2022 Amazon Web Services, Inc. or its affiliates. All Rights Reserved.
+ *
+ *  Host test for SimpleIOTVersion, the semantic version comparison used to gate update
+ *  messages. Build and run from the repository root:
+ *
+ *    g++ -I src -o /tmp/version_test extras/tests/version_test.cpp src/SimpleIOTVersion.cpp
+ *    /tmp/version_test
+ */
+
+#include <stdio.h>
+#include "SimpleIOTVersion.h"
+
+typedef struct {
+  const char* a;
+  const char* b;
+  int expected;             // -1 a is older, 0 same, 1 a is newer
+} VersionCase;
+
+static const VersionCase cases[] = {
+  // Numbers compare numerically, not as text
+  { "1.0.0",              "1.0.0",              0 },
+  { "1.0.0",              "1.0.1",              -1 },
+  { "1.0.10",             "1.0.9",              1 },
+  { "1.10.0",             "1.9.9",              1 },
+  { "2.0.0",              "10.0.0",             -1 },
+
+  // Missing parts are 0, a leading v is ignored
+  { "1.2",                "1.2.0",              0 },
+  { "1",                  "1.0.0",              0 },
+  { "v1.2.3",             "1.2.3",              0 },
+  { "V2.0",               "v1.9.9",             1 },
+
+  // Build metadata doesn't count
+  { "1.0.0+build.5",      "1.0.0+build.9",      0 },
+  { "1.0.0-rc.1+abc",     "1.0.0-rc.1",         0 },
+
+  // The precedence example from the semver spec, in order
+  { "1.0.0-alpha",        "1.0.0-alpha.1",      -1 },
+  { "1.0.0-alpha.1",      "1.0.0-alpha.beta",   -1 },
+  { "1.0.0-alpha.beta",   "1.0.0-beta",         -1 },
+  { "1.0.0-beta",         "1.0.0-beta.2",       -1 },
+  { "1.0.0-beta.2",       "1.0.0-beta.11",      -1 },
+  { "1.0.0-beta.11",      "1.0.0-rc.1",         -1 },
+  { "1.0.0-rc.1",         "1.0.0",              -1 },
+
+  // A pre-release of a later version is still newer than an earlier release
+  { "1.1.0-alpha",        "1.0.0",              1 },
+  { "1.0.0",              "1.0.0-rc.1",         1 },
+
+  // Numeric identifiers sort below alphanumeric ones
+  { "1.0.0-1",            "1.0.0-a",            -1 },
+  { "1.0.0-rc.2",         "1.0.0-rc.a",         -1 },
+
+  // Garbage doesn't crash and doesn't count as newer
+  { "",                   "0.0.0",              0 },
+  { "abc",                "0.0.1",              -1 },
+  { "2022-10",            "2022.0.0",           -1 },
+};
+
+static int sign(int x)
+{
+  return x < 0 ? -1 : (x > 0 ? 1 : 0);
+}
+
+int main()
+{
+  int failed = 0;
+  int count = sizeof(cases) / sizeof(cases[0]);
+
+  for (int i = 0; i < count; i++) {
+    const VersionCase* c = &cases[i];
+
+    // Every case is checked both ways round
+    //
+    int forward = sign(SimpleIOTVersion::compare(c->a, c->b));
+    int backward = sign(SimpleIOTVersion::compare(c->b, c->a));
+    if (forward != c->expected || backward != -c->expected) {
+      printf("FAIL: compare(\"%s\", \"%s\") = %d, reversed %d, expected %d\n",
+             c->a, c->b, forward, backward, c->expected);
+      failed++;
+    }
+  }
+  printf("%d of %d version cases passed\n", count - failed, count);
+  return failed == 0 ? 0 : 1;
+}
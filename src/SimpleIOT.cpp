@@ -5,13 +5,43 @@
  */
  
  #include "SimpleIOT.h"
+ #include "SimpleIOTVersion.h"
+ #include <rom/crc.h>
+ #include <esp_sleep.h>
+ #include <esp_system.h>
+ #include <mbedtls/base64.h>
+ #include <time.h>
 
-SimpleIOT* SimpleIOT::_iot_singleton = NULL;  // Singleton needed for greengrass
+SimpleIOT* SimpleIOT::_iot_singleton = NULL;  // Singleton needed for the C-style callbacks
 
 
 #define DELAY_MS_BEFORE_RESTART    2000
+#define WIFI_CONNECT_TIMEOUT_MS    20000
+#define WIFI_FAST_CONNECT_TIMEOUT_MS 3000
+#define DUTY_CYCLE_ACK_TIMEOUT_MS  5000       // how long a report waits for its PUBACK
+#define DUTY_CYCLE_BATCH_SIZE      4096       // JSON for a report batch, room for a full pending queue
+#define DUTY_CYCLE_MAX_AWAKE_MS    30000
+#define DUTY_CYCLE_MIN_SLEEP_MS    1000
+#define HEARTBEAT_STRETCH          4          // interval multiplier when app data shows we're alive
+#define HEARTBEAT_SHRINK           4          // interval divisor after an error
+#define HEARTBEAT_MIN_MS           10000
+#define IOT_MQTT_PORT              8883
+#define GG_DISCOVERY_PORT          8443
+#define GG_DISCOVERY_PATH          "/greengrass/discover/thing/"
+#define GG_DISCOVERY_DOC_SIZE      8192
+#define GG_HEALTH_CHECK_TIMEOUT_MS 2000
+#define SUBACK_TIMEOUT_MS          10000
+#define LOOP_WIFI_POLL_MS          20         // while waiting on WiFi, check this often
+#define LOOP_PACKET_POLL_MS        10         // same, while waiting on a SUBACK or PUBACK
+#define IDLE_SLICE_MS              10
+#define MQTT_PUBLISH_QOS1          0x32       // packet type 3, flags 0010
+#define MQTT_PUBACK                0x40
+#define MQTT_SUBSCRIBE             0x82       // packet type 8, flags 0010
+#define MQTT_SUBACK                0x90
+#define MQTT_PACKET_ID_BASE        0xF000     // for packets we build ourselves, well away from the ids MqttClient uses
 #define MAXIMUM_JSON_PAYLOAD_SIZE  1024
 #define OP_SET_DATA   "data/set"
+#define OP_SET_BATCH  "data/batch"
 
 #define SIMPLEIOT_APP_TOPIC_PREFIX    "simpleiot_v1/app"
 #define SIMPLEIOT_APP_MONITOR_PREFIX  SIMPLEIOT_APP_TOPIC_PREFIX "/monitor"
@@ -19,20 +49,82 @@ SimpleIOT* SimpleIOT::_iot_singleton = NULL;  // Singleton needed for greengrass
 #define SIMPLEIOT_SYS_TOPIC_PREFIX    "simpleiot_v1/sys"
 #define SIMPLEIOT_DIAG_TOPIC_PREFIX   SIMPLEIOT_SYS_TOPIC_PREFIX "/diag"
 #define UPDATE_TOPIC_PREFIX  "simpleiot_v1/adm/update"
+#define SIMPLEIOT_ADM_CMD_PREFIX      SIMPLEIOT_ADM_TOPIC_PREFIX "/cmd"
+#define OP_DIAG_RESULT                "diag/result"
+#define OP_DUTY_CYCLE                 "dutycycle"
+#define OP_HEARTBEAT                  "heartbeat"
+#define OP_CONNECT_REPORT             "connect"
+#define RTT_PROBE_SUFFIX              "rtt"
+
+#define SIMPLEIOT_NVS_NAMESPACE       "simpleiot"
+#define SIMPLEIOT_NVS_STATE_KEY       "state"
+#define SIMPLEIOT_STATE_MAGIC         0x544F4953     // "SIOT"
+#define SIMPLEIOT_NVS_WIFI_KEY        "wifi"
+#define SIMPLEIOT_WIFI_MAGIC          0x49464957     // "WIFI"
+#define SIMPLEIOT_NVS_GG_KEY          "ggcore"
+#define SIMPLEIOT_GG_MAGIC            0x45524F43     // "CORE"
+#define SIMPLEIOT_NVS_OTA_KEY         "otaresume"
+#define SIMPLEIOT_OTA_MAGIC           0x4D555352     // "RSUM"
+#define SIMPLEIOT_NVS_PENDING_KEY     "otapending"
+#define SIMPLEIOT_PENDING_MAGIC       0x444E4550     // "PEND"
+#define OTA_RESUME_SAVE_BYTES      65536      // how often the resume point is written to NVS
+#define OTA_RESUME_RETRIES         5          // reconnects within one performOTA call
+#define OTA_RETRY_DELAY_MS         2000
+#define OTA_TASK_STACK             10240      // room for a TLS handshake
+#define OTA_PROGRESS_POLL_MS       250        // how often loop() checks on a background OTA
+#define OTA_CONFIRM_RETRY_MS       1000       // between confirm heartbeats that couldn't be sent
+
+// Last good WiFi connection, used to skip the scan (and optionally DHCP) on the next one.
+// Kept in RTC memory so it survives deep sleep, and mirrored in NVS for cold boots.
+//
+typedef struct {
+  uint32_t magic;
+  uint32_t ssidCrc;       // so we don't use settings from a different network
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint8_t reserved;
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+} SimpleIOTWiFiCache;
+
+RTC_DATA_ATTR static SimpleIOTWiFiCache _wifiCache;
+
+// Duty-cycle bookkeeping and the state snapshot carried across deep sleep
+//
+RTC_DATA_ATTR static unsigned long _rtcWakeCount;
+RTC_DATA_ATTR static unsigned long _rtcRadioOnMs;
+RTC_DATA_ATTR static size_t _rtcStateLength;
+RTC_DATA_ATTR static uint8_t _rtcState[SIMPLEIOT_RTC_STATE_SIZE];
 
 ///////////////////////////////////////////////////////////////
 
-int SimpleIOT::_publish(char* topic, char* payload)
+// Returns 0 if the message went out, -1 if it couldn't be sent. If sentUs is given, it gets
+// the micros() value just before the first byte is written.
+//
+int SimpleIOT::_publish(char* topic, char* payload, unsigned long* sentUs)
 {
-  if (this->_withGateway) {
-      Serial.println("Publishing via GG");
-      this->_greengrass->publish(topic, payload);
-  } else {
-      Serial.println("Publishing via direct MQTT");
-      this->_mqttClient->beginMessage(topic);
-      this->_mqttClient->print(payload);
-      this->_mqttClient->endMessage();
+  bool sent;
+
+  #ifdef _DEBUG
+    Serial.println(this->_withGateway ? "Publishing via GG" : "Publishing via direct MQTT");
+  #endif
+  if (sentUs) {
+    *sentUs = micros();
   }
+  sent = this->_mqttClient->beginMessage(topic);
+  if (sent) {
+    this->_mqttClient->print(payload);
+    sent = this->_mqttClient->endMessage();
+  }
+
+  if (!sent) {
+    this->_publishFailCount++;
+    this->_errorSinceHeartbeat = true;
+    return -1;
+  }
+  this->_publishCount++;
   return 0;
 }
 
@@ -134,26 +226,55 @@ DynamicJsonDocument root(SimpleIOTInternalBufferSize);
 }
 
 
-/* This is the static callback passed on to the MQTT Client. We've already assigned us to the
- *  client instance reference. We use that to pass back the data returned back to us by the
- *  MQTT client and unmarshall the data.
- */
+// Called from inside MqttClient::poll(), so all incoming messages, direct or through a
+// Greengrass core, are dispatched from loop().
+//
 void _mqttSubCallback(int messageSize)
 {
   char buffer[SimpleIOTInternalBufferSize+1];
+  size_t length = 0;
 
   MqttClient* client = SimpleIOT::getClient();
   String topic = client->messageTopic();
 
-  if (client->available()) {
-      client->read((uint8_t *) &buffer, (size_t) sizeof(buffer));
-      SimpleIOT::getImpl()->_invokeCallback((const char *) topic.c_str(),
-                                            (const char *) buffer,
-                                            (const unsigned int) strlen(buffer));
+  // A truncated JSON message is no use to anyone, so drop ones that don't fit
+  //
+  if (messageSize > (int) SimpleIOTInternalBufferSize) {
+    Serial.printf("SimpleIOT: Dropping %d byte message on %s, too big\n", messageSize, topic.c_str());
+    while (client->available()) {
+      client->read();
+    }
+    return;
+  }
+
+  while (client->available() && length < SimpleIOTInternalBufferSize) {
+    int count = client->read((uint8_t *) buffer + length, SimpleIOTInternalBufferSize - length);
+    if (count <= 0) {
+      break;
+    }
+    length += count;
+  }
+  buffer[length] = '\0';
+
+  if (length > 0) {
+    SimpleIOT::getImpl()->_invokeCallback((const char *) topic.c_str(),
+                                          (const char *) buffer,
+                                          (const unsigned int) length);
   }
 }
 
 
+// WiFi events arrive on the WiFi event task. We only use them to timestamp association and
+// DHCP for the connect profile.
+//
+void _wifiEventCallback(WiFiEvent_t event)
+{
+  SimpleIOT* iot = SimpleIOT::getImpl();
+  if (iot) {
+    iot->_wifiEvent(event);
+  }
+}
+
 //////////////////////////////////////////////////////////////////////////
 
 SimpleIOT* SimpleIOT::create(const char* wifiSSID,
@@ -179,6 +300,111 @@ SimpleIOT::SimpleIOT(const char* wifiSSID, const char* wifiPassword, const char*
 {
 //  Serial.println("SimpleIOT Constructor");
   this->_ready = false;
+  this->_connState = IOT_CONN_IDLE;
+  this->_phaseStartMs = 0;
+  memset(this->_phaseMs, 0, sizeof(this->_phaseMs));
+  memset(this->_phaseUs, 0, sizeof(this->_phaseUs));
+  this->_subscribeStartUs = 0;
+  this->_rttSeq = 0;
+  this->_rttSentUs = 0;
+  this->_rttUs = 0;
+  this->_rttCount = 0;
+  this->_wifiBeginUs = 0;
+  this->_wifiAssocUs = 0;
+  this->_wifiGotIpUs = 0;
+  this->_subscribeCount = 0;
+  this->_subscribeIndex = 0;
+  this->_subscribedCount = 0;
+  this->_persistentSession = false;
+  this->_sessionResumed = false;
+  this->_packetId = 0;
+  this->_subackId = 0;
+  this->_subackLast = 0;
+  this->_subackStartMs = 0;
+  this->_rxHeaderLength = 0;
+  this->_rxLength = 0;
+  this->_rxGot = 0;
+  this->_rxBody = NULL;
+  this->_children = NULL;
+  this->_childCount = 0;
+  this->_childQueue = NULL;
+  this->_childQueueCount = 0;
+  this->_childQueueStartMs = 0;
+  this->_childBatchMs = SIMPLEIOT_CHILD_BATCH_MS;
+  this->_loopDeadlineMs = 0;
+  this->_otaBufferSize = SIMPLEIOT_OTA_BUFFER_SIZE;
+  this->_otaKBps = 0;
+  this->_otaDownloadMs = 0;
+  this->_otaWriteMs = 0;
+  this->_otaVerifyMs = 0;
+  this->_otaGzip = false;
+  this->_otaDeltaBase[0] = '\0';
+  this->_otaVersion[0] = '\0';
+  this->_otaRequest.signatureLength = 0;
+  this->_otaRequest.key = NULL;
+  this->_otaPath[0] = '\0';
+  this->_otaFileType = UPDATE_FILE;
+  this->_fileUpdateCallback = NULL;
+  memset(&this->_otaPending, 0, sizeof(this->_otaPending));
+  this->_otaProbation = false;
+  this->_otaRollbackReport = false;
+  this->_otaConfirmTimeoutMs = SIMPLEIOT_OTA_CONFIRM_SECS * 1000UL;
+  this->_otaConfirmFailed = false;
+  this->_otaConfirmTriedMs = 0;
+  this->_otaState = IOT_OTA_IDLE;
+  this->_otaAsync = false;
+  this->_otaReported = false;
+  this->_otaDoneCallback = NULL;
+  this->_otaTask = NULL;
+  this->_otaTaskCore = SIMPLEIOT_OTA_TASK_CORE;
+  this->_otaTaskPriority = SIMPLEIOT_OTA_TASK_PRIORITY;
+  this->_otaMaxKBps = 0;
+  this->_otaProgressCallback = NULL;
+  this->_otaProgressIntervalMs = SIMPLEIOT_OTA_PROGRESS_MS;
+  this->_otaLastProgressMs = 0;
+  this->_otaStartMs = 0;
+  this->_otaStartBytes = 0;
+  this->_otaMd5[0] = '\0';
+  this->_otaSha256[0] = '\0';
+  this->_otaSignatureLength = 0;
+  mbedtls_pk_init(&this->_otaSigningKey);
+  this->_haveOtaSigningKey = false;
+  this->_heartbeatIntervalMs = 0;
+  this->_lastHeartbeatMs = 0;
+  this->_lastAppPublishMs = 0;
+  this->_publishCount = 0;
+  this->_publishFailCount = 0;
+  this->_errorSinceHeartbeat = false;
+  this->_retryCount = 0;
+  this->_retryDelayMs = 0;
+  this->_reconnectCount = 0;
+  this->_tlsResume = true;
+  this->_tlsResumeRtc = false;
+  this->_wifiFastConnect = true;
+  this->_wifiReuseLease = false;
+  this->_wifiFastAttempt = false;
+  this->_wifiBeginMs = 0;
+  this->_radioOnStartMs = 0;
+  this->_dutyIntervalSecs = 0;
+  this->_dutySamplesPerReport = 1;
+  this->_dutySampleCallback = NULL;
+  this->_dutyReported = false;
+  this->_pubackId = 0;
+  this->_pubackCount = 0;
+  this->_pubackStartMs = 0;
+  this->_haveDerCredentials = false;
+  this->_wifiClient = NULL;
+  this->_mqttClient = NULL;
+  this->_ggCore = NULL;
+  this->_ggCoreValid = false;
+  this->_ggFailures = 0;
+  this->_discoveryHandler = NULL;
+  this->_path = withGateway ? IOT_PATH_GATEWAY : IOT_PATH_DIRECT;
+  this->_failover = false;
+  this->_failbackCheckMs = 0;
+  this->_lastFailbackCheckMs = 0;
+  memset(this->_pathMs, 0, sizeof(this->_pathMs));
+  this->_pathReadyMs = 0;
   this->_withGateway = withGateway;
   this->_wifiSsid = (char *) wifiSSID;
   this->_wifiPassword = (char *) wifiPassword;
@@ -186,13 +412,20 @@ SimpleIOT::SimpleIOT(const char* wifiSSID, const char* wifiPassword, const char*
   this->_certPem = (char *) certPem;
   this->_keyPem = (char *) keyPem;
   this->_iotEndpoint = (char *) iotEndpoint;
+  this->_attributeCount = 0;
+  this->_pendingHead = 0;
+  this->_pendingCount = 0;
+  this->_pendingSaved = false;
 }
 
 
 SimpleIOT::~SimpleIOT()
 {
+  delete[] this->_children;
+  delete[] this->_childQueue;
+  mbedtls_pk_free(&this->_otaSigningKey);
   if (this->_withGateway) {
-      delete this->_greengrass;
+      delete this->_ggCore;
   } else {
       delete this->_iot_singleton;
   }
@@ -227,424 +460,3307 @@ void SimpleIOT::config(const char* project, const char* model, const char* seria
   snprintf(this->_triggerUpdateTopicBuffer, INTERNAL_TOPIC_BUFFER_SIZE, 
                 "%.25s/%.25s/%.25s/%.25s", UPDATE_TOPIC_PREFIX, project, model, serialNumber);
 
+  snprintf(this->_diagTopicBuffer, INTERNAL_TOPIC_BUFFER_SIZE, 
+                "%.25s/%.25s/%.25s/%.25s/#", SIMPLEIOT_DIAG_TOPIC_PREFIX, project, model, serialNumber);
+  snprintf(this->_adminTopicBuffer, INTERNAL_TOPIC_BUFFER_SIZE, 
+                "%.25s/%.25s/%.25s/%.25s", SIMPLEIOT_ADM_CMD_PREFIX, project, model, serialNumber);
+
+  snprintf(this->_fleetUpdateTopicBuffer, INTERNAL_TOPIC_BUFFER_SIZE, 
+                "%.25s/%.25s/%.25s", UPDATE_TOPIC_PREFIX, project, model);
+
   this->_triggerUpdateTopic = this->_triggerUpdateTopicBuffer;
   this->_monitorTopic = this->_monitorTopicBuffer;
+  this->_diagTopic = this->_diagTopicBuffer;
+  this->_adminTopic = this->_adminTopicBuffer;
 
-  char thingName[INTERNAL_STATIC_BUFFER_SIZE + 1];
-  snprintf(thingName, INTERNAL_STATIC_BUFFER_SIZE, "%.25s-%.25s", model, serialNumber);
-  this->_clientId = thingName;
+  // Bring back the last saved attribute values and anything that was queued but not sent,
+  // so the app has its last-known values before the network is even up.
+  //
+  this->_restoreState();
 
-  Serial.println("SimpleIOT: Starting WiFi");
-  WiFi.mode(WIFI_STA);
-  WiFi.begin(this->_wifiSsid, this->_wifiPassword);
+  // If we were just updated, or just rolled back from an update, pick that up before the
+  // duty-cycle code has a chance to put us back to sleep.
+  //
+  this->_otaCheckPending();
 
-  Serial.print("SimpleIOT: Connecting to Wi-Fi: ");
-  Serial.println(this->_wifiSsid);
+  // In duty-cycle mode, take this wake's sample. If this isn't a report wake, we go right
+  // back to sleep from in here and never bring the radio up.
+  //
+  if (this->_dutyIntervalSecs > 0) {
+    this->_dutyCycleWake();
+  }
 
-  while (WiFi.status() != WL_CONNECTED){
-    delay(500);
-    Serial.print(".");
+  snprintf(this->_clientIdBuffer, INTERNAL_STATIC_BUFFER_SIZE, "%.25s-%.25s", model, serialNumber);
+  this->_clientId = this->_clientIdBuffer;
+
+  // If a return handler is specified, we subscribe to the monitor topic.
+  //
+  // If there's an onTriggerUpdate handler, we subscribe to it. It gets invoked when there's an 'update'
+  // push message coming from the cloud. This can either be done Live when a device is connected to IOT or as
+  // a response to a 'update' message with a 'check' op, sent to the server with the current device Serial and Firmware 
+  // version. If there is an update, the response will be a doupdate message with information on the payload.
+  // Updates announced to the whole model come in on a second topic, and the SDK drops the ones that
+  // aren't for us before the app hears about them.
+  //
+  // Diagnostic and admin requests are always subscribed since some of them (state save/restore)
+  // are handled inside the SDK, whether or not the app has provided a handler.
+  //
+  this->_subscribeCount = 0;
+  if (onData) {
+    this->_subscribeTopics[this->_subscribeCount++] = this->_monitorTopic;
+  }
+  if (onTriggerUpdate || this->_fileUpdateCallback) {
+    this->_subscribeTopics[this->_subscribeCount++] = this->_triggerUpdateTopic;
+    this->_subscribeTopics[this->_subscribeCount++] = this->_fleetUpdateTopicBuffer;
   }
+  this->_subscribeTopics[this->_subscribeCount++] = this->_diagTopic;
+  this->_subscribeTopics[this->_subscribeCount++] = this->_adminTopic;
 
   // Configure WiFiClientSecure for IoT
   //
   Serial.println("SimpleIOT: Configuring WiFi for secure access");
-  this->_wifiClient = new WiFiClientSecure();
-  this->_wifiClient->setCACert(this->_caPem);
-  this->_wifiClient->setCertificate(this->_certPem);
-  this->_wifiClient->setPrivateKey(this->_keyPem);
+  if (!this->_haveDerCredentials) {
+    this->_credentials.setPem(this->_caPem, this->_certPem, this->_keyPem);
+  }
+  this->_wifiClient = new SimpleIOTSecureClient();
+  this->_wifiClient->setCredentials(&this->_credentials);
+  this->_wifiClient->setSessionResumption(this->_tlsResume, this->_tlsResumeRtc);
 
   if (this->_withGateway) {
-        Serial.println("SimpleIOTGW: Creating Greengrass client");
-  
+    // The core's certificate is signed by the group CA from discovery, not the Amazon root,
+    // so the IOT connection is checked against that. If we have the core from a previous
+    // boot we go straight to it.
+    //
     // NOTE: assume registered Thing Name is the same as the serial number for the device.
     // Otherwise GG discovery will not work.
-  
-    this->_greengrass = new AWSGreenGrassIoT(this->_iotEndpoint, this->_serialNumber, 
-                                             this->_caPem, this->_certPem, this->_keyPem);
-    
-    Serial.println("SimpleIOTGW: Connecting to GG Core");
-  
-    while (!this->_greengrass->connectToGG()) {
-      Serial.print(".");
-      delay(200);
-    }
-  
-    if(!this->_greengrass->isConnected()){
-      Serial.println("SimpleIOTGW: TIMEOUT ERROR");
-      return;
-    }
-  } else {
     //
-    // Regular MQTT client
-    //
-    Serial.println("SimpleIOT: Creating MQTT client");
-
-    this->_mqttClient = new MqttClient(*(this->_wifiClient));
-    
-    // Connect to MQTT endpoint on AWS - NOTE: we should make the port configurable.
-    //
-    Serial.print("SimpleIOT: Connecting to AWS IOT at endpoint: ");
-    Serial.println(this->_iotEndpoint);
-
-    if (!(this->_mqttClient->connect(this->_iotEndpoint, 8883))) {
-        Serial.print("ERROR Connecting to MQTT endpoint. Halting: ");
-        Serial.println(this->_mqttClient->connectError());
-        while (1);
-    }
-
-  Serial.println("SimpleIOT: Connected to AWS IOT.");
-
-    this->_mqttClient->onMessage(_mqttSubCallback);
-
-
-    if(!this->_mqttClient->connected()){
-      Serial.println("SimpleIOT: TIMEOUT ERROR");
-      return;
-    }
-  }
-
-  // If a return handler is specified, we subscribe to the monitor topic
-  //
-  if (onData) {
-    Serial.println("SimpleIOT: Subscribing to Monitor Topic: " + String(this->_monitorTopic));
-    this->_mqttClient->subscribe(this->_monitorTopic);
+    Serial.println("SimpleIOTGW: Setting up Greengrass connection");
+    this->_ggCore = new SimpleIOTGGCore();
+    this->_ggCoreValid = this->_loadGatewayCache();
+    this->_setPath(IOT_PATH_GATEWAY);
   }
 
-  // If there's an onTriggerUpdate handler, we subscribe to it. It gets invoked when there's an 'update'
-  // push message coming from the cloud. This can either be done Live when a device is connected to IOT or as
-  // a response to a 'update' message with a 'check' op, sent to the server with the current device Serial and Firmware 
-  // version. If there is an update, the response will be a doupdate message with information on the payload.
-  //
-  if (onTriggerUpdate) {
-    Serial.println("SimpleIOT: Subscribing to MQTT Trigger Update Topic: " + String(this->_triggerUpdateTopic));
-    this->_mqttClient->subscribe(this->_triggerUpdateTopic);
-    
+  Serial.println("SimpleIOT: Creating MQTT client");
+  this->_mqttClient = new MqttClient(*(this->_wifiClient));
+  this->_mqttClient->onMessage(_mqttSubCallback);
+  this->_mqttClient->setKeepAliveInterval(SIMPLEIOT_MQTT_KEEPALIVE_MS);
+  if (this->_persistentSession) {
+    this->_mqttClient->setId(this->_clientId);
+    this->_mqttClient->setCleanSession(false);
   }
 
-  Serial.print("SimpleIOT: AWS IOT connected. IP Address: ");
-  Serial.println(WiFi.localIP());
+  WiFi.onEvent(_wifiEventCallback);
 
-  this->_ready = true;
-  if (this->_readyCallback.callback) {
-    this->_readyCallback.callback(this, 0, "Ready");
-  }
+  // The rest happens a step at a time inside loop()
+  //
+  this->_startConnect();
 }
 
-void SimpleIOT::_invokeCallback(const char* topic, const char* buffer, const unsigned int buflen)
+void SimpleIOT::setCredentialsDER(const uint8_t* caDer, size_t caLength,
+                                  const uint8_t* certDer, size_t certLength,
+                                  const uint8_t* keyDer, size_t keyLength)
 {
-  SimpleIOTType typeValue = IOT_STRING;
-
-  // We parse the buffer as json, then we extract the data coming in, convert it to the data type
-  // indicated, and call the right data handler.
-  //
-  // 
-    //  typedef enum {
-    //  IOT_INT,
-    //  IOT_FLOAT,
-    //  IOT_DOUBLE,
-    //  IOT_STRING,
-    //  IOT_BOOLEAN
-    //} SimpleIOTType;
-
-  Serial.print("SimpleIOT: Got callback from MQTT: ");
-  Serial.println(topic);
-  Serial.println(buffer);
-
-  DynamicJsonDocument jdoc(MAXIMUM_JSON_PAYLOAD_SIZE);
-  deserializeJson(jdoc, buffer);
+  this->_credentials.setDer(caDer, caLength, certDer, certLength, keyDer, keyLength);
+  this->_haveDerCredentials = true;
+}
 
-  // Let's check to see if it's an update
-  //
-  if (strncmp(UPDATE_TOPIC_PREFIX, topic, strlen(UPDATE_TOPIC_PREFIX)) == 0) {
-    const char* serial = jdoc["device"];
-    const char* version = jdoc["version"];
-    const char* payload_url = jdoc["url"];
-    const char* md5 = jdoc["md5"];
+void SimpleIOT::setCredentialCache(bool enable)
+{
+  this->_credentials.setNVSCache(enable);
+}
 
-    bool force = true;
+void SimpleIOT::setDiscoveryHandler(SimpleIOTDiscoveryHandler handler)
+{
+  this->_discoveryHandler = handler;
+}
 
-    JsonVariant forceValue = jdoc.getMember("force");
-    if (!forceValue.isNull()) {
-        force = forceValue.as<bool>();
-    }
+void SimpleIOT::clearGatewayCache()
+{
+Preferences prefs;
 
-// TBD: determine update type passed via payload. For now, we default to FIRMWARE
-//
-//    bool update_type_str = jdoc["type"];
-    SimpleIOTUpdateType update_type = UPDATE_FIRMWARE;
+  this->_ggCoreValid = false;
+  if (prefs.begin(SIMPLEIOT_NVS_NAMESPACE, false)) {
+    prefs.remove(SIMPLEIOT_NVS_GG_KEY);
+    prefs.end();
+  }
+}
 
-    // Now, we check to see if the packet is with us, if the version matches (or exceeds) and whether
-    // it has been forced. 
+void SimpleIOT::setGatewayFailover(bool enable, unsigned long failbackCheckSecs)
+{
+  this->_failover = enable;
+  this->_failbackCheckMs = failbackCheckSecs * 1000UL;
+}
 
-    this->_triggerUpdateCallback.callback(this, version, payload_url, update_type);
+unsigned long SimpleIOT::pathTime(SimpleIOTPath path)
+{
+  if (path >= IOT_PATH_COUNT) {
+    return 0;
   }
-  else if (strncmp(SIMPLEIOT_ADM_TOPIC_PREFIX, topic, strlen(SIMPLEIOT_ADM_TOPIC_PREFIX)) == 0) {
-    this->_handleAdminRequest(topic, jdoc);
-  } else if (strncmp(SIMPLEIOT_DIAG_TOPIC_PREFIX, topic, strlen(SIMPLEIOT_DIAG_TOPIC_PREFIX)) == 0) {
-    this->_handleDiagRequest(topic, jdoc);
-  } else {
-    if (this->_dataCallback.callback) {
-      const char* name = jdoc["name"];
-      const char* value = jdoc["value"];
-      JsonVariant type = jdoc.getMember("type");
-
-      if (!(type.isNull())) {
-        const char* typeStr = type.as<const char *>();
-        if (strcmp(typeStr, "string") || strcmp(typeStr, "str"))
-          typeValue = IOT_STRING;
-        else if (strcmp(typeStr, "integer") || strcmp(typeStr, "int"))
-          typeValue = IOT_INT;
-        else if (strcmp(typeStr, "float"))
-          typeValue = IOT_FLOAT;
-        else if (strcmp(typeStr, "double"))
-          typeValue = IOT_DOUBLE;
-        else if (strcmp(typeStr, "boolean") || strcmp(typeStr, "bool"))
-          typeValue = IOT_BOOLEAN;
-      }
-      // Callback for onData. Value is passed as string, but with a typeValue
-      // so it can be coerced if needed.
-      //
-      this->_dataCallback.callback(this, String(name), String(value), typeValue);
-    }
+  unsigned long ms = this->_pathMs[path];
+  if (this->_ready && path == this->_path) {
+    ms += millis() - this->_pathReadyMs;
   }
-  // In either case we should verify that it's addressed for this device and model.
+  return ms / 1000;
 }
 
-// These are internal functions to handle admin and diagnostic requests.
-// Items intended to be handled by the SDK are dealt with without going back to the main app.
-
-// Those meant to be handled by the app are passed on to the provided handlers (if there)
-// and the results returned.
-//
-// These are currently placeholders. They will be populated as the SDK functionality is
-// extended.
-//
-void SimpleIOT::_handleAdminRequest(const char* topic, DynamicJsonDocument jdoc)
+void SimpleIOT::setPersistentSession(bool enable)
 {
-   // *TBD*
+  this->_persistentSession = enable;
 }
 
-// NOTE: for diagnostics, certain of the SimpleIOTDiagType values may be performed here in the SDK
-// since they wouldn't be required to be handled by the application.
-//
-// We'll add  
-void SimpleIOT::_handleDiagRequest(const char* topic, DynamicJsonDocument jdoc)
+void SimpleIOT::setTLSSessionResumption(bool enable, bool acrossDeepSleep)
 {
-  if (this->_diagCallback.callback) {
-    const char* diagId = jdoc["id"];
-    const char* diagData = jdoc["data"];
-    int diagType = jdoc["type"];
-
-    const char* result = this->_diagCallback.callback(this, diagId, diagData, (SimpleIOTDiagType) diagType);
-
-    // We assume the data we get back is a JSON string. We would return it verbatim back via 
-    // MQTT, with the transaction ID in the topic.
-
-    // *TBD*
+  this->_tlsResume = enable;
+  this->_tlsResumeRtc = acrossDeepSleep;
+  if (this->_wifiClient) {
+    this->_wifiClient->setSessionResumption(enable, acrossDeepSleep);
   }
 }
 
-
-int SimpleIOT::set(const char* name, const char* value)
+unsigned long SimpleIOT::tlsHandshakeTime()
 {
-  return this->_sendMessage(OP_SET_DATA, name, value, MESSAGE_APP);
+  return this->_wifiClient ? this->_wifiClient->lastHandshakeUs() : 0;
 }
 
-int SimpleIOT::set(const char* name, int value)
+unsigned long SimpleIOT::tlsHandshakeCount()
 {
-  char buffer[INTERNAL_STATIC_BUFFER_SIZE + 1];
-  snprintf(buffer, INTERNAL_STATIC_BUFFER_SIZE, "%d", value);
-
-  return this->_sendMessage(OP_SET_DATA, name, buffer, MESSAGE_APP);
+  return this->_wifiClient ? this->_wifiClient->handshakeCount() : 0;
 }
 
-int SimpleIOT::set(const char* name, float value)
+unsigned long SimpleIOT::tlsResumedCount()
 {
-  char buffer[INTERNAL_STATIC_BUFFER_SIZE + 1];
-  snprintf(buffer, INTERNAL_STATIC_BUFFER_SIZE, "%.6f", value);
-
-    return this->_sendMessage(OP_SET_DATA, name, buffer, MESSAGE_APP);
+  return this->_wifiClient ? this->_wifiClient->resumedCount() : 0;
 }
 
-int SimpleIOT::set(const char* name, double value)
+unsigned long SimpleIOT::phaseMicros(SimpleIOTConnPhase phase)
 {
-  char buffer[INTERNAL_STATIC_BUFFER_SIZE + 1];
-  snprintf(buffer, INTERNAL_STATIC_BUFFER_SIZE, "%.6g", value);
-
-  return this->_sendMessage(OP_SET_DATA, name, buffer, MESSAGE_APP);
+  if (phase >= IOT_PHASE_COUNT) {
+    return 0;
+  }
+  return this->_phaseUs[phase];
 }
 
-int SimpleIOT::set(const char* name, boolean value)
+void SimpleIOT::_wifiEvent(WiFiEvent_t event)
 {
-  return this->_sendMessage(OP_SET_DATA, name, value ? "true" : "false", MESSAGE_APP);
+  if (event == ARDUINO_EVENT_WIFI_STA_CONNECTED) {
+    this->_wifiAssocUs = micros();
+  } else if (event == ARDUINO_EVENT_WIFI_STA_GOT_IP) {
+    this->_wifiGotIpUs = micros();
+  }
 }
 
-int SimpleIOT::set(const char* name, const char* value, float latitude, float longitude)
+unsigned long SimpleIOT::phaseTime(SimpleIOTConnState phase)
 {
-  return this->_sendMessage(OP_SET_DATA, name, value, latitude, longitude, MESSAGE_APP);
+  if (phase >= IOT_CONN_READY) {
+    return 0;
+  }
+  return this->_phaseMs[phase];
 }
 
-int SimpleIOT::set(const char* name, int value, float latitude, float longitude)
+// Record how long we spent in the phase we're leaving, then move on to the next one.
+//
+void SimpleIOT::_setConnState(SimpleIOTConnState state)
 {
-  char buffer[INTERNAL_STATIC_BUFFER_SIZE + 1];
-  snprintf(buffer, INTERNAL_STATIC_BUFFER_SIZE, "%d", value);
+  unsigned long now = millis();
 
-  return this->_sendMessage(OP_SET_DATA, name, buffer, latitude, longitude, MESSAGE_APP);
+  if (this->_connState < IOT_CONN_READY) {
+    this->_phaseMs[this->_connState] = now - this->_phaseStartMs;
+  }
+  this->_connState = state;
+  this->_phaseStartMs = now;
 }
 
-int SimpleIOT::set(const char* name, float value, float latitude, float longitude)
+void SimpleIOT::_startConnect()
 {
-  char buffer[INTERNAL_STATIC_BUFFER_SIZE + 1];
-  snprintf(buffer, INTERNAL_STATIC_BUFFER_SIZE, "%.6f", value);
+  this->_ready = false;
+  memset(this->_phaseMs, 0, sizeof(this->_phaseMs));
+  memset(this->_phaseUs, 0, sizeof(this->_phaseUs));
+  this->_wifiAssocUs = 0;
+  this->_wifiGotIpUs = 0;
+  this->_wifiBeginUs = micros();
+
+  Serial.println("SimpleIOT: Starting WiFi");
+  if (this->_radioOnStartMs == 0) {
+    this->_radioOnStartMs = millis();
+  }
+  WiFi.mode(WIFI_STA);
+  this->_beginWiFi(this->_wifiFastConnect);
 
-  return this->_sendMessage(OP_SET_DATA, name, buffer, latitude, longitude, MESSAGE_APP);
+  this->_setConnState(IOT_CONN_WIFI);
 }
 
-int SimpleIOT::set(const char* name, double value, float latitude, float longitude)
+void SimpleIOT::setWiFiFastConnect(bool enable, bool reuseLease)
 {
-  char buffer[INTERNAL_STATIC_BUFFER_SIZE + 1];
-  snprintf(buffer, INTERNAL_STATIC_BUFFER_SIZE, "%.6g", value);
-
-  return this->_sendMessage(OP_SET_DATA, name, buffer, latitude, longitude, MESSAGE_APP);
+  this->_wifiFastConnect = enable;
+  this->_wifiReuseLease = enable && reuseLease;
 }
 
-int SimpleIOT::set(const char* name, boolean value, float latitude, float longitude)
+// Start connecting, with the cached access point if there is a usable one. The RTC copy is
+// checked first; after a cold boot it's empty and we load it from NVS.
+//
+void SimpleIOT::_beginWiFi(bool useCache)
 {
-  return this->_sendMessage(OP_SET_DATA, name, value ? "true" : "false", latitude, longitude, MESSAGE_APP);
-}
+  uint32_t ssidCrc = crc32_le(0, (const uint8_t*) this->_wifiSsid, strlen(this->_wifiSsid));
 
+  this->_wifiFastAttempt = false;
+  this->_wifiBeginMs = millis();
 
-void SimpleIOT::loop(float delayMs)
-{
-    if (this->_mqttClient) {
-        this->_mqttClient->poll();
+  if (useCache && _wifiCache.magic != SIMPLEIOT_WIFI_MAGIC) {
+    Preferences prefs;
+    if (prefs.begin(SIMPLEIOT_NVS_NAMESPACE, true)) {
+      if (prefs.getBytes(SIMPLEIOT_NVS_WIFI_KEY, &_wifiCache, sizeof(_wifiCache)) != sizeof(_wifiCache)) {
+        _wifiCache.magic = 0;
+      }
+      prefs.end();
     }
-    if (delayMs > 0) {
-        delay(delayMs);
+  }
+
+  if (useCache && _wifiCache.magic == SIMPLEIOT_WIFI_MAGIC && _wifiCache.ssidCrc == ssidCrc) {
+    if (this->_wifiReuseLease && _wifiCache.ip != 0) {
+      WiFi.config(IPAddress(_wifiCache.ip), IPAddress(_wifiCache.gateway),
+                  IPAddress(_wifiCache.subnet), IPAddress(_wifiCache.dns));
     }
-}
+    Serial.printf("SimpleIOT: Fast connect to Wi-Fi: %s on channel %d\n", this->_wifiSsid, _wifiCache.channel);
+    WiFi.begin(this->_wifiSsid, this->_wifiPassword, _wifiCache.channel, _wifiCache.bssid);
+    this->_wifiFastAttempt = true;
+    return;
+  }
 
+  // Make sure a static config from an earlier fast attempt doesn't stick around
+  //
+  WiFi.config(IPAddress((uint32_t) 0), IPAddress((uint32_t) 0), IPAddress((uint32_t) 0));
+  WiFi.begin(this->_wifiSsid, this->_wifiPassword);
 
-// Utility to extract header value from headers
-String getHeaderValue(String header, String headerName) {
-  return header.substring(strlen(headerName.c_str()));
+  Serial.print("SimpleIOT: Connecting to Wi-Fi: ");
+  Serial.println(this->_wifiSsid);
 }
 
-// Based on ESP32 OTA system. This should be abstracted out so it can run on any processor
-// 
-// NOTE that the URL only works with S3/CloudFront since it downloads via SSL and the HTTP client needs the
-// RootCA of the server. We happen to have it as part of OTA connection so it only works with 
-// OTA updates hosted on AWS services.
-//
-// References:
-//
-// - https://github.com/kurimawxx00/webota-esp32/blob/main/WebOTA.ino
-// - https://techtutorialsx.com/2017/11/18/esp32-arduino-https-get-request/
+// Remember the access point and lease we just got. NVS is only written when something
+// changed so a device that wakes every few minutes doesn't wear out the flash.
 //
-
-void SimpleIOT::performOTA(const char* url, SimpleIOTOTACallback otaCallback)
+void SimpleIOT::_saveWiFiCache()
 {
-HTTPClient client;
+  SimpleIOTWiFiCache fresh;
+  uint8_t* bssid = WiFi.BSSID();
 
-  this->_otaCallback = otaCallback;
-  this->_fwUpdateTotalLength = 0;
-  this->_fwUpdateCurrentLength = 0;
-  this->_fwUpdatePercent = 0;
-  
-  client.begin(url, this->_caPem); // NOTE: we need to append the ROOT_CA so HTTPS calls can be made
-  // Get file, just to check if each reachable
-  int resp = client.GET();
-  Serial.print("Response: ");
-  Serial.println(resp);
-
-  if(resp > 0) {
-      // get length of document (is -1 when Server sends no Content-Length header)
-      
-      this->_fwUpdateTotalLength = client.getSize();
-      
-      // transfer to local variable
-      int len = this->_fwUpdateTotalLength;
-      
-      // this is required to start firmware update process
-      Update.begin(UPDATE_SIZE_UNKNOWN);
-      Serial.printf("FW Size: %u\n",this->_fwUpdateTotalLength);
-      
-      // create buffer for read
-      uint8_t buff[128] = { 0 };
-      // get tcp stream
-      WiFiClient * stream = client.getStreamPtr();
-      
-      // read all data from server
-      Serial.println("Updating firmware...");
-      while(client.connected() && (len > 0 || len == -1)) {
-           // get available data size
-           size_t size = stream->available();
-           
-           if (size) {
-              // read up to 128 byte
-              int c = stream->readBytes(buff, ((size > sizeof(buff)) ? sizeof(buff) : size));
-              // pass to function
-              this->_updateFirmware(buff, c);
-              if(len > 0) {
-                 len -= c;
-              }
-           }
-           delay(1);
-      }
-  }else{
-    Serial.println("ERROR: Cannot download firmware file");
+  if (!this->_wifiFastConnect || !bssid) {
+    return;
   }
-  client.end();
-}
+  memset(&fresh, 0, sizeof(fresh));
+  fresh.magic = SIMPLEIOT_WIFI_MAGIC;
+  fresh.ssidCrc = crc32_le(0, (const uint8_t*) this->_wifiSsid, strlen(this->_wifiSsid));
+  memcpy(fresh.bssid, bssid, sizeof(fresh.bssid));
+  fresh.channel = (uint8_t) WiFi.channel();
+  fresh.ip = (uint32_t) WiFi.localIP();
+  fresh.gateway = (uint32_t) WiFi.gatewayIP();
+  fresh.subnet = (uint32_t) WiFi.subnetMask();
+  fresh.dns = (uint32_t) WiFi.dnsIP();
+
+  if (memcmp(&fresh, &_wifiCache, sizeof(fresh)) == 0) {
+    return;
+  }
+  _wifiCache = fresh;
 
+  Preferences prefs;
+  if (prefs.begin(SIMPLEIOT_NVS_NAMESPACE, false)) {
+    prefs.putBytes(SIMPLEIOT_NVS_WIFI_KEY, &_wifiCache, sizeof(_wifiCache));
+    prefs.end();
+  }
+}
 
-// Update firmware incrementally.
-// Buffer is declared to be 128 so chunks of 128 bytes from firmware is written to device until server closes.
+// A failed attempt is reported to the app via the ready callback with a non-zero status.
+// We then back off before trying again. See SIMPLEIOT_BACKOFF_* for how long.
 //
-// We calculate percentage done in integer format and invoke the callback handler only when the value has changed.
-// Since the download is only 128 bytes at a time, this cuts down on a lot of callbacks.
-
-void SimpleIOT::_updateFirmware(uint8_t *data, size_t len)
+void SimpleIOT::_connectFailed(int status, const char* message)
 {
-  int percent;
-  Update.write(data, len);
-  this->_fwUpdateCurrentLength += len;
+  unsigned long ceiling = SIMPLEIOT_BACKOFF_MAX_MS;
 
-  if (this->_otaCallback != NULL) {
-    percent = int((float(this->_fwUpdateCurrentLength) / float(this->_fwUpdateTotalLength)) * 100.0);
-    if (percent != this->_fwUpdatePercent) {
-       this->_fwUpdatePercent = percent;
-       this->_otaCallback(this->_fwUpdateCurrentLength, this->_fwUpdateTotalLength, percent);
-    }
+  if (this->_retryCount < 16 && (SIMPLEIOT_BACKOFF_BASE_MS << this->_retryCount) < SIMPLEIOT_BACKOFF_MAX_MS) {
+    ceiling = SIMPLEIOT_BACKOFF_BASE_MS << this->_retryCount;
   }
+  this->_retryCount++;
+  this->_retryDelayMs = ceiling / 2 + random(ceiling / 2 + 1);
 
-  // if current length of written firmware is not equal to total firmware size, repeat
-  
-  if (this->_fwUpdateCurrentLength != this->_fwUpdateTotalLength) 
-     return;
+  this->_leavePath();
 
-  Update.end(true);
-  
-  this->_updateReceived(); // We send the update received message to the server so it marks the record properly
+  Serial.print("SimpleIOT: Connect failed: ");
+  Serial.print(message);
+  Serial.printf(". Retrying in %lu ms\n", this->_retryDelayMs);
 
-  Serial.printf("\nUpdate Success, Total Size: %u\nRebooting...\n", this->_fwUpdateCurrentLength);
-  // Restart ESP32 to see changes 
-  
-  delay(DELAY_MS_BEFORE_RESTART);            // then we wait a little before restarting to let the updateReceived call get through
-  ESP.restart();
+  this->_ready = false;
+  this->_setConnState(IOT_CONN_FAILED);
+  if (this->_readyCallback.callback) {
+    this->_readyCallback.callback(this, status, message);
+  }
 }
 
-void SimpleIOT::_doUpdate(char* op, bool force)
+bool SimpleIOT::_isConnected()
 {
-DynamicJsonDocument root(SimpleIOTInternalBufferSize);
-
-  root["project"] = this->_project;
-  root["serial"] = this->_serialNumber;
-  root["version"] = this->_fwVersion;
-  root["op"] = op;
-  if (force) {
-    root["force"] = true;
+  if (WiFi.status() != WL_CONNECTED) {
+    return false;
+  }
+  return this->_mqttClient->connected();
+}
+
+// Called from loop() when a ready connection has dropped. Values set() from here on are
+// queued, and the subscriptions are redone as part of the reconnect.
+//
+void SimpleIOT::_connectionLost()
+{
+  Serial.println("SimpleIOT: Connection lost");
+
+  this->_reconnectCount++;
+  this->_errorSinceHeartbeat = true;
+  if (this->_mqttClient) {
+    this->_mqttClient->stop();
+  }
+  this->_connectFailed(SIMPLEIOT_ERR_DISCONNECTED, "Connection lost");
+}
+
+// Advance the connection by one step. Nothing in here waits on the network except the
+// MQTT connect itself (the TLS handshake happens inside it), which gets a call of its own so
+// the app gets control back before and after it.
+//
+void SimpleIOT::_connectStep()
+{
+  unsigned long elapsed = millis() - this->_phaseStartMs;
+
+  switch (this->_connState) {
+    case IOT_CONN_IDLE:
+    case IOT_CONN_READY:
+      break;
+
+    case IOT_CONN_WIFI:
+      if (WiFi.status() == WL_CONNECTED) {
+        Serial.print("SimpleIOT: WiFi connected. IP Address: ");
+        Serial.println(WiFi.localIP());
+        if (this->_wifiAssocUs && this->_wifiGotIpUs) {
+          this->_phaseUs[IOT_PHASE_WIFI_ASSOC] = this->_wifiAssocUs - this->_wifiBeginUs;
+          this->_phaseUs[IOT_PHASE_DHCP] = this->_wifiGotIpUs - this->_wifiAssocUs;
+        }
+        this->_saveWiFiCache();
+        this->_setConnState(IOT_CONN_CONNECT);
+      } else if (this->_wifiFastAttempt && millis() - this->_wifiBeginMs > WIFI_FAST_CONNECT_TIMEOUT_MS) {
+        // The access point may have moved channel or gone away. Forget it and do a full scan.
+        //
+        Serial.println("SimpleIOT: Fast connect failed, falling back to full scan");
+        _wifiCache.magic = 0;
+        WiFi.disconnect();
+        this->_beginWiFi(false);
+      } else if (elapsed > WIFI_CONNECT_TIMEOUT_MS) {
+        WiFi.disconnect();
+        this->_connectFailed(SIMPLEIOT_ERR_WIFI_TIMEOUT, "WiFi connect timeout");
+      }
+      break;
+
+    case IOT_CONN_CONNECT: {
+      const char* host = this->_iotEndpoint;
+      uint16_t port = IOT_MQTT_PORT;            // NOTE: we should make the port configurable.
+      bool viaGateway = this->_path == IOT_PATH_GATEWAY;
+
+      if (viaGateway) {
+        // Discovery is its own step, so the app gets control back before the core connect
+        //
+        if (!this->_ggCoreValid) {
+          unsigned long start = micros();
+          int ret = this->_discover();
+          this->_phaseUs[IOT_PHASE_DISCOVERY] = micros() - start;
+
+          if (ret != 0) {
+            if (this->_failover) {
+              Serial.println("SimpleIOTGW: Failing over to AWS IOT");
+              this->_setPath(IOT_PATH_DIRECT);
+              this->_retryCount = 0;
+            }
+            this->_connectFailed(SIMPLEIOT_ERR_DISCOVERY, "Greengrass discovery failed");
+          }
+          break;
+        }
+        host = this->_ggCore->addresses[this->_ggCore->addressIndex].host;
+        port = this->_ggCore->addresses[this->_ggCore->addressIndex].port;
+        Serial.printf("SimpleIOTGW: Connecting to GG Core at %s:%u\n", host, port);
+      } else {
+        Serial.print("SimpleIOT: Connecting to AWS IOT at endpoint: ");
+        Serial.println(host);
+      }
+
+      bool connected = this->_mqttClient->connect(host, port);
+      unsigned long doneUs = micros();
+
+      // The secure client timed DNS, TCP and the handshake; what's left is CONNECT/CONNACK
+      //
+      this->_phaseUs[IOT_PHASE_DNS] = this->_wifiClient->lastDnsUs();
+      this->_phaseUs[IOT_PHASE_TCP] = this->_wifiClient->lastTcpUs();
+      this->_phaseUs[IOT_PHASE_TLS] = this->_wifiClient->lastHandshakeUs();
+      if (connected) {
+        this->_phaseUs[IOT_PHASE_MQTT_CONNECT] = doneUs - this->_wifiClient->connectedAtUs();
+      }
+
+      if (!connected) {
+        Serial.print("ERROR Connecting to MQTT endpoint: ");
+        Serial.println(this->_mqttClient->connectError());
+
+        // Try the next saved core address next time. Once they've all failed, the core has
+        // probably moved, so run discovery again.
+        //
+        if (viaGateway) {
+          this->_ggFailures++;
+          if (this->_ggFailures >= this->_ggCore->addressCount && this->_failover) {
+            Serial.println("SimpleIOTGW: Core unreachable, failing over to AWS IOT");
+            this->_ggFailures = 0;
+            this->_setPath(IOT_PATH_DIRECT);
+            this->_retryCount = 0;        // the next endpoint gets tried right away
+          } else if (this->_ggFailures >= this->_ggCore->addressCount) {
+            Serial.println("SimpleIOTGW: No saved core address worked, will run discovery again");
+            this->_ggCoreValid = false;
+            this->_ggFailures = 0;
+          } else {
+            this->_ggCore->addressIndex = (this->_ggCore->addressIndex + 1) % this->_ggCore->addressCount;
+          }
+        }
+        this->_connectFailed(SIMPLEIOT_ERR_CONNECT, "MQTT connect failed");
+        break;
+      }
+
+      if (viaGateway && this->_ggFailures > 0) {
+        this->_ggFailures = 0;
+        this->_saveGatewayCache();      // remember which address worked
+      }
+      Serial.println("SimpleIOT: Connected to AWS IOT.");
+      this->_setConnState(IOT_CONN_SUBSCRIBE);
+      this->_subscribeIndex = 0;
+      this->_subackId = 0;
+      this->_pubackId = 0;
+      this->_resetPacket();
+      this->_subscribeStartUs = micros();
+
+      // If the broker kept our session it still has the subscriptions. We only need to add
+      // children that were added since. After a reboot we can't tell, so assume the app
+      // added the same children as last time.
+      //
+      this->_sessionResumed = this->_persistentSession && this->_wifiClient->sessionPresent();
+      if (this->_sessionResumed) {
+        Serial.println("SimpleIOT: MQTT session resumed");
+        this->_subscribeIndex = this->_subscribedCount > 0 ? this->_subscribedCount
+                                                          : this->_subscribeCount + this->_childCount;
+      }
+      this->_subscribedCount = this->_subscribeIndex;
+      break;
+    }
+
+    case IOT_CONN_SUBSCRIBE:
+      // Our own topics first, then each child's monitor topic, several to a packet. Each
+      // SUBSCRIBE is sent on one call and its SUBACK looked for on the calls after.
+      //
+      // The connection never got to ready, so a failure here is a failed connect like any
+      // other, not a lost connection. It shouldn't count as a reconnect.
+      //
+      if (this->_subackId != 0) {
+        int ret = this->_subscribeCheck();
+        if (ret < 0) {
+          this->_mqttClient->stop();
+          this->_connectFailed(SIMPLEIOT_ERR_CONNECT, "Subscribe failed");
+        }
+        if (ret <= 0) {
+          break;
+        }
+      }
+      if (this->_subscribeIndex < this->_subscribeCount + this->_childCount) {
+        if (this->_subscribeBatch() != 0) {
+          this->_mqttClient->stop();
+          this->_connectFailed(SIMPLEIOT_ERR_CONNECT, "Subscribe failed");
+        }
+        break;
+      }
+
+      this->_phaseUs[IOT_PHASE_SUBSCRIBE] = micros() - this->_subscribeStartUs;
+
+      Serial.println("SimpleIOT: AWS IOT connected.");
+      this->_setConnState(IOT_CONN_READY);
+      this->_ready = true;
+      this->_pathReadyMs = millis();
+      this->_retryCount = 0;
+      if (this->_readyCallback.callback) {
+        this->_readyCallback.callback(this, 0, "Ready");
+      }
+
+      // Anything set() before the connection came up goes out now. In duty-cycle mode
+      // _dutyCycleStep() sends it as an acknowledged batch instead.
+      //
+      this->_sendConnectReport();
+      if (this->_dutyIntervalSecs > 0) {
+        this->_sendDutyCycleReport();
+      } else {
+        this->_flushPending();
+      }
+      break;
+
+    case IOT_CONN_FAILED:
+      if (elapsed > this->_retryDelayMs) {
+        // If WiFi is still up, only the cloud side needs to be redone.
+        //
+        if (WiFi.status() == WL_CONNECTED) {
+          memset(this->_phaseMs, 0, sizeof(this->_phaseMs));
+          memset(this->_phaseUs, 0, sizeof(this->_phaseUs));
+          this->_setConnState(IOT_CONN_CONNECT);
+        } else {
+          WiFi.disconnect();
+          this->_startConnect();
+        }
+      }
+      break;
+  }
+}
+
+// MQTT fixed header: the packet type and flags, then the remaining length, 7 bits a byte.
+// Returns the header's length, at most 5.
+//
+static size_t _mqttFixedHeader(uint8_t* header, uint8_t type, size_t remaining)
+{
+  size_t length = 0;
+
+  header[length++] = type;
+  do {
+    uint8_t digit = remaining % 128;
+    remaining /= 128;
+    header[length++] = digit | (remaining > 0 ? 0x80 : 0);
+  } while (remaining > 0);
+  return length;
+}
+
+const char* SimpleIOT::_subscribeTopic(int index, char* buffer)
+{
+  if (index < this->_subscribeCount) {
+    return this->_subscribeTopics[index];
+  }
+  this->_childTopic(buffer, SIMPLEIOT_APP_MONITOR_PREFIX, index - this->_subscribeCount, "#");
+  return buffer;
+}
+
+// MqttClient only sends one topic filter per SUBSCRIBE and waits for each SUBACK, so we
+// build the packet ourselves and send up to SIMPLEIOT_SUBSCRIBE_BATCH filters at a time.
+// The SUBACK is picked up by _subscribeCheck() on later calls. Returns -1 if the SUBSCRIBE
+// couldn't be sent.
+//
+int SimpleIOT::_subscribeBatch()
+{
+  int total = this->_subscribeCount + this->_childCount;
+  int last = min(this->_subscribeIndex + SIMPLEIOT_SUBSCRIBE_BATCH, total);
+  uint8_t qos = this->_persistentSession ? 1 : 0;
+  char topicBuffer[INTERNAL_TOPIC_BUFFER_SIZE + 1];
+
+  // Room for the fixed header in front of the body, which we write first since the header
+  // holds the body's length
+  //
+  const size_t headerRoom = 5;
+  uint8_t* packet = (uint8_t*) malloc(headerRoom + 2 + SIMPLEIOT_SUBSCRIBE_BATCH * (INTERNAL_TOPIC_BUFFER_SIZE + 3));
+  if (!packet) {
+    return -1;
+  }
+
+  uint16_t packetId = MQTT_PACKET_ID_BASE + (this->_packetId++ & 0x0FFF);
+  uint8_t* p = packet + headerRoom;
+  *p++ = packetId >> 8;
+  *p++ = packetId & 0xFF;
+  for (int i = this->_subscribeIndex; i < last; i++) {
+    const char* topic = this->_subscribeTopic(i, topicBuffer);
+    size_t length = strlen(topic);
+
+    Serial.println("SimpleIOT: Subscribing to: " + String(topic));
+    *p++ = length >> 8;
+    *p++ = length & 0xFF;
+    memcpy(p, topic, length);
+    p += length;
+    *p++ = qos;
+  }
+  uint8_t header[5];
+  size_t headerLength = _mqttFixedHeader(header, MQTT_SUBSCRIBE, p - (packet + headerRoom));
+
+  uint8_t* start = packet + headerRoom - headerLength;
+  memcpy(start, header, headerLength);
+  size_t packetLength = p - start;
+  bool written = this->_wifiClient->write(start, packetLength) == packetLength;
+  free(packet);
+  if (!written) {
+    return -1;
+  }
+
+  this->_subackId = packetId;
+  this->_subackLast = last;
+  this->_subackStartMs = millis();
+  return 0;
+}
+
+// Check for the SUBACK to the last SUBSCRIBE without waiting for it. Returns 1 once it's
+// in, 0 if it hasn't arrived yet, and -1 if it never will and the connection should be dropped.
+//
+int SimpleIOT::_subscribeCheck()
+{
+  char topicBuffer[INTERNAL_TOPIC_BUFFER_SIZE + 1];
+  uint8_t* body = NULL;
+  size_t bodyLength = 0;
+  int ret = this->_readAck(MQTT_SUBACK, this->_subackId, &body, &bodyLength);
+
+  if (ret == 1) {
+    for (size_t i = 2; i < bodyLength; i++) {
+      if (body[i] == 0x80) {
+        Serial.printf("SimpleIOT: ERROR: Subscribe refused for: %s\n",
+                      this->_subscribeTopic(this->_subscribeIndex + i - 2, topicBuffer));
+      }
+    }
+    free(body);
+    this->_subackId = 0;
+    this->_subscribeIndex = this->_subackLast;
+    this->_subscribedCount = this->_subackLast;
+    return 1;
+  }
+  if (ret < 0 || millis() - this->_subackStartMs > SUBACK_TIMEOUT_MS) {
+    Serial.println("SimpleIOT: ERROR: No SUBACK");
+    return -1;
+  }
+  return 0;
+}
+
+// Look for the acknowledgement (SUBACK or PUBACK) to a packet we sent ourselves, without
+// waiting for it. Anything else that turns up first (messages queued in a persistent session,
+// say) is handed back so MqttClient reads it as usual. Returns 1 once it's in, with the body
+// malloc'd for the caller to free, 0 if it hasn't arrived yet, -1 if the stream is broken.
+//
+int SimpleIOT::_readAck(uint8_t type, uint16_t packetId, uint8_t** body, size_t* bodyLength)
+{
+  uint8_t header[5];
+  size_t headerLength = 0;
+  int ret;
+
+  while ((ret = this->_readPacket(header, &headerLength, body, bodyLength)) == 1) {
+    if (header[0] == type && *bodyLength >= 2 && (((*body)[0] << 8) | (*body)[1]) == packetId) {
+      return 1;
+    }
+
+    bool kept = this->_wifiClient->unread(header, headerLength) &&
+                this->_wifiClient->unread(*body, *bodyLength);
+    free(*body);
+    *body = NULL;
+    if (!kept) {
+      Serial.println("SimpleIOT: ERROR: Too much data waiting for an acknowledgement");
+      return -1;
+    }
+  }
+  return ret;
+}
+
+// Read one MQTT packet straight off the TLS stream, as much of it as has arrived. The part
+// read so far is kept between calls. Returns 1 once the whole packet is in (the body is
+// malloc'd, caller frees it), 0 if the rest hasn't arrived yet, -1 if the stream is broken.
+//
+int SimpleIOT::_readPacket(uint8_t* header, size_t* headerLength, uint8_t** body, size_t* bodyLength)
+{
+  if (!this->_wifiClient->connected()) {
+    return -1;
+  }
+
+  while (this->_rxBody == NULL) {
+    uint8_t b;
+    if (this->_wifiClient->rawRead(&b, 1) != 1) {
+      return 0;
+    }
+    this->_rxHeader[this->_rxHeaderLength++] = b;
+    if (this->_rxHeaderLength == 1) {
+      this->_rxLength = 0;
+      continue;
+    }
+    this->_rxLength += (size_t) (b & 0x7F) << (7 * (this->_rxHeaderLength - 2));
+    if (b & 0x80) {
+      if (this->_rxHeaderLength == 5) {
+        return -1;          // malformed length
+      }
+      continue;
+    }
+    if (this->_rxLength > SIMPLEIOT_TLS_PUSHBACK_SIZE) {
+      return -1;
+    }
+    this->_rxBody = (uint8_t*) malloc(this->_rxLength > 0 ? this->_rxLength : 1);
+    if (!this->_rxBody) {
+      return -1;
+    }
+    this->_rxGot = 0;
+  }
+
+  while (this->_rxGot < this->_rxLength) {
+    int count = this->_wifiClient->rawRead(this->_rxBody + this->_rxGot, this->_rxLength - this->_rxGot);
+    if (count <= 0) {
+      return 0;
+    }
+    this->_rxGot += count;
+  }
+
+  memcpy(header, this->_rxHeader, this->_rxHeaderLength);
+  *headerLength = this->_rxHeaderLength;
+  *body = this->_rxBody;
+  *bodyLength = this->_rxLength;
+  this->_rxBody = NULL;
+  this->_rxHeaderLength = 0;
+  return 1;
+}
+
+// Drop a packet _readPacket was part way through, when the connection it came on is gone
+//
+void SimpleIOT::_resetPacket()
+{
+  free(this->_rxBody);
+  this->_rxBody = NULL;
+  this->_rxHeaderLength = 0;
+  this->_rxLength = 0;
+  this->_rxGot = 0;
+}
+
+// Map the 'type' field of an incoming data message to a SimpleIOTType
+//
+static SimpleIOTType _typeFromString(const char* typeStr)
+{
+  if (!typeStr)
+    return IOT_STRING;
+  if (strcmp(typeStr, "integer") == 0 || strcmp(typeStr, "int") == 0)
+    return IOT_INT;
+  if (strcmp(typeStr, "float") == 0)
+    return IOT_FLOAT;
+  if (strcmp(typeStr, "double") == 0)
+    return IOT_DOUBLE;
+  if (strcmp(typeStr, "boolean") == 0 || strcmp(typeStr, "bool") == 0)
+    return IOT_BOOLEAN;
+  return IOT_STRING;
+}
+
+static SimpleIOTUpdateType _updateTypeFromString(const char* typeStr)
+{
+  if (!typeStr)
+    return UPDATE_FIRMWARE;
+  if (strcmp(typeStr, "config") == 0)
+    return UPDATE_CONFIG;
+  if (strcmp(typeStr, "file") == 0)
+    return UPDATE_FILE;
+  if (strcmp(typeStr, "test") == 0)
+    return UPDATE_TEST;
+  return UPDATE_FIRMWARE;
+}
+
+// Decide whether an update message is for us. Everything here is local, so an update
+// announced to the whole model costs devices that don't qualify one JSON parse and nothing
+// more. Fields that aren't in the message don't restrict anything.
+//
+//   device    serial, or a list of them, the update is for ("*" for all)
+//   version   firmware updates are only taken if newer than ours, unless force is set
+//   rollout   percentage of devices that take it, by a hash of serial and version
+//   start/end epoch seconds the update is open for. Uses our clock if it's set, else the
+//             message's "ts".
+//
+bool SimpleIOT::_updateWanted(DynamicJsonDocument& jdoc, SimpleIOTUpdateType type)
+{
+  JsonVariant device = jdoc["device"];
+  const char* version = jdoc["version"];
+  bool force = jdoc["force"] | false;
+
+  if (device.is<JsonArray>()) {
+    bool found = false;
+    for (JsonVariant serial : device.as<JsonArray>()) {
+      const char* s = serial;
+      found = found || (s && strcmp(s, this->_serialNumber) == 0);
+    }
+    if (!found) {
+      return false;
+    }
+  } else if (device.is<const char*>()) {
+    const char* s = device;
+    if (strcmp(s, "*") != 0 && strcmp(s, this->_serialNumber) != 0) {
+      return false;
+    }
+  }
+
+  // An update the device asked for with checkForUpdate(true) comes back forced
+  //
+  if (force) {
+    return true;
+  }
+
+  if (type == UPDATE_FIRMWARE && version && SimpleIOTVersion::compare(version, this->_fwVersion) <= 0) {
+    Serial.println("SimpleIOT: Already running " + String(this->_fwVersion) + ", skipping update to " + String(version));
+    return false;
+  }
+
+  JsonVariant rollout = jdoc["rollout"];
+  if (!rollout.isNull()) {
+    uint32_t bucket = crc32_le(0, (const uint8_t*) this->_serialNumber, strlen(this->_serialNumber));
+    if (version) {
+      bucket = crc32_le(bucket, (const uint8_t*) version, strlen(version));   // a different group for each release
+    }
+    if (bucket % 100 >= rollout.as<unsigned int>()) {
+      Serial.println("SimpleIOT: Not in this stage of the rollout");
+      return false;
+    }
+  }
+
+  unsigned long start = jdoc["start"] | 0UL;
+  unsigned long end = jdoc["end"] | 0UL;
+  if (start > 0 || end > 0) {
+    unsigned long now = time(NULL);
+    if (now < SIMPLEIOT_CLOCK_VALID) {
+      now = jdoc["ts"] | 0UL;
+    }
+    if (now == 0) {
+      Serial.println("SimpleIOT: WARNING: Clock not set, ignoring update window");
+    } else if ((start > 0 && now < start) || (end > 0 && now >= end)) {
+      Serial.println("SimpleIOT: Outside the update window");
+      return false;
+    }
+  }
+  return true;
+}
+
+void SimpleIOT::_invokeCallback(const char* topic, const char* buffer, const unsigned int buflen)
+{
+  SimpleIOTType typeValue = IOT_STRING;
+
+  // We parse the buffer as json, then we extract the data coming in, convert it to the data type
+  // indicated, and call the right data handler.
+  //
+  // 
+    //  typedef enum {
+    //  IOT_INT,
+    //  IOT_FLOAT,
+    //  IOT_DOUBLE,
+    //  IOT_STRING,
+    //  IOT_BOOLEAN
+    //} SimpleIOTType;
+
+  Serial.print("SimpleIOT: Got callback from MQTT: ");
+  Serial.println(topic);
+  Serial.println(buffer);
+
+  DynamicJsonDocument jdoc(MAXIMUM_JSON_PAYLOAD_SIZE);
+  deserializeJson(jdoc, buffer);
+
+  // Let's check to see if it's an update
+  //
+  if (strncmp(UPDATE_TOPIC_PREFIX, topic, strlen(UPDATE_TOPIC_PREFIX)) == 0) {
+    // One update at a time. The server sends it again on the next check.
+    //
+    if (this->_otaState == IOT_OTA_RUNNING) {
+      Serial.println("SimpleIOT: OTA running, ignoring update message");
+      return;
+    }
+
+    SimpleIOTUpdateType update_type = _updateTypeFromString(jdoc["type"]);
+
+    // Check that the packet is for us, that the version is newer (unless forced) and that
+    // we're in this stage of the rollout, before doing anything else with it.
+    //
+    if (!this->_updateWanted(jdoc, update_type)) {
+      return;
+    }
+
+    const char* version = jdoc["version"];
+    const char* payload_url = jdoc["url"];
+    const char* md5 = jdoc["md5"];
+    const char* sha256 = jdoc["sha256"];
+    const char* signature = jdoc["signature"];
+    const char* compression = jdoc["compression"];
+    const char* deltaUrl = jdoc["delta_url"];
+    const char* deltaBase = jdoc["delta_base"];
+
+    this->setOTAHash(md5, sha256, signature);
+    strncpy(this->_otaVersion, version ? version : "", SIMPLEIOT_OTA_VERSION_SIZE - 1);
+    this->_otaVersion[SIMPLEIOT_OTA_VERSION_SIZE - 1] = '\0';
+    this->setOTADelta(deltaUrl, deltaBase);
+    this->_otaGzip = compression && strcmp(compression, "gzip") == 0;
+
+    // Config updates have a default place to go. Files have to say where.
+    //
+    const char* path = jdoc["path"];
+
+    if (!path) {
+      path = update_type == UPDATE_CONFIG ? SIMPLEIOT_CONFIG_PATH : "";
+    }
+    strncpy(this->_otaPath, update_type == UPDATE_CONFIG || update_type == UPDATE_FILE ? path : "",
+            SIMPLEIOT_OTA_PATH_SIZE - 1);
+    this->_otaPath[SIMPLEIOT_OTA_PATH_SIZE - 1] = '\0';
+
+    if (this->_otaPath[0] != '\0' && this->_fileUpdateCallback && payload_url) {
+      this->performFileUpdateAsync(payload_url, this->_otaPath, update_type);
+    } else if (this->_triggerUpdateCallback.callback) {
+      this->_triggerUpdateCallback.callback(this, version, payload_url, update_type);
+    }
+  }
+  else if (strncmp(SIMPLEIOT_ADM_TOPIC_PREFIX, topic, strlen(SIMPLEIOT_ADM_TOPIC_PREFIX)) == 0) {
+    this->_handleAdminRequest(topic, jdoc);
+  } else if (strncmp(SIMPLEIOT_DIAG_TOPIC_PREFIX, topic, strlen(SIMPLEIOT_DIAG_TOPIC_PREFIX)) == 0) {
+    this->_handleDiagRequest(topic, jdoc);
+  } else {
+    int child = this->_findChild(topic);
+
+    if (child >= 0) {
+      const char* name = jdoc["name"];
+      const char* value = jdoc["value"];
+      JsonVariant type = jdoc.getMember("type");
+
+      if (!(type.isNull())) {
+        typeValue = _typeFromString(type.as<const char *>());
+      }
+      if (name && value && this->_children[child].onData) {
+        this->_children[child].onData(this, child, String(name), String(value), typeValue);
+      }
+    } else if (this->_dataCallback.callback) {
+      const char* name = jdoc["name"];
+      const char* value = jdoc["value"];
+      JsonVariant type = jdoc.getMember("type");
+
+      if (!(type.isNull())) {
+        typeValue = _typeFromString(type.as<const char *>());
+      }
+      if (name && value) {
+        this->_recordAttribute(name, value, typeValue, SIMPLEIOT_ATTR_FROM_CLOUD, 0.0, 0.0);
+      }
+
+      // Callback for onData. Value is passed as string, but with a typeValue
+      // so it can be coerced if needed.
+      //
+      this->_dataCallback.callback(this, String(name), String(value), typeValue);
+    }
+  }
+}
+
+// These are internal functions to handle admin and diagnostic requests.
+// Items intended to be handled by the SDK are dealt with without going back to the main app.
+
+// Those meant to be handled by the app are passed on to the provided handlers (if there)
+// and the results returned.
+//
+// Admin requests carry an 'op' and an optional 'id' that is echoed back with the result.
+//
+void SimpleIOT::_handleAdminRequest(const char* topic, DynamicJsonDocument jdoc)
+{
+  const char* op = jdoc["op"];
+  const char* id = jdoc["id"];
+
+  if (!op) {
+    return;
+  }
+  if (strcmp(op, "savestate") == 0) {
+    this->_sendDiagResult(id, this->saveState() == 0 ? "{\"saved\":true}" : "{\"saved\":false}");
+  } else if (strcmp(op, "clearstate") == 0) {
+    this->_sendDiagResult(id, this->clearState() == 0 ? "{\"cleared\":true}" : "{\"cleared\":false}");
+  } else if (strcmp(op, "returnstate") == 0) {
+    this->_returnState(id);
+  } else {
+    Serial.print("SimpleIOT: Unknown admin op: ");
+    Serial.println(op);
+  }
+}
+
+// NOTE: for diagnostics, certain of the SimpleIOTDiagType values are performed here in the SDK
+// since they wouldn't be required to be handled by the application. The rest are passed on to
+// the app's diag handler.
+//
+void SimpleIOT::_handleDiagRequest(const char* topic, DynamicJsonDocument jdoc)
+{
+  const char* diagId = jdoc["id"];
+  const char* diagData = jdoc["data"];
+  int diagType = jdoc["type"];
+
+  // Our own round-trip probe coming back
+  //
+  JsonVariant probe = jdoc.getMember(RTT_PROBE_SUFFIX);
+  if (!probe.isNull()) {
+    if (probe.as<unsigned long>() == this->_rttSeq && this->_rttSentUs) {
+      this->_rttUs = micros() - this->_rttSentUs;
+      this->_rttSentUs = 0;
+      this->_rttCount++;
+      #ifdef _DEBUG
+        Serial.printf("SimpleIOT: Round trip %lu us\n", this->_rttUs);
+      #endif
+    }
+    return;
+  }
+
+  // A message without a type is the app's, even though the default of 0 is IOT_HEARTBEAT
+  //
+  switch (jdoc.containsKey("type") ? diagType : -1) {
+    case IOT_SAVESTATE:
+      this->_sendDiagResult(diagId, this->saveState() == 0 ? "{\"saved\":true}" : "{\"saved\":false}");
+      return;
+    case IOT_CLEARSTATE:
+      this->_sendDiagResult(diagId, this->clearState() == 0 ? "{\"cleared\":true}" : "{\"cleared\":false}");
+      return;
+    case IOT_RETURNSTATE:
+      this->_returnState(diagId);
+      return;
+    case IOT_HEARTBEAT:
+      this->sendHeartbeat();
+      this->_sendDiagResult(diagId, "{\"heartbeat\":true}");
+      return;
+    default:
+      break;
+  }
+
+  if (this->_diagCallback.callback) {
+    const char* result = this->_diagCallback.callback(this, diagId, diagData, (SimpleIOTDiagType) diagType);
+
+    // We assume the data we get back is a JSON string. We return it verbatim back via 
+    // MQTT, with the transaction ID alongside it.
+    //
+    if (result) {
+      this->_sendDiagResult(diagId, result);
+    }
+  }
+}
+
+// Publish a probe to one of our own diag topics. We're subscribed to all of them, so the
+// broker (AWS IOT or the Greengrass core) sends it straight back and the time it takes is
+// the round trip through the broker.
+//
+int SimpleIOT::sendRoundTripProbe()
+{
+char topic[INTERNAL_TOPIC_BUFFER_SIZE + 1];
+char payload[32];
+
+  if (!this->_ready) {
+    return -1;
+  }
+  snprintf(topic, INTERNAL_TOPIC_BUFFER_SIZE, "%.25s/%.25s/%.25s/%.25s/%s", SIMPLEIOT_DIAG_TOPIC_PREFIX,
+           this->_project, this->_model, this->_serialNumber, RTT_PROBE_SUFFIX);
+  snprintf(payload, sizeof(payload), "{\"%s\":%lu}", RTT_PROBE_SUFFIX, ++this->_rttSeq);
+
+  if (this->_publish(topic, payload, &this->_rttSentUs) != 0) {
+    this->_rttSentUs = 0;
+    return -1;
+  }
+  return 0;
+}
+
+void SimpleIOT::_sendDiagResult(const char* diagId, const char* result)
+{
+DynamicJsonDocument root(SimpleIOTInternalBufferSize);
+
+  root["project"] = this->_project;
+  root["serial"] = this->_serialNumber;
+  if (diagId) {
+    root["id"] = diagId;
+  }
+  root["result"] = serialized(result);
+
+  this->_sendRawMessage(OP_DIAG_RESULT, root, MESSAGE_SYS);
+}
+
+// The state is returned as JSON (name: value) so it can be read by the cloud side without
+// knowing the binary layout. The snapshot size and version are included for reference.
+//
+void SimpleIOT::_returnState(const char* diagId)
+{
+DynamicJsonDocument root(SimpleIOTInternalBufferSize);
+
+  root["project"] = this->_project;
+  root["serial"] = this->_serialNumber;
+  if (diagId) {
+    root["id"] = diagId;
+  }
+  root["version"] = SIMPLEIOT_STATE_VERSION;
+  root["size"] = this->stateSnapshot(NULL, 0);
+  root["pending"] = this->_pendingCount;
+
+  JsonObject state = root.createNestedObject("state");
+  for (int i = 0; i < this->_attributeCount; i++) {
+    state[this->_attributes[i].name] = this->_attributes[i].value;
+  }
+
+  this->_sendRawMessage(OP_DIAG_RESULT, root, MESSAGE_SYS);
+}
+
+int SimpleIOT::set(const char* name, const char* value)
+{
+  return this->_setValue(name, value, IOT_STRING);
+}
+
+int SimpleIOT::set(const char* name, int value)
+{
+  char buffer[INTERNAL_STATIC_BUFFER_SIZE + 1];
+  snprintf(buffer, INTERNAL_STATIC_BUFFER_SIZE, "%d", value);
+
+  return this->_setValue(name, buffer, IOT_INT);
+}
+
+int SimpleIOT::set(const char* name, float value)
+{
+  char buffer[INTERNAL_STATIC_BUFFER_SIZE + 1];
+  snprintf(buffer, INTERNAL_STATIC_BUFFER_SIZE, "%.6f", value);
+
+    return this->_setValue(name, buffer, IOT_FLOAT);
+}
+
+int SimpleIOT::set(const char* name, double value)
+{
+  char buffer[INTERNAL_STATIC_BUFFER_SIZE + 1];
+  snprintf(buffer, INTERNAL_STATIC_BUFFER_SIZE, "%.6g", value);
+
+  return this->_setValue(name, buffer, IOT_DOUBLE);
+}
+
+int SimpleIOT::set(const char* name, boolean value)
+{
+  return this->_setValue(name, value ? "true" : "false", IOT_BOOLEAN);
+}
+
+int SimpleIOT::set(const char* name, const char* value, float latitude, float longitude)
+{
+  return this->_setValue(name, value, IOT_STRING, latitude, longitude);
+}
+
+int SimpleIOT::set(const char* name, int value, float latitude, float longitude)
+{
+  char buffer[INTERNAL_STATIC_BUFFER_SIZE + 1];
+  snprintf(buffer, INTERNAL_STATIC_BUFFER_SIZE, "%d", value);
+
+  return this->_setValue(name, buffer, IOT_INT, latitude, longitude);
+}
+
+int SimpleIOT::set(const char* name, float value, float latitude, float longitude)
+{
+  char buffer[INTERNAL_STATIC_BUFFER_SIZE + 1];
+  snprintf(buffer, INTERNAL_STATIC_BUFFER_SIZE, "%.6f", value);
+
+  return this->_setValue(name, buffer, IOT_FLOAT, latitude, longitude);
+}
+
+int SimpleIOT::set(const char* name, double value, float latitude, float longitude)
+{
+  char buffer[INTERNAL_STATIC_BUFFER_SIZE + 1];
+  snprintf(buffer, INTERNAL_STATIC_BUFFER_SIZE, "%.6g", value);
+
+  return this->_setValue(name, buffer, IOT_DOUBLE, latitude, longitude);
+}
+
+int SimpleIOT::set(const char* name, boolean value, float latitude, float longitude)
+{
+  return this->_setValue(name, value ? "true" : "false", IOT_BOOLEAN, latitude, longitude);
+}
+
+
+// All set() calls end up here. The value is recorded in the attribute table, then either
+// sent right away or, if the connection isn't ready yet, queued until it is. In duty-cycle
+// mode values are always queued and go out in the report batch.
+//
+int SimpleIOT::_setValue(const char* name, const char* value, SimpleIOTType type)
+{
+  this->_recordAttribute(name, value, type, 0, 0.0, 0.0);
+  if (!this->_ready || this->_dutyIntervalSecs > 0 || this->_sendMessage(OP_SET_DATA, name, value, MESSAGE_APP) != 0) {
+    return this->_queuePending(name, value, type, 0, 0.0, 0.0);
+  }
+  this->_lastAppPublishMs = millis();
+  return 0;
+}
+
+int SimpleIOT::_setValue(const char* name, const char* value, SimpleIOTType type, float lat, float lng)
+{
+  this->_recordAttribute(name, value, type, SIMPLEIOT_ATTR_HAS_LOCATION, lat, lng);
+  if (!this->_ready || this->_dutyIntervalSecs > 0 || this->_sendMessage(OP_SET_DATA, name, value, lat, lng, MESSAGE_APP) != 0) {
+    return this->_queuePending(name, value, type, SIMPLEIOT_ATTR_HAS_LOCATION, lat, lng);
+  }
+  this->_lastAppPublishMs = millis();
+  return 0;
+}
+
+static void _fillAttribute(SimpleIOTAttribute* attr, const char* name, const char* value, SimpleIOTType type,
+                           uint8_t flags, float lat, float lng)
+{
+  strncpy(attr->name, name, SIMPLEIOT_ATTR_NAME_SIZE - 1);
+  attr->name[SIMPLEIOT_ATTR_NAME_SIZE - 1] = '\0';
+  strncpy(attr->value, value, SIMPLEIOT_ATTR_VALUE_SIZE - 1);
+  attr->value[SIMPLEIOT_ATTR_VALUE_SIZE - 1] = '\0';
+  attr->type = (uint8_t) type;
+  attr->flags = flags;
+  attr->latitude = lat;
+  attr->longitude = lng;
+}
+
+SimpleIOTAttribute* SimpleIOT::_recordAttribute(const char* name, const char* value, SimpleIOTType type,
+                                                uint8_t flags, float lat, float lng)
+{
+  SimpleIOTAttribute* attr = NULL;
+
+  for (int i = 0; i < this->_attributeCount; i++) {
+    if (strncmp(this->_attributes[i].name, name, SIMPLEIOT_ATTR_NAME_SIZE - 1) == 0) {
+      attr = &this->_attributes[i];
+      break;
+    }
+  }
+  if (!attr) {
+    if (this->_attributeCount >= SIMPLEIOT_MAX_ATTRIBUTES) {
+      Serial.print("SimpleIOT: Attribute table full, not tracking: ");
+      Serial.println(name);
+      return NULL;
+    }
+    attr = &this->_attributes[this->_attributeCount++];
+  }
+  _fillAttribute(attr, name, value, type, flags, lat, lng);
+  return attr;
+}
+
+// The pending queue is a ring buffer. If it fills up, the oldest value is dropped since
+// the newest reading is usually the one that matters.
+//
+int SimpleIOT::_queuePending(const char* name, const char* value, SimpleIOTType type,
+                             uint8_t flags, float lat, float lng)
+{
+  int slot;
+
+  if (this->_pendingCount == SIMPLEIOT_MAX_PENDING) {
+    Serial.print("SimpleIOT: Pending queue full, dropping: ");
+    Serial.println(this->_pending[this->_pendingHead].name);
+    this->_pendingHead = (this->_pendingHead + 1) % SIMPLEIOT_MAX_PENDING;
+    this->_pendingCount--;
+    if (this->_pubackCount > 0) {
+      this->_pubackCount--;       // it was in the batch waiting for its PUBACK
+    }
+  }
+  slot = (this->_pendingHead + this->_pendingCount) % SIMPLEIOT_MAX_PENDING;
+  _fillAttribute(&this->_pending[slot], name, value, type, flags, lat, lng);
+  this->_pendingCount++;
+  return 0;
+}
+
+void SimpleIOT::_flushPending()
+{
+  while (this->_ready && this->_pendingCount > 0) {
+    SimpleIOTAttribute* attr = &this->_pending[this->_pendingHead];
+
+    int result;
+
+    if (attr->flags & SIMPLEIOT_ATTR_HAS_LOCATION) {
+      result = this->_sendMessage(OP_SET_DATA, attr->name, attr->value, attr->latitude, attr->longitude, MESSAGE_APP);
+    } else {
+      result = this->_sendMessage(OP_SET_DATA, attr->name, attr->value, MESSAGE_APP);
+    }
+    if (result != 0) {
+      break;          // leave it queued, the reconnect will flush it again
+    }
+    this->_lastAppPublishMs = millis();
+    this->_pendingHead = (this->_pendingHead + 1) % SIMPLEIOT_MAX_PENDING;
+    this->_pendingCount--;
+    if (this->_pendingCount == 0) {
+      this->_pendingSent();
+    }
+  }
+}
+
+int SimpleIOT::addChild(const char* model, const char* serial, SimpleIOTChildDataCallback onData)
+{
+  if (!model || !serial) {
+    return -1;
+  }
+  if (!this->_children) {
+    this->_children = new SimpleIOTChild[SIMPLEIOT_MAX_CHILDREN];
+    this->_childQueue = new SimpleIOTChildValue[SIMPLEIOT_CHILD_QUEUE_SIZE];
+  }
+
+  // Adding the same serial again just updates the handler
+  //
+  for (int i = 0; i < this->_childCount; i++) {
+    if (strncmp(this->_children[i].serial, serial, SIMPLEIOT_CHILD_ID_SIZE - 1) == 0) {
+      this->_children[i].onData = onData;
+      return i;
+    }
+  }
+  if (this->_childCount >= SIMPLEIOT_MAX_CHILDREN) {
+    Serial.print("SimpleIOT: Child table full, can't add: ");
+    Serial.println(serial);
+    return -1;
+  }
+
+  int child = this->_childCount;
+  SimpleIOTChild* entry = &this->_children[child];
+
+  strncpy(entry->model, model, SIMPLEIOT_CHILD_ID_SIZE - 1);
+  entry->model[SIMPLEIOT_CHILD_ID_SIZE - 1] = '\0';
+  strncpy(entry->serial, serial, SIMPLEIOT_CHILD_ID_SIZE - 1);
+  entry->serial[SIMPLEIOT_CHILD_ID_SIZE - 1] = '\0';
+  entry->onData = onData;
+  this->_childCount++;
+
+  // Children added before or during the connect are picked up by the subscribe step
+  //
+  if (this->_ready) {
+    char topic[INTERNAL_TOPIC_BUFFER_SIZE + 1];
+
+    this->_childTopic(topic, SIMPLEIOT_APP_MONITOR_PREFIX, child, "#");
+    Serial.println("SimpleIOT: Subscribing to: " + String(topic));
+    if (this->_mqttClient->subscribe(topic, this->_persistentSession ? 1 : 0)) {
+      this->_subscribedCount = this->_subscribeCount + this->_childCount;
+    }
+  }
+  return child;
+}
+
+const char* SimpleIOT::childSerial(int child)
+{
+  if (child < 0 || child >= this->_childCount) {
+    return NULL;
+  }
+  return this->_children[child].serial;
+}
+
+int SimpleIOT::setChild(int child, const char* name, const char* value)
+{
+  return this->_setChildValue(child, name, value, IOT_STRING);
+}
+
+int SimpleIOT::setChild(int child, const char* name, int value)
+{
+  char buffer[INTERNAL_STATIC_BUFFER_SIZE + 1];
+  snprintf(buffer, INTERNAL_STATIC_BUFFER_SIZE, "%d", value);
+
+  return this->_setChildValue(child, name, buffer, IOT_INT);
+}
+
+int SimpleIOT::setChild(int child, const char* name, float value)
+{
+  char buffer[INTERNAL_STATIC_BUFFER_SIZE + 1];
+  snprintf(buffer, INTERNAL_STATIC_BUFFER_SIZE, "%.6f", value);
+
+  return this->_setChildValue(child, name, buffer, IOT_FLOAT);
+}
+
+int SimpleIOT::setChild(int child, const char* name, double value)
+{
+  char buffer[INTERNAL_STATIC_BUFFER_SIZE + 1];
+  snprintf(buffer, INTERNAL_STATIC_BUFFER_SIZE, "%.6g", value);
+
+  return this->_setChildValue(child, name, buffer, IOT_DOUBLE);
+}
+
+int SimpleIOT::setChild(int child, const char* name, bool value)
+{
+  return this->_setChildValue(child, name, value ? "true" : "false", IOT_BOOLEAN);
+}
+
+// Child values always go through the queue. A newer value for the same child and name
+// replaces the queued one, so a sensor that updates faster than the batch window only
+// sends its latest reading.
+//
+int SimpleIOT::_setChildValue(int child, const char* name, const char* value, SimpleIOTType type)
+{
+  if (child < 0 || child >= this->_childCount || !name || !value) {
+    return -1;
+  }
+  for (int i = 0; i < this->_childQueueCount; i++) {
+    SimpleIOTChildValue* queued = &this->_childQueue[i];
+    if (queued->child == child && strncmp(queued->attr.name, name, SIMPLEIOT_ATTR_NAME_SIZE - 1) == 0) {
+      _fillAttribute(&queued->attr, name, value, type, 0, 0.0, 0.0);
+      return 0;
+    }
+  }
+
+  if (this->_childQueueCount == SIMPLEIOT_CHILD_QUEUE_SIZE) {
+    this->_flushChildren();
+  }
+  if (this->_childQueueCount == SIMPLEIOT_CHILD_QUEUE_SIZE) {
+    // Still full, so we're offline. Drop the oldest, same as the pending queue.
+    //
+    memmove(this->_childQueue, this->_childQueue + 1, (SIMPLEIOT_CHILD_QUEUE_SIZE - 1) * sizeof(SimpleIOTChildValue));
+    this->_childQueueCount--;
+  }
+  if (this->_childQueueCount == 0) {
+    this->_childQueueStartMs = millis();
+  }
+  this->_childQueue[this->_childQueueCount].child = (uint8_t) child;
+  _fillAttribute(&this->_childQueue[this->_childQueueCount].attr, name, value, type, 0, 0.0, 0.0);
+  this->_childQueueCount++;
+  return 0;
+}
+
+// prefix/project/model/serial, then /suffix if there is one
+//
+void SimpleIOT::_childTopic(char* buffer, const char* prefix, int child, const char* suffix)
+{
+  SimpleIOTChild* entry = &this->_children[child];
+
+  if (suffix) {
+    snprintf(buffer, INTERNAL_TOPIC_BUFFER_SIZE, "%s/%s/%s/%s/%s", prefix, this->_project,
+             entry->model, entry->serial, suffix);
+  } else {
+    snprintf(buffer, INTERNAL_TOPIC_BUFFER_SIZE, "%s/%s/%s/%s", prefix, this->_project,
+             entry->model, entry->serial);
+  }
+}
+
+// Which child, if any, an incoming monitor message is for
+//
+int SimpleIOT::_findChild(const char* topic)
+{
+  char prefix[INTERNAL_TOPIC_BUFFER_SIZE + 1];
+
+  if (strncmp(topic, SIMPLEIOT_APP_MONITOR_PREFIX, strlen(SIMPLEIOT_APP_MONITOR_PREFIX)) != 0) {
+    return -1;
+  }
+  for (int i = 0; i < this->_childCount; i++) {
+    this->_childTopic(prefix, SIMPLEIOT_APP_MONITOR_PREFIX, i, "");
+    if (strncmp(topic, prefix, strlen(prefix)) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Send everything queued for the children, in the order it was set. Each value goes to
+// its own child's data topic so the cloud sees each child as a device in its own right.
+//
+void SimpleIOT::_flushChildren()
+{
+DynamicJsonDocument root(SimpleIOTInternalBufferSize);
+char topic[INTERNAL_TOPIC_BUFFER_SIZE + 1];
+char payload[SimpleIOTInternalBufferSize];
+int sent = 0;
+
+  while (this->_ready && sent < this->_childQueueCount) {
+    SimpleIOTChildValue* queued = &this->_childQueue[sent];
+
+    root.clear();
+    root["action"] = "set";
+    root["project"] = this->_project;
+    root["serial"] = this->_children[queued->child].serial;
+    root["name"] = queued->attr.name;
+    root["value"] = queued->attr.value;
+    serializeJson(root, payload);
+
+    this->_childTopic(topic, SIMPLEIOT_APP_TOPIC_PREFIX "/" OP_SET_DATA, queued->child, NULL);
+    if (this->_publish(topic, payload) != 0) {
+      break;          // the rest go out on the next window, or after the reconnect
+    }
+    sent++;
+  }
+
+  if (sent > 0) {
+    this->_childQueueCount -= sent;
+    memmove(this->_childQueue, this->_childQueue + sent, this->_childQueueCount * sizeof(SimpleIOTChildValue));
+    this->_lastAppPublishMs = millis();
+  }
+  this->_childQueueStartMs = millis();
+}
+
+void SimpleIOT::_childStep()
+{
+  if (this->_childQueueCount > 0 && millis() - this->_childQueueStartMs >= this->_childBatchMs) {
+    this->_flushChildren();
+  }
+}
+
+const char* SimpleIOT::get(const char* name)
+{
+  for (int i = 0; i < this->_attributeCount; i++) {
+    if (strncmp(this->_attributes[i].name, name, SIMPLEIOT_ATTR_NAME_SIZE - 1) == 0) {
+      return this->_attributes[i].value;
+    }
+  }
+  return NULL;
+}
+
+// Binary state snapshot. See SimpleIOTStateHeader in SimpleIOT.h for the layout.
+//
+static size_t _packAttribute(uint8_t* out, size_t room, const SimpleIOTAttribute* attr)
+{
+  size_t nameLen = strlen(attr->name);
+  size_t valueLen = strlen(attr->value);
+  size_t needed = 4 + nameLen + valueLen;
+
+  if (attr->flags & SIMPLEIOT_ATTR_HAS_LOCATION) {
+    needed += 2 * sizeof(float);
+  }
+  if (out == NULL || needed > room) {
+    return needed;
+  }
+  *out++ = attr->type;
+  *out++ = attr->flags;
+  *out++ = (uint8_t) nameLen;
+  *out++ = (uint8_t) valueLen;
+  if (attr->flags & SIMPLEIOT_ATTR_HAS_LOCATION) {
+    memcpy(out, &attr->latitude, sizeof(float));
+    out += sizeof(float);
+    memcpy(out, &attr->longitude, sizeof(float));
+    out += sizeof(float);
+  }
+  memcpy(out, attr->name, nameLen);
+  memcpy(out + nameLen, attr->value, valueLen);
+  return needed;
+}
+
+static size_t _unpackAttribute(const uint8_t* in, size_t room, SimpleIOTAttribute* attr)
+{
+  size_t used = 4;
+
+  if (room < used) {
+    return 0;
+  }
+  uint8_t type = in[0];
+  uint8_t flags = in[1];
+  uint8_t nameLen = in[2];
+  uint8_t valueLen = in[3];
+
+  if (nameLen >= SIMPLEIOT_ATTR_NAME_SIZE || valueLen >= SIMPLEIOT_ATTR_VALUE_SIZE) {
+    return 0;
+  }
+  if (flags & SIMPLEIOT_ATTR_HAS_LOCATION) {
+    used += 2 * sizeof(float);
+  }
+  if (room < used + nameLen + valueLen) {
+    return 0;
+  }
+  memset(attr, 0, sizeof(SimpleIOTAttribute));
+  attr->type = type;
+  attr->flags = flags;
+  if (flags & SIMPLEIOT_ATTR_HAS_LOCATION) {
+    memcpy(&attr->latitude, in + 4, sizeof(float));
+    memcpy(&attr->longitude, in + 4 + sizeof(float), sizeof(float));
+  }
+  memcpy(attr->name, in + used, nameLen);
+  memcpy(attr->value, in + used + nameLen, valueLen);
+  return used + nameLen + valueLen;
+}
+
+size_t SimpleIOT::stateSnapshot(uint8_t* buffer, size_t bufferSize)
+{
+  size_t needed = sizeof(SimpleIOTStateHeader);
+  size_t used;
+  int i;
+
+  for (i = 0; i < this->_attributeCount; i++) {
+    needed += _packAttribute(NULL, 0, &this->_attributes[i]);
+  }
+  for (i = 0; i < this->_pendingCount; i++) {
+    needed += _packAttribute(NULL, 0, &this->_pending[(this->_pendingHead + i) % SIMPLEIOT_MAX_PENDING]);
+  }
+  if (buffer == NULL || bufferSize < needed) {
+    return needed;
+  }
+
+  used = sizeof(SimpleIOTStateHeader);
+  for (i = 0; i < this->_attributeCount; i++) {
+    used += _packAttribute(buffer + used, bufferSize - used, &this->_attributes[i]);
+  }
+  for (i = 0; i < this->_pendingCount; i++) {
+    used += _packAttribute(buffer + used, bufferSize - used,
+                           &this->_pending[(this->_pendingHead + i) % SIMPLEIOT_MAX_PENDING]);
+  }
+
+  SimpleIOTStateHeader header;
+  header.magic = SIMPLEIOT_STATE_MAGIC;
+  header.version = SIMPLEIOT_STATE_VERSION;
+  header.attributeCount = (uint8_t) this->_attributeCount;
+  header.pendingCount = (uint8_t) this->_pendingCount;
+  header.crc = crc32_le(0, buffer + sizeof(SimpleIOTStateHeader), used - sizeof(SimpleIOTStateHeader));
+  memcpy(buffer, &header, sizeof(SimpleIOTStateHeader));
+
+  return used;
+}
+
+int SimpleIOT::saveState()
+{
+Preferences prefs;
+
+  size_t size = this->stateSnapshot(NULL, 0);
+  uint8_t* buffer = (uint8_t*) malloc(size);
+  if (!buffer) {
+    return -1;
+  }
+  this->stateSnapshot(buffer, size);
+
+  int result = -1;
+  if (prefs.begin(SIMPLEIOT_NVS_NAMESPACE, false)) {
+    if (prefs.putBytes(SIMPLEIOT_NVS_STATE_KEY, buffer, size) == size) {
+      result = 0;
+    }
+    prefs.end();
+  }
+  free(buffer);
+  if (result == 0) {
+    this->_pendingSaved = this->_pendingCount > 0;
+  }
+
+  #ifdef _DEBUG
+    Serial.printf("SimpleIOT: Saved state, %u bytes, %d attributes, %d pending\n",
+                  size, this->_attributeCount, this->_pendingCount);
+  #endif
+  return result;
+}
+
+int SimpleIOT::clearState()
+{
+Preferences prefs;
+
+  this->_attributeCount = 0;
+  this->_pendingHead = 0;
+  this->_pendingCount = 0;
+  this->_pubackCount = 0;         // a batch in flight has nothing left to take off the queue
+  this->_pendingSaved = false;
+  _rtcStateLength = 0;
+  if (!prefs.begin(SIMPLEIOT_NVS_NAMESPACE, false)) {
+    return -1;
+  }
+  prefs.remove(SIMPLEIOT_NVS_STATE_KEY);
+  prefs.end();
+  return 0;
+}
+
+// Called when the pending queue has been sent. If the saved snapshot still has pending
+// values, cut them off the end, or they'd be sent again after every reboot until the next
+// saveState(). The attribute records are left as they were saved.
+//
+void SimpleIOT::_pendingSent()
+{
+Preferences prefs;
+SimpleIOTStateHeader header;
+
+  _rtcStateLength = 0;
+  if (!this->_pendingSaved || !prefs.begin(SIMPLEIOT_NVS_NAMESPACE, false)) {
+    return;
+  }
+  this->_pendingSaved = false;
+
+  size_t size = prefs.getBytesLength(SIMPLEIOT_NVS_STATE_KEY);
+  uint8_t* buffer = size >= sizeof(SimpleIOTStateHeader) ? (uint8_t*) malloc(size) : NULL;
+
+  if (buffer && prefs.getBytes(SIMPLEIOT_NVS_STATE_KEY, buffer, size) == size) {
+    memcpy(&header, buffer, sizeof(SimpleIOTStateHeader));
+    if (header.magic == SIMPLEIOT_STATE_MAGIC && header.pendingCount > 0) {
+      SimpleIOTAttribute attr;
+      size_t offset = sizeof(SimpleIOTStateHeader);
+
+      for (int i = 0; i < header.attributeCount && offset < size; i++) {
+        size_t used = _unpackAttribute(buffer + offset, size - offset, &attr);
+        if (used == 0) {
+          break;
+        }
+        offset += used;
+      }
+      header.pendingCount = 0;
+      header.crc = crc32_le(0, buffer + sizeof(SimpleIOTStateHeader), offset - sizeof(SimpleIOTStateHeader));
+      memcpy(buffer, &header, sizeof(SimpleIOTStateHeader));
+      prefs.putBytes(SIMPLEIOT_NVS_STATE_KEY, buffer, offset);
+    }
+  }
+  free(buffer);
+  prefs.end();
+}
+
+// Load a snapshot produced by stateSnapshot(). Anything that doesn't validate (wrong magic,
+// newer version, bad crc) is ignored and we keep an empty table.
+//
+bool SimpleIOT::_loadSnapshot(const uint8_t* buffer, size_t size)
+{
+  SimpleIOTStateHeader header;
+
+  if (size < sizeof(SimpleIOTStateHeader)) {
+    return false;
+  }
+  memcpy(&header, buffer, sizeof(SimpleIOTStateHeader));
+  if (header.magic != SIMPLEIOT_STATE_MAGIC || header.version > SIMPLEIOT_STATE_VERSION ||
+      header.crc != crc32_le(0, buffer + sizeof(SimpleIOTStateHeader), size - sizeof(SimpleIOTStateHeader))) {
+    Serial.println("SimpleIOT: Ignoring invalid saved state");
+    return false;
+  }
+
+  SimpleIOTAttribute attr;
+  size_t offset = sizeof(SimpleIOTStateHeader);
+  int total = header.attributeCount + header.pendingCount;
+
+  this->_attributeCount = 0;
+  this->_pendingHead = 0;
+  this->_pendingCount = 0;
+  this->_pendingSaved = false;
+
+  for (int i = 0; i < total; i++) {
+    size_t used = _unpackAttribute(buffer + offset, size - offset, &attr);
+    if (used == 0) {
+      break;
+    }
+    offset += used;
+    if (i < header.attributeCount) {
+      if (this->_attributeCount < SIMPLEIOT_MAX_ATTRIBUTES) {
+        this->_attributes[this->_attributeCount++] = attr;
+      }
+    } else {
+      this->_queuePending(attr.name, attr.value, (SimpleIOTType) attr.type, attr.flags,
+                          attr.latitude, attr.longitude);
+    }
+  }
+  return true;
+}
+
+// Restore the saved snapshot in a single read. After a deep sleep wake in duty-cycle mode
+// the copy in RTC memory is the newest one; otherwise it comes from NVS.
+//
+bool SimpleIOT::_restoreState()
+{
+Preferences prefs;
+unsigned long start = millis();
+bool restored = false;
+
+  if (esp_reset_reason() == ESP_RST_DEEPSLEEP && _rtcStateLength > 0) {
+    restored = this->_loadSnapshot(_rtcState, _rtcStateLength);
+  }
+
+  if (!restored && prefs.begin(SIMPLEIOT_NVS_NAMESPACE, true)) {
+    size_t size = prefs.getBytesLength(SIMPLEIOT_NVS_STATE_KEY);
+    uint8_t* buffer = size > 0 ? (uint8_t*) malloc(size) : NULL;
+
+    if (buffer) {
+      prefs.getBytes(SIMPLEIOT_NVS_STATE_KEY, buffer, size);
+      restored = this->_loadSnapshot(buffer, size);
+      free(buffer);
+    }
+    prefs.end();
+  }
+  if (!restored) {
+    return false;
+  }
+  this->_pendingSaved = this->_pendingCount > 0;
+
+  #ifdef _DEBUG
+    Serial.printf("SimpleIOT: Restored state in %lu ms, %d attributes, %d pending\n",
+                  millis() - start, this->_attributeCount, this->_pendingCount);
+  #endif
+
+  // Values that came from the cloud are handed back to the app, the same as if they
+  // had just arrived, so it can show the last-known settings right away.
+  //
+  if (this->_dataCallback.callback) {
+    for (int i = 0; i < this->_attributeCount; i++) {
+      if (this->_attributes[i].flags & SIMPLEIOT_ATTR_FROM_CLOUD) {
+        this->_dataCallback.callback(this, String(this->_attributes[i].name),
+                                     String(this->_attributes[i].value),
+                                     (SimpleIOTType) this->_attributes[i].type);
+      }
+    }
+  }
+  return true;
+}
+
+// Duty-cycle mode. The device deep sleeps between wakes; each wake takes a sample, and
+// every samplesPerReport wakes it connects and sends everything queued since the last report.
+//
+void SimpleIOT::setDutyCycle(unsigned long reportIntervalSecs, SimpleIOTSampleCallback onSample,
+                             int samplesPerReport)
+{
+  this->_dutyIntervalSecs = reportIntervalSecs;
+  this->_dutySampleCallback = onSample;
+  this->_dutySamplesPerReport = samplesPerReport > 0 ? samplesPerReport : 1;
+
+  // Every sample has to fit in the pending queue until the report
+  //
+  if (this->_dutySamplesPerReport > SIMPLEIOT_MAX_PENDING) {
+    Serial.printf("SimpleIOT: %d samples per report won't fit in the pending queue, using %d\n",
+                  this->_dutySamplesPerReport, SIMPLEIOT_MAX_PENDING);
+    this->_dutySamplesPerReport = SIMPLEIOT_MAX_PENDING;
+  }
+}
+
+unsigned long SimpleIOT::lastRadioOnTime()
+{
+  return _rtcRadioOnMs;
+}
+
+unsigned long SimpleIOT::wakeCount()
+{
+  return _rtcWakeCount;
+}
+
+// Called from config() in duty-cycle mode, once the saved state is back. Returns true if this
+// wake should connect and report. Otherwise we're done already and go right back to sleep.
+// A sample that sets several values can fill the queue before the report is due, so we also
+// report early if another wake's worth of values wouldn't fit.
+//
+bool SimpleIOT::_dutyCycleWake()
+{
+  int queued = this->_pendingCount;
+
+  if (esp_reset_reason() != ESP_RST_DEEPSLEEP) {
+    _rtcWakeCount = 0;
+    _rtcRadioOnMs = 0;
+  }
+  _rtcWakeCount++;
+
+  if (this->_dutySampleCallback) {
+    this->_dutySampleCallback(this);
+  }
+  int added = this->_pendingCount - queued;
+  if ((_rtcWakeCount - 1) % this->_dutySamplesPerReport != 0 && this->_pendingCount + added <= SIMPLEIOT_MAX_PENDING) {
+    this->_dutyCycleSleep();      // does not return
+  }
+  return true;
+}
+
+// The record of an update on probation, see _otaCheckPending
+//
+static void _otaPendingSave(SimpleIOTOTAPending* pending)
+{
+Preferences prefs;
+
+  if (prefs.begin(SIMPLEIOT_NVS_NAMESPACE, false)) {
+    prefs.putBytes(SIMPLEIOT_NVS_PENDING_KEY, pending, sizeof(SimpleIOTOTAPending));
+    prefs.end();
+  }
+}
+
+static void _otaPendingClear()
+{
+Preferences prefs;
+
+  if (prefs.begin(SIMPLEIOT_NVS_NAMESPACE, false)) {
+    prefs.remove(SIMPLEIOT_NVS_PENDING_KEY);
+    prefs.end();
+  }
+}
+
+// Shut the radio down, keep the state in RTC memory, and deep sleep until the next sample
+// is due. The time we've been awake comes off the sleep so the period stays steady.
+//
+void SimpleIOT::_dutyCycleSleep()
+{
+  unsigned long periodMs = (this->_dutyIntervalSecs * 1000UL) / this->_dutySamplesPerReport;
+  unsigned long awakeMs = millis();
+
+  if (this->_radioOnStartMs) {
+    if (this->_mqttClient) {
+      this->_mqttClient->stop();
+    }
+    WiFi.disconnect(true);
+    WiFi.mode(WIFI_OFF);
+    _rtcRadioOnMs = millis() - this->_radioOnStartMs;
+    this->_radioOnStartMs = 0;
+  }
+
+  size_t size = this->stateSnapshot(NULL, 0);
+  if (size <= sizeof(_rtcState)) {
+    _rtcStateLength = this->stateSnapshot(_rtcState, sizeof(_rtcState));
+  } else {
+    _rtcStateLength = 0;
+    this->saveState();          // too big for RTC memory, NVS will have to do
+  }
+
+  // Probation time carries over the sleep, or new firmware that never connects would get a
+  // fresh deadline on every wake and never be rolled back
+  //
+  if (this->_otaProbation) {
+    this->_otaPending.awakeMs += awakeMs;
+    _otaPendingSave(&this->_otaPending);
+  }
+
+  unsigned long sleepMs = periodMs > awakeMs + DUTY_CYCLE_MIN_SLEEP_MS ? periodMs - awakeMs : DUTY_CYCLE_MIN_SLEEP_MS;
+
+  Serial.printf("SimpleIOT: Awake %lu ms, radio on %lu ms. Sleeping %lu ms\n", awakeMs, _rtcRadioOnMs, sleepMs);
+  Serial.flush();
+
+  esp_sleep_enable_timer_wakeup((uint64_t) sleepMs * 1000ULL);
+  esp_deep_sleep_start();
+}
+
+// Once a report wake is connected, send the queue as a QoS 1 batch and wait for the PUBACK.
+// The broker handles a connection's packets in order, so the PUBACK also means the reports
+// sent ahead of the batch got there. Values only come off the queue once their batch is
+// acknowledged. If the PUBACK doesn't come, or we can't connect at all, we give up after a
+// while and keep the queue for the next report.
+//
+void SimpleIOT::_dutyCycleStep()
+{
+  if (this->_connState != IOT_CONN_READY) {
+    if (millis() > DUTY_CYCLE_MAX_AWAKE_MS) {
+      Serial.println("SimpleIOT: Could not report this cycle, going back to sleep");
+      this->_dutyCycleSleep();
+    }
+    return;
+  }
+
+  // All acknowledged on the last call. loop() has polled once since, so anything that came in
+  // while we were reading the stream ourselves has been handed to the app.
+  //
+  if (this->_dutyReported) {
+    this->_dutyCycleSleep();
+  }
+
+  if (this->_pubackId != 0) {
+    int ret = this->_pubackCheck();
+    if (ret == 0 && millis() - this->_pubackStartMs <= DUTY_CYCLE_ACK_TIMEOUT_MS) {
+      return;
+    }
+    if (ret != 1) {
+      Serial.printf("SimpleIOT: Report not acknowledged, keeping %d values for the next one\n", this->_pendingCount);
+      this->_publishFailCount++;
+      this->_dutyCycleSleep();
+    }
+  }
+
+  if (this->_pendingCount > 0) {
+    if (this->_sendPendingBatch() != 0) {
+      Serial.println("SimpleIOT: Could not send report, going back to sleep");
+      this->_dutyCycleSleep();
+    }
+    return;
+  }
+  this->_dutyReported = true;
+}
+
+/*
+ * payload: {
+ *          "action": "set",
+ *          "project": "Sunshine",
+ *          "serial": "TIE-DEMO01",
+ *          "values": [
+ *            { "name": "oil_pressure", "value": "20" },
+ *            { "name": "position", "value": "1", "geo_lat": "12.2", "geo_lng": "-123.4" }
+ *          ]
+ *          }
+ *
+ * The duty-cycle report batch, sent at QoS 1. A full pending queue fits in one message; if
+ * the values are too long for that, the rest go in another once this one is acknowledged.
+ * The PUBLISH is built here rather than by MqttClient so we know its packet id.
+ */
+int SimpleIOT::_sendPendingBatch()
+{
+DynamicJsonDocument root(DUTY_CYCLE_BATCH_SIZE);
+char topic[INTERNAL_TOPIC_BUFFER_SIZE + 1];
+char latLng[10];
+int count = 0;
+
+  root["action"] = "set";
+  root["project"] = this->_project;
+  root["serial"] = this->_serialNumber;
+  JsonArray values = root.createNestedArray("values");
+
+  while (count < this->_pendingCount) {
+    SimpleIOTAttribute* attr = &this->_pending[(this->_pendingHead + count) % SIMPLEIOT_MAX_PENDING];
+    JsonObject entry = values.createNestedObject();
+
+    entry["name"] = attr->name;
+    entry["value"] = attr->value;
+    if (attr->flags & SIMPLEIOT_ATTR_HAS_LOCATION) {
+      sprintf(latLng, "%3.4f", attr->latitude);
+      entry["geo_lat"] = String(latLng);
+      sprintf(latLng, "%3.4f", attr->longitude);
+      entry["geo_lng"] = String(latLng);
+    }
+    if (root.overflowed() || measureJson(root) >= DUTY_CYCLE_BATCH_SIZE) {
+      values.remove(count);
+      break;
+    }
+    count++;
+  }
+  if (count == 0) {
+    return -1;
+  }
+
+  snprintf(topic, INTERNAL_TOPIC_BUFFER_SIZE, "%s/%s/%s/%s/%s", SIMPLEIOT_APP_TOPIC_PREFIX, OP_SET_BATCH,
+           this->_project, this->_model, this->_serialNumber);
+  size_t topicLength = strlen(topic);
+  size_t payloadLength = measureJson(root);
+  size_t remaining = 2 + topicLength + 2 + payloadLength;
+
+  // Room for the longest fixed header, and the terminator serializeJson adds
+  //
+  uint8_t* packet = (uint8_t*) malloc(5 + remaining + 1);
+  if (!packet) {
+    return -1;
+  }
+  uint16_t packetId = MQTT_PACKET_ID_BASE + (this->_packetId++ & 0x0FFF);
+  uint8_t* p = packet + _mqttFixedHeader(packet, MQTT_PUBLISH_QOS1, remaining);
+  *p++ = topicLength >> 8;
+  *p++ = topicLength & 0xFF;
+  memcpy(p, topic, topicLength);
+  p += topicLength;
+  *p++ = packetId >> 8;
+  *p++ = packetId & 0xFF;
+  serializeJson(root, (char*) p, payloadLength + 1);
+  p += payloadLength;
+
+  #ifdef _DEBUG
+    Serial.printf("SimpleIOT: Sending %d of %d queued values in one batch\n", count, this->_pendingCount);
+  #endif
+
+  size_t packetLength = p - packet;
+  bool written = this->_wifiClient->write(packet, packetLength) == packetLength;
+  free(packet);
+  if (!written) {
+    this->_publishFailCount++;
+    this->_errorSinceHeartbeat = true;
+    return -1;
+  }
+  this->_publishCount++;
+  this->_pubackId = packetId;
+  this->_pubackCount = count;
+  this->_pubackStartMs = millis();
+  return 0;
+}
+
+// Check for the batch's PUBACK without waiting. Returns 1 once it's in and the batch is off
+// the queue, 0 if it hasn't arrived yet, -1 if it never will.
+//
+int SimpleIOT::_pubackCheck()
+{
+  uint8_t* body = NULL;
+  size_t bodyLength = 0;
+  int ret = this->_readAck(MQTT_PUBACK, this->_pubackId, &body, &bodyLength);
+
+  if (ret != 1) {
+    return ret;
+  }
+  free(body);
+  this->_pendingHead = (this->_pendingHead + this->_pubackCount) % SIMPLEIOT_MAX_PENDING;
+  this->_pendingCount -= this->_pubackCount;
+  this->_pubackId = 0;
+  this->_pubackCount = 0;
+  this->_lastAppPublishMs = millis();
+  if (this->_pendingCount == 0) {
+    this->_pendingSent();
+  }
+  return 1;
+}
+
+void SimpleIOT::_sendDutyCycleReport()
+{
+DynamicJsonDocument root(SimpleIOTInternalBufferSize);
+
+  root["project"] = this->_project;
+  root["serial"] = this->_serialNumber;
+  root["wakes"] = _rtcWakeCount;
+  root["radio_ms"] = _rtcRadioOnMs;       // previous report cycle
+  root["queued"] = this->_pendingCount;
+
+  this->_sendRawMessage(OP_DUTY_CYCLE, root, MESSAGE_SYS);
+}
+
+
+// Find the Greengrass core, from the app's handler if there is one, otherwise from cloud
+// discovery. The result is saved so later boots can skip this.
+//
+int SimpleIOT::_discover()
+{
+  int ret;
+
+  memset(this->_ggCore, 0, sizeof(SimpleIOTGGCore));
+  if (this->_discoveryHandler) {
+    ret = this->_discoveryHandler(this, this->_ggCore);
+  } else {
+    ret = this->_cloudDiscover(this->_ggCore);
+  }
+  this->_ggCore->ca[SIMPLEIOT_GG_CA_SIZE - 1] = '\0';
+  if (ret != 0 || this->_ggCore->addressCount == 0 || this->_ggCore->ca[0] == '\0') {
+    return -1;
+  }
+  if (this->_ggCore->addressCount > SIMPLEIOT_GG_MAX_ADDRESSES) {
+    this->_ggCore->addressCount = SIMPLEIOT_GG_MAX_ADDRESSES;
+  }
+  this->_ggCore->magic = SIMPLEIOT_GG_MAGIC;
+  this->_ggCore->addressIndex = 0;
+  this->_ggCoreValid = true;
+  this->_ggFailures = 0;
+
+  // A new group CA invalidates any session we had with the old core
+  //
+  this->_ggCredentials.setPem(this->_ggCore->ca, NULL, NULL);
+  this->_wifiClient->clearSession();
+  this->_saveGatewayCache();
+
+  Serial.printf("SimpleIOTGW: Discovered %d core address(es)\n", this->_ggCore->addressCount);
+  return 0;
+}
+
+// Greengrass discovery: an HTTPS GET on port 8443 of the IOT endpoint, authenticated with the
+// device certificate. We take the first core of the first group, and its group CA.
+//
+int SimpleIOT::_cloudDiscover(SimpleIOTGGCore* core)
+{
+SimpleIOTSecureClient secureClient;     // declared first so it outlives the HTTPClient
+HTTPClient client;
+DynamicJsonDocument doc(GG_DISCOVERY_DOC_SIZE);
+
+  String url = String("https://") + this->_iotEndpoint + ":" + String(GG_DISCOVERY_PORT) +
+               GG_DISCOVERY_PATH + this->_serialNumber;
+
+  Serial.println("SimpleIOTGW: Running Greengrass discovery");
+  secureClient.setCredentials(&this->_credentials);
+  secureClient.setSessionResumption(false);
+  if (!client.begin(secureClient, url)) {
+    return -1;
+  }
+  int resp = client.GET();
+  if (resp != HTTP_CODE_OK) {
+    Serial.printf("SimpleIOTGW: ERROR: Discovery returned %d\n", resp);
+    client.end();
+    return -1;
+  }
+  DeserializationError err = deserializeJson(doc, client.getString());
+  client.end();
+  if (err) {
+    Serial.print("SimpleIOTGW: ERROR: Can't parse discovery response: ");
+    Serial.println(err.c_str());
+    return -1;
+  }
+
+  JsonVariant group = doc["GGGroups"][0];
+  JsonVariant connectivity = group["Cores"][0]["Connectivity"];
+
+  for (size_t i = 0; i < connectivity.size() && core->addressCount < SIMPLEIOT_GG_MAX_ADDRESSES; i++) {
+    const char* host = connectivity[i]["HostAddress"] | "";
+    int port = connectivity[i]["PortNumber"] | IOT_MQTT_PORT;
+
+    // The core lists its own loopback addresses too, which are no use to us
+    //
+    if (host[0] == '\0' || strlen(host) >= SIMPLEIOT_GG_HOST_SIZE ||
+        strncmp(host, "127.", 4) == 0 || strcmp(host, "::1") == 0 || strcmp(host, "localhost") == 0) {
+      continue;
+    }
+    SimpleIOTGGAddress* address = &core->addresses[core->addressCount++];
+    strcpy(address->host, host);
+    address->port = (uint16_t) port;
+  }
+
+  const char* ca = group["CAs"][0] | "";
+  if (strlen(ca) >= SIMPLEIOT_GG_CA_SIZE) {
+    Serial.println("SimpleIOTGW: ERROR: Group CA too big");
+    return -1;
+  }
+  strcpy(core->ca, ca);
+  return 0;
+}
+
+// The gateway and direct paths share the MQTT and TLS clients. Only the CA the server is
+// checked against changes.
+//
+void SimpleIOT::_setPath(SimpleIOTPath path)
+{
+  this->_path = path;
+  this->_subscribedCount = 0;         // a different broker, so a different session
+  if (path == IOT_PATH_GATEWAY) {
+    this->_wifiClient->setCredentials(&this->_credentials, true, &this->_ggCredentials);
+  } else {
+    this->_wifiClient->setCredentials(&this->_credentials);
+    this->_lastFailbackCheckMs = millis();
+  }
+}
+
+// Add the time since the connection came up to the current path's total
+//
+void SimpleIOT::_leavePath()
+{
+  if (this->_ready) {
+    this->_pathMs[this->_path] += millis() - this->_pathReadyMs;
+  }
+}
+
+// Health check for failback: can we open a TCP connection to the core? If none of the saved
+// addresses answer, rediscover on the next check in case the core has moved.
+//
+bool SimpleIOT::_gatewayAlive()
+{
+  if (!this->_ggCoreValid && this->_discover() != 0) {
+    return false;
+  }
+  for (int i = 0; i < this->_ggCore->addressCount; i++) {
+    int index = (this->_ggCore->addressIndex + i) % this->_ggCore->addressCount;
+    WiFiClient probe;
+
+    if (probe.connect(this->_ggCore->addresses[index].host, this->_ggCore->addresses[index].port,
+                      GG_HEALTH_CHECK_TIMEOUT_MS)) {
+      probe.stop();
+      this->_ggCore->addressIndex = index;
+      return true;
+    }
+  }
+  this->_ggCoreValid = false;
+  return false;
+}
+
+void SimpleIOT::_failbackStep()
+{
+  if (!this->_failover || !this->_withGateway || this->_path != IOT_PATH_DIRECT ||
+      millis() - this->_lastFailbackCheckMs < this->_failbackCheckMs) {
+    return;
+  }
+  this->_lastFailbackCheckMs = millis();
+  if (!this->_gatewayAlive()) {
+    return;
+  }
+
+  // Anything set() from here until the gateway connection is up gets queued
+  //
+  Serial.println("SimpleIOTGW: Core is back, moving to the gateway");
+  this->_leavePath();
+  this->_ready = false;
+  this->_mqttClient->stop();
+  this->_setPath(IOT_PATH_GATEWAY);
+  memset(this->_phaseMs, 0, sizeof(this->_phaseMs));
+  memset(this->_phaseUs, 0, sizeof(this->_phaseUs));
+  this->_setConnState(IOT_CONN_CONNECT);
+}
+
+bool SimpleIOT::_loadGatewayCache()
+{
+Preferences prefs;
+bool loaded = false;
+
+  if (prefs.begin(SIMPLEIOT_NVS_NAMESPACE, true)) {
+    if (prefs.getBytes(SIMPLEIOT_NVS_GG_KEY, this->_ggCore, sizeof(SimpleIOTGGCore)) == sizeof(SimpleIOTGGCore) &&
+        this->_ggCore->magic == SIMPLEIOT_GG_MAGIC && this->_ggCore->addressCount > 0 &&
+        this->_ggCore->addressCount <= SIMPLEIOT_GG_MAX_ADDRESSES &&
+        this->_ggCore->addressIndex < this->_ggCore->addressCount) {
+      this->_ggCore->ca[SIMPLEIOT_GG_CA_SIZE - 1] = '\0';
+      this->_ggCredentials.setPem(this->_ggCore->ca, NULL, NULL);
+      loaded = true;
+    }
+    prefs.end();
+  }
+  if (loaded) {
+    Serial.println("SimpleIOTGW: Using saved Greengrass core");
+  }
+  return loaded;
+}
+
+void SimpleIOT::_saveGatewayCache()
+{
+Preferences prefs;
+
+  if (prefs.begin(SIMPLEIOT_NVS_NAMESPACE, false)) {
+    prefs.putBytes(SIMPLEIOT_NVS_GG_KEY, this->_ggCore, sizeof(SimpleIOTGGCore));
+    prefs.end();
+  }
+}
+
+// Connect profile, sent once per connect so boot and reconnect latency can be looked at
+// across a fleet. All times are in microseconds.
+//
+void SimpleIOT::_sendConnectReport()
+{
+DynamicJsonDocument root(SimpleIOTInternalBufferSize);
+
+  root["wifi"] = this->_phaseUs[IOT_PHASE_WIFI_ASSOC];
+  root["dhcp"] = this->_phaseUs[IOT_PHASE_DHCP];
+  if (this->_withGateway) {
+    root["path"] = this->_path == IOT_PATH_GATEWAY ? "gg" : "direct";
+    root["gg"] = this->_phaseUs[IOT_PHASE_DISCOVERY];     // 0 if the saved core was used
+  }
+  root["dns"] = this->_phaseUs[IOT_PHASE_DNS];
+  root["tcp"] = this->_phaseUs[IOT_PHASE_TCP];
+  root["tls"] = this->_phaseUs[IOT_PHASE_TLS];
+  root["mqtt"] = this->_phaseUs[IOT_PHASE_MQTT_CONNECT];
+  root["resumed"] = this->_wifiClient->lastResumed();
+  root["sub"] = this->_phaseUs[IOT_PHASE_SUBSCRIBE];
+  root["fast"] = this->_wifiFastAttempt;
+  root["rc"] = this->_reconnectCount;
+
+  this->_sendRawMessage(OP_CONNECT_REPORT, root, MESSAGE_SYS);
+}
+
+void SimpleIOT::setHeartbeat(unsigned long intervalSecs)
+{
+  this->_heartbeatIntervalMs = intervalSecs * 1000UL;
+  this->_lastHeartbeatMs = millis();
+}
+
+// Keys are kept short on purpose since this goes out on every heartbeat. Project, model and
+// serial are already in the topic.
+//
+int SimpleIOT::sendHeartbeat()
+{
+DynamicJsonDocument root(SimpleIOTInternalBufferSize);
+
+  if (!this->_ready) {
+    return -1;
+  }
+  root["up"] = millis() / 1000;
+  root["heap"] = ESP.getFreeHeap();
+  root["blk"] = ESP.getMaxAllocHeap();
+  root["rssi"] = WiFi.RSSI();
+  root["pq"] = this->_pendingCount;
+  root["cq"] = this->_childQueueCount;
+  root["pub"] = this->_publishCount;
+  root["perr"] = this->_publishFailCount;
+  root["rc"] = this->_reconnectCount;
+  if (this->_withGateway) {
+    root["path"] = this->_path == IOT_PATH_GATEWAY ? "gg" : "direct";
+    root["ggs"] = this->pathTime(IOT_PATH_GATEWAY);
+    root["ds"] = this->pathTime(IOT_PATH_DIRECT);
+  }
+
+  this->_lastHeartbeatMs = millis();
+  this->_errorSinceHeartbeat = false;
+  return this->_sendRawMessage(OP_HEARTBEAT, root, MESSAGE_SYS);
+}
+
+unsigned long SimpleIOT::_heartbeatInterval()
+{
+  unsigned long interval = this->_heartbeatIntervalMs;
+
+  if (this->_errorSinceHeartbeat) {
+    interval = max(interval / HEARTBEAT_SHRINK, (unsigned long) HEARTBEAT_MIN_MS);
+  } else if (this->_lastAppPublishMs > this->_lastHeartbeatMs) {
+    interval *= HEARTBEAT_STRETCH;
+  }
+  return interval;
+}
+
+void SimpleIOT::_heartbeatStep()
+{
+  if (this->_heartbeatIntervalMs == 0) {
+    return;
+  }
+  if (millis() - this->_lastHeartbeatMs >= this->_heartbeatInterval()) {
+    this->sendHeartbeat();
+  }
+}
+
+
+unsigned long SimpleIOT::loop()
+{
+    if (this->_connState != IOT_CONN_READY) {
+        this->_connectStep();
+    } else if (!this->_isConnected()) {
+        this->_connectionLost();
+    } else {
+        // While a duty-cycle batch waits for its PUBACK, we read the stream ourselves
+        //
+        if (this->_mqttClient && this->_pubackId == 0) {
+            this->_mqttClient->poll();
+        }
+        this->_childStep();
+        this->_heartbeatStep();
+        this->_failbackStep();
+    }
+    if (this->_dutyIntervalSecs > 0) {
+        this->_dutyCycleStep();
+    }
+    if (this->_otaAsync && this->_otaState != IOT_OTA_IDLE) {
+        this->_otaStep();
+    }
+    if (this->_otaProbation || this->_otaRollbackReport) {
+        this->_otaConfirmStep();
+    }
+
+    unsigned long next = this->_nextDeadline();
+    this->_loopDeadlineMs = millis() + next;
+    return next;
+}
+
+void SimpleIOT::loop(float delayMs)
+{
+    this->loop();
+    if (delayMs > 0) {
+        delay(delayMs);
+    }
+}
+
+// Milliseconds until the earliest thing loop() has to do. Everything here is measured from
+// millis() with unsigned subtraction, so it's safe across the 49 day wrap.
+//
+static unsigned long _msUntil(unsigned long startMs, unsigned long periodMs)
+{
+    unsigned long elapsed = millis() - startMs;
+    return elapsed >= periodMs ? 0 : periodMs - elapsed;
+}
+
+unsigned long SimpleIOT::_nextDeadline()
+{
+    // MqttClient sends its PINGREQ from poll(), so poll well inside the keepalive
+    //
+    unsigned long next = SIMPLEIOT_MQTT_KEEPALIVE_MS / 4;
+
+    switch (this->_connState) {
+      case IOT_CONN_IDLE:
+        break;
+      case IOT_CONN_WIFI:
+        next = LOOP_WIFI_POLL_MS;
+        break;
+      case IOT_CONN_CONNECT:
+        next = 0;
+        break;
+      case IOT_CONN_SUBSCRIBE:
+        next = this->_subackId == 0 ? 0 : min((unsigned long) LOOP_PACKET_POLL_MS,
+                                               _msUntil(this->_subackStartMs, SUBACK_TIMEOUT_MS + 1));
+        break;
+      case IOT_CONN_FAILED:
+        next = _msUntil(this->_phaseStartMs, this->_retryDelayMs + 1);
+        break;
+      case IOT_CONN_READY:
+        if (this->_heartbeatIntervalMs > 0) {
+          next = min(next, _msUntil(this->_lastHeartbeatMs, this->_heartbeatInterval()));
+        }
+        if (this->_childQueueCount > 0) {
+          next = min(next, _msUntil(this->_childQueueStartMs, this->_childBatchMs));
+        }
+        if (this->_failover && this->_withGateway && this->_path == IOT_PATH_DIRECT) {
+          next = min(next, _msUntil(this->_lastFailbackCheckMs, this->_failbackCheckMs));
+        }
+        break;
+    }
+
+    if (this->_otaAsync && this->_otaState != IOT_OTA_IDLE && !this->_otaReported) {
+      next = min(next, (unsigned long) OTA_PROGRESS_POLL_MS);
+    }
+    if (this->_otaProbation) {
+      unsigned long spent = this->_otaPending.awakeMs;
+      next = min(next, _msUntil(0, (spent < this->_otaConfirmTimeoutMs ? this->_otaConfirmTimeoutMs - spent : 0) + 1));
+      if (this->_ready) {
+        next = this->_otaConfirmFailed ? min(next, _msUntil(this->_otaConfirmTriedMs, OTA_CONFIRM_RETRY_MS)) : 0;
+      }
+    }
+    if (this->_dutyIntervalSecs > 0) {
+      if (this->_connState != IOT_CONN_READY) {
+        next = min(next, _msUntil(0, DUTY_CYCLE_MAX_AWAKE_MS + 1));
+      } else if (this->_pubackId != 0) {
+        next = min(next, min((unsigned long) LOOP_PACKET_POLL_MS, _msUntil(this->_pubackStartMs, DUTY_CYCLE_ACK_TIMEOUT_MS + 1)));
+      } else {
+        next = 0;         // a batch to send, or we're done and about to sleep
+      }
+    }
+    return next;
+}
+
+unsigned long SimpleIOT::idle(unsigned long maxMs, SimpleIOTWakeCallback wake)
+{
+    unsigned long start = millis();
+    long untilDeadline = (long) (this->_loopDeadlineMs - start);
+
+    if (untilDeadline <= 0) {
+      return 0;
+    }
+    unsigned long wait = min(maxMs, (unsigned long) untilDeadline);
+
+    while (millis() - start < wait) {
+      if (wake && wake(this)) {
+        break;
+      }
+      if (this->_connState == IOT_CONN_READY && this->_pubackId == 0 && this->_wifiClient && this->_wifiClient->available() > 0) {
+        break;
+      }
+      if ((this->_connState == IOT_CONN_SUBSCRIBE || this->_pubackId != 0) && this->_wifiClient &&
+          this->_wifiClient->rawAvailable() > 0) {
+        break;
+      }
+      if (this->_connState == IOT_CONN_WIFI && WiFi.status() == WL_CONNECTED) {
+        break;
+      }
+      delay(min((unsigned long) IDLE_SLICE_MS, wait - (millis() - start)));
+    }
+    return millis() - start;
+}
+
+
+// Utility to extract header value from headers
+String getHeaderValue(String header, String headerName) {
+  return header.substring(strlen(headerName.c_str()));
+}
+
+// Based on ESP32 OTA system. This should be abstracted out so it can run on any processor
+// 
+// NOTE that the URL only works with S3/CloudFront since it downloads via SSL and the HTTP client needs the
+// RootCA of the server. We happen to have it as part of OTA connection so it only works with 
+// OTA updates hosted on AWS services.
+//
+// References:
+//
+// - https://github.com/kurimawxx00/webota-esp32/blob/main/WebOTA.ino
+// - https://techtutorialsx.com/2017/11/18/esp32-arduino-https-get-request/
+//
+
+// Resume point for an interrupted OTA download. The key ties it to one image: the URL
+// without its query string (presigned URLs change every time) and the expected hashes.
+//
+static uint32_t _otaResumeKey(const char* url, const char* md5, const char* sha256)
+{
+  const char* query = strchr(url, '?');
+  size_t length = query ? query - url : strlen(url);
+  uint32_t crc = crc32_le(0, (const uint8_t*) url, length);
+
+  crc = crc32_le(crc, (const uint8_t*) md5, strlen(md5));
+  return crc32_le(crc, (const uint8_t*) sha256, strlen(sha256));
+}
+
+static bool _otaResumeLoad(SimpleIOTOTAResume* resume, uint32_t key)
+{
+Preferences prefs;
+bool loaded = false;
+
+  if (prefs.begin(SIMPLEIOT_NVS_NAMESPACE, true)) {
+    loaded = prefs.getBytes(SIMPLEIOT_NVS_OTA_KEY, resume, sizeof(SimpleIOTOTAResume)) == sizeof(SimpleIOTOTAResume) &&
+             resume->magic == SIMPLEIOT_OTA_MAGIC && resume->key == key && resume->offset > 0 &&
+             resume->offset < resume->total;
+    prefs.end();
+  }
+  if (loaded) {
+    resume->etag[SIMPLEIOT_OTA_ETAG_SIZE - 1] = '\0';
+  }
+  return loaded;
+}
+
+// Called with the flash and the hashes at the same point, either on the writer task right
+// after a write or after the writer has been flushed.
+//
+static void _otaResumeSave(SimpleIOTOTAJob* job)
+{
+Preferences prefs;
+
+  job->resume->offset = job->received;
+  job->verifier->saveState(&job->resume->hash);
+  job->savedOffset = job->resume->offset;
+  if (job->resume->etag[0] == '\0' || job->resume->total == 0) {
+    return;                 // can't resume without knowing it's the same file
+  }
+
+  // The inflater's window is too big to keep, and the patcher's position in the base isn't
+  // saved, so these downloads can only be resumed within the same performOTA call. Files are
+  // small enough to just start over.
+  //
+  if (job->compressed || job->patcher || job->file) {
+    return;
+  }
+  if (prefs.begin(SIMPLEIOT_NVS_NAMESPACE, false)) {
+    prefs.putBytes(SIMPLEIOT_NVS_OTA_KEY, job->resume, sizeof(SimpleIOTOTAResume));
+    prefs.end();
+  }
+}
+
+static void _otaResumeClear()
+{
+Preferences prefs;
+
+  if (prefs.begin(SIMPLEIOT_NVS_NAMESPACE, false)) {
+    prefs.remove(SIMPLEIOT_NVS_OTA_KEY);
+    prefs.end();
+  }
+}
+
+static const esp_partition_t* _otaPartitionAt(uint32_t address)
+{
+  const esp_partition_t* found = NULL;
+  esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, NULL);
+
+  for (; it != NULL && found == NULL; it = esp_partition_next(it)) {
+    if (esp_partition_get(it)->address == address) {
+      found = esp_partition_get(it);
+    }
+  }
+  esp_partition_iterator_release(it);
+  return found;
+}
+
+// The image itself, after inflating if it was compressed: hash it and write it
+//
+static int _otaImageSink(void* context, const uint8_t* data, size_t length)
+{
+  SimpleIOTOTAJob* job = (SimpleIOTOTAJob*) context;
+
+  job->verifier->update(data, length);
+  if (job->file) {
+    return job->file->write(data, length);
+  }
+  return job->flash->write(data, length);
+}
+
+// Start writing a firmware image or a file at offset
+//
+static int _otaBegin(SimpleIOTOTAJob* job, size_t offset)
+{
+  if (job->file) {
+    return job->file->begin(job->file->path(), offset);
+  }
+  return job->flash->begin(offset);
+}
+
+// After inflating: apply the patch for a delta, otherwise it's the image
+//
+static int _otaStreamSink(void* context, const uint8_t* data, size_t length)
+{
+  SimpleIOTOTAJob* job = (SimpleIOTOTAJob*) context;
+
+  if (job->patcher) {
+    return job->patcher->write(data, length);
+  }
+  return _otaImageSink(context, data, length);
+}
+
+// Flash writes for the download pipeline. Runs on the writer task, so hashing, inflating and
+// patching also stay off the network side.
+//
+static int _otaFlashSink(void* context, const uint8_t* data, size_t length)
+{
+  SimpleIOTOTAJob* job = (SimpleIOTOTAJob*) context;
+  int ret;
+
+  // A gzip image is spotted by its magic bytes, or the update message can say so
+  //
+  if (job->received == 0 && (job->gzip || SimpleIOTOTAInflater::isGzip(data, length))) {
+    Serial.println("SimpleIOT: Compressed image, inflating");
+    job->compressed = true;
+    if (job->inflater->begin(_otaStreamSink, job) != 0) {
+      return -1;
+    }
+  }
+  if (job->compressed) {
+    ret = job->inflater->write(data, length);
+  } else {
+    ret = _otaStreamSink(job, data, length);
+  }
+  if (ret != 0) {
+    return -1;
+  }
+  job->received += length;
+  if (job->received - job->savedOffset >= OTA_RESUME_SAVE_BYTES) {
+    _otaResumeSave(job);
+  }
+  return 0;
+}
+
+void SimpleIOT::setOTAHash(const char* md5, const char* sha256, const char* signature)
+{
+  strncpy(this->_otaMd5, md5 ? md5 : "", SIMPLEIOT_OTA_MD5_SIZE - 1);
+  this->_otaMd5[SIMPLEIOT_OTA_MD5_SIZE - 1] = '\0';
+  strncpy(this->_otaSha256, sha256 ? sha256 : "", SIMPLEIOT_OTA_SHA256_SIZE - 1);
+  this->_otaSha256[SIMPLEIOT_OTA_SHA256_SIZE - 1] = '\0';
+  this->_otaSignatureLength = 0;
+  if (signature && *signature) {
+    if (mbedtls_base64_decode(this->_otaSignature, sizeof(this->_otaSignature), &this->_otaSignatureLength,
+                              (const unsigned char*) signature, strlen(signature)) != 0) {
+      Serial.println("SimpleIOT: ERROR: Can't decode update signature");
+      this->_otaSignatureLength = 0;
+    }
+  }
+}
+
+int SimpleIOT::setOTASigningKey(const char* publicKeyPem)
+{
+  if (this->_otaState == IOT_OTA_RUNNING) {
+    Serial.println("SimpleIOT: ERROR: Can't change the signing key during an OTA");
+    return -1;
+  }
+  mbedtls_pk_free(&this->_otaSigningKey);
+  mbedtls_pk_init(&this->_otaSigningKey);
+  this->_haveOtaSigningKey = false;
+
+  int ret = mbedtls_pk_parse_public_key(&this->_otaSigningKey, (const unsigned char*) publicKeyPem,
+                                        strlen(publicKeyPem) + 1);
+  if (ret != 0) {
+    Serial.printf("SimpleIOT: ERROR: Can't parse OTA signing key: -0x%04x\n", -ret);
+    return -1;
+  }
+  this->_haveOtaSigningKey = true;
+  return 0;
+}
+
+void SimpleIOT::setOTABufferSize(size_t bytes)
+{
+  this->_otaBufferSize = constrain(bytes, (size_t) SIMPLEIOT_OTA_BUFFER_MIN, (size_t) SIMPLEIOT_OTA_BUFFER_MAX);
+}
+
+void SimpleIOT::setOTADelta(const char* url, const char* baseVersion)
+{
+  this->_otaDeltaUrl = url ? url : "";
+  strncpy(this->_otaDeltaBase, baseVersion ? baseVersion : "", SIMPLEIOT_OTA_VERSION_SIZE - 1);
+  this->_otaDeltaBase[SIMPLEIOT_OTA_VERSION_SIZE - 1] = '\0';
+}
+
+void SimpleIOT::setOTAProgressCallback(SimpleIOTOTAProgressCallback onProgress, unsigned long minIntervalMs)
+{
+  this->_otaProgressCallback = onProgress;
+  this->_otaProgressIntervalMs = minIntervalMs;
+}
+
+void SimpleIOT::setOTATask(int core, int priority, unsigned long maxKBps)
+{
+  this->_otaTaskCore = core;
+  this->_otaTaskPriority = priority;
+  this->_otaMaxKBps = maxKBps;
+}
+
+// Copy the settings for this update into _otaRequest. After this, setOTAHash, setOTADelta
+// and update messages only affect the next update.
+//
+void SimpleIOT::_otaSnapshot(const char* url)
+{
+  SimpleIOTOTARequest* request = &this->_otaRequest;
+
+  request->url = url;
+  request->path[0] = '\0';
+  request->deltaUrl = strcmp(this->_otaDeltaBase, this->_fwVersion) == 0 ? this->_otaDeltaUrl : String("");
+  memcpy(request->version, this->_otaVersion, sizeof(request->version));
+  memcpy(request->md5, this->_otaMd5, sizeof(request->md5));
+  memcpy(request->sha256, this->_otaSha256, sizeof(request->sha256));
+  memcpy(request->signature, this->_otaSignature, this->_otaSignatureLength);
+  request->signatureLength = this->_otaSignatureLength;
+  request->key = this->_haveOtaSigningKey ? &this->_otaSigningKey : NULL;
+  request->gzip = this->_otaGzip;
+}
+
+void SimpleIOT::performOTA(const char* url, SimpleIOTOTACallback otaCallback)
+{
+  if (this->_otaState == IOT_OTA_RUNNING) {
+    Serial.println("SimpleIOT: OTA already running");
+    return;
+  }
+  this->_otaCallback = otaCallback;
+  this->_otaAsync = false;
+  this->_otaSnapshot(url);
+  if (this->_otaPerform(&this->_otaRequest) == 0) {
+    this->_finishUpdate();
+  }
+}
+
+int SimpleIOT::performOTAAsync(const char* url, SimpleIOTOTACallback otaCallback, SimpleIOTOTADoneCallback onDone)
+{
+  if (this->_otaState == IOT_OTA_RUNNING) {
+    Serial.println("SimpleIOT: OTA already running");
+    return -1;
+  }
+  this->_otaCallback = otaCallback;
+  this->_otaDoneCallback = onDone;
+  this->_otaSnapshot(url);
+  return this->_otaStartTask();
+}
+
+int SimpleIOT::_otaStartTask()
+{
+  this->_otaAsync = true;
+  this->_otaReported = false;
+  this->_fwUpdatePercent = 0;
+  this->_otaState = IOT_OTA_RUNNING;
+
+  if (xTaskCreatePinnedToCore(_otaTaskMain, "simpleiot_ota_dl", OTA_TASK_STACK, this,
+                              this->_otaTaskPriority, &this->_otaTask, this->_otaTaskCore) != pdPASS) {
+    Serial.println("SimpleIOT: ERROR: Can't start OTA task");
+    this->_otaState = IOT_OTA_IDLE;
+    return -1;
+  }
+  return 0;
+}
+
+void SimpleIOT::_otaTaskMain(void* arg)
+{
+  SimpleIOT* iot = (SimpleIOT*) arg;
+
+  SimpleIOTOTARequest* request = &iot->_otaRequest;
+  int ret = request->path[0] != '\0' ? iot->_fileInstall(request) : iot->_otaPerform(request);
+
+  iot->_otaState = ret == 0 ? IOT_OTA_INSTALLED : IOT_OTA_FAILED;
+  iot->_otaTask = NULL;
+  vTaskDelete(NULL);
+}
+
+// Called from loop() while a background OTA is going. Everything that touches the app or
+// MQTT happens here, on the app's task, rather than on the OTA task.
+//
+void SimpleIOT::_otaStep()
+{
+  if (this->_otaState == IOT_OTA_RUNNING) {
+    this->_reportProgress(false);
+  } else if (this->_otaState == IOT_OTA_FAILED) {
+    this->_otaState = IOT_OTA_IDLE;
+    if (this->_otaRequest.path[0] != '\0') {
+      this->_fileUpdateDone(SIMPLEIOT_ERR_OTA);
+    } else if (this->_otaDoneCallback) {
+      this->_otaDoneCallback(this, SIMPLEIOT_ERR_OTA);
+    }
+  } else if (this->_otaState == IOT_OTA_INSTALLED && !this->_otaReported && this->_ready) {
+    this->_otaReported = true;
+    this->_reportProgress(true);
+    if (this->_otaRequest.path[0] != '\0') {
+      this->_otaState = IOT_OTA_IDLE;       // nothing to restart for
+      this->_fileUpdateDone(0);
+      return;
+    }
+    this->_updateReceived();
+    Serial.println("SimpleIOT: Update installed, restart to run it");
+    if (this->_otaDoneCallback) {
+      this->_otaDoneCallback(this, 0);
+    }
+  }
+}
+
+// A delta only applies to the version it was made from. If anything goes wrong with it,
+// the full image still gets the device updated.
+//
+int SimpleIOT::_otaPerform(const SimpleIOTOTARequest* request)
+{
+  if (request->deltaUrl.length() > 0) {
+    Serial.println("SimpleIOT: Trying delta update from " + String(this->_fwVersion));
+    if (this->_otaInstall(request, true) == 0) {
+      return 0;
+    }
+    Serial.println("SimpleIOT: Delta update failed, getting the full image");
+  }
+  return this->_otaInstall(request, false);
+}
+
+// Download, check and install one image. Returns 0 once it's set to boot, -1 if anything
+// failed, in which case the running firmware is untouched.
+//
+int SimpleIOT::_otaInstall(const SimpleIOTOTARequest* request, bool delta)
+{
+SimpleIOTOTAVerifier verifier;
+SimpleIOTOTAFlash flash;
+SimpleIOTOTAResume resume;
+SimpleIOTOTAInflater inflater;
+SimpleIOTOTAPatcher patcher;
+SimpleIOTOTAPending pending;
+SimpleIOTOTAJob job = { request, &verifier, &flash, &resume, &inflater, delta ? &patcher : NULL, NULL,
+                        delta ? false : request->gzip, false, 0, 0 };   // a gzipped delta is still spotted by its header
+const char* url = delta ? request->deltaUrl.c_str() : request->url.c_str();
+int ret = -1;
+
+  this->_fwUpdateTotalLength = 0;
+  this->_fwUpdateCurrentLength = 0;
+  this->_fwUpdatePercent = 0;
+  this->_otaKBps = 0;
+  this->_otaDownloadMs = 0;
+  this->_otaWriteMs = 0;
+  this->_otaVerifyMs = 0;
+
+  verifier.begin(request->md5, request->sha256, request->signature, request->signatureLength, request->key);
+  if (!verifier.checking()) {
+    Serial.println("SimpleIOT: WARNING: No hash for this update, it won't be verified");
+  }
+
+  if (delta && patcher.begin(_otaImageSink, &job) != 0) {
+    return -1;
+  }
+
+  // Pick up a download of the same image that was cut off, possibly before a reboot
+  //
+  uint32_t key = _otaResumeKey(url, request->md5, request->sha256);
+  const esp_partition_t* target = esp_ota_get_next_update_partition(NULL);
+  if (_otaResumeLoad(&resume, key) && target && resume.partition == target->address) {
+    Serial.printf("SimpleIOT: Resuming OTA at %u of %u\n", resume.offset, resume.total);
+    job.received = resume.offset;
+    job.savedOffset = resume.offset;
+  } else {
+    memset(&resume, 0, sizeof(resume));
+    resume.magic = SIMPLEIOT_OTA_MAGIC;
+    resume.key = key;
+  }
+
+  unsigned long start = millis();
+  for (int attempt = 0; attempt <= OTA_RESUME_RETRIES; attempt++) {
+    if (attempt > 0) {
+      Serial.printf("SimpleIOT: OTA interrupted at %u, retrying\n", resume.offset);
+      delay(OTA_RETRY_DELAY_MS);
+    }
+    ret = this->_otaDownload(url, &job);
+    if (ret <= 0) {
+      break;
+    }
+  }
+  this->_otaDownloadMs = millis() - start;
+  this->_otaKBps = this->_otaDownloadMs > 0 ? (unsigned long) ((uint64_t) this->_fwUpdateCurrentLength * 1000 / 1024 / this->_otaDownloadMs) : 0;
+
+  Serial.printf("SimpleIOT: OTA %d bytes in %lu ms (%lu KB/s), flash writes %lu ms\n",
+                this->_fwUpdateCurrentLength, this->_otaDownloadMs, this->_otaKBps, this->_otaWriteMs);
+
+  if (ret != 0) {
+    Serial.println("SimpleIOT: ERROR: Firmware download incomplete");
+    return -1;
+  }
+
+  // Whatever the outcome, this image is done with. A bad one shouldn't be resumed.
+  //
+  _otaResumeClear();
+  inflater.end();
+  patcher.end();
+  if ((job.compressed && !inflater.done()) || (delta && !patcher.done())) {
+    Serial.println("SimpleIOT: ERROR: Compressed image or patch is truncated");
+    return -1;
+  }
+  ret = verifier.finish();
+  this->_otaVerifyMs = verifier.verifyUs() / 1000;
+  Serial.printf("SimpleIOT: OTA verify %lu ms\n", this->_otaVerifyMs);
+  if (ret != 0) {
+    Serial.println("SimpleIOT: ERROR: Firmware failed verification, not installing");
+    return -1;
+  }
+  if (flash.finish() != 0) {
+    return -1;
+  }
+
+  // Put the new image on probation. If it never gets to confirm itself, this is how the
+  // old one knows where to go back to and what to report.
+  //
+  memset(&pending, 0, sizeof(pending));
+  pending.magic = SIMPLEIOT_PENDING_MAGIC;
+  pending.previous = esp_ota_get_running_partition()->address;
+  pending.target = flash.partition()->address;
+  strncpy(pending.version, request->version, SIMPLEIOT_OTA_VERSION_SIZE - 1);
+  _otaPendingSave(&pending);
+  return 0;
+}
+
+void SimpleIOT::setFileUpdateCallback(SimpleIOTFileUpdateCallback onFileUpdate)
+{
+  this->_fileUpdateCallback = onFileUpdate;
+}
+
+int SimpleIOT::performFileUpdate(const char* url, const char* path, SimpleIOTUpdateType type,
+                                 SimpleIOTOTACallback otaCallback)
+{
+  if (this->_otaState == IOT_OTA_RUNNING) {
+    Serial.println("SimpleIOT: OTA already running");
+    return -1;
+  }
+  this->_otaCallback = otaCallback;
+  this->_otaAsync = false;
+  this->_otaSnapshot(url);
+  strncpy(this->_otaRequest.path, path ? path : "", SIMPLEIOT_OTA_PATH_SIZE - 1);
+  this->_otaRequest.path[SIMPLEIOT_OTA_PATH_SIZE - 1] = '\0';
+  this->_otaFileType = type;
+
+  int ret = this->_fileInstall(&this->_otaRequest);
+  this->_fileUpdateDone(ret == 0 ? 0 : SIMPLEIOT_ERR_OTA);
+  return ret;
+}
+
+int SimpleIOT::performFileUpdateAsync(const char* url, const char* path, SimpleIOTUpdateType type,
+                                      SimpleIOTOTACallback otaCallback)
+{
+  if (this->_otaState == IOT_OTA_RUNNING) {
+    Serial.println("SimpleIOT: OTA already running");
+    return -1;
+  }
+  this->_otaCallback = otaCallback;
+  this->_otaSnapshot(url);
+  strncpy(this->_otaRequest.path, path ? path : "", SIMPLEIOT_OTA_PATH_SIZE - 1);
+  this->_otaRequest.path[SIMPLEIOT_OTA_PATH_SIZE - 1] = '\0';
+  this->_otaFileType = type;
+  return this->_otaStartTask();
+}
+
+// Tell the app a file update is done with, on the app's task
+//
+void SimpleIOT::_fileUpdateDone(int status)
+{
+  const char* path = this->_otaRequest.path;
+
+  if (status == 0) {
+    Serial.println("SimpleIOT: Updated " + String(path));
+  }
+  if (this->_ready) {
+    this->_reportFileUpdate(status);
+  }
+  if (this->_fileUpdateCallback) {
+    this->_fileUpdateCallback(this, path, this->_otaFileType, status);
+  }
+}
+
+// File updates get their own status message. updateInstalled() is about the firmware and
+// would close out a pending firmware update instead.
+//
+int SimpleIOT::_reportFileUpdate(int status)
+{
+DynamicJsonDocument root(SimpleIOTInternalBufferSize);
+
+  root["project"] = this->_project;
+  root["serial"] = this->_serialNumber;
+  root["op"] = "fileupdate";
+  root["type"] = this->_otaFileType == UPDATE_CONFIG ? "config" : "file";
+  root["path"] = this->_otaRequest.path;
+  root["version"] = this->_otaRequest.version;
+  root["status"] = status == 0 ? "installed" : "failed";
+
+  return _sendRawMessage("fileupdate", root, MESSAGE_ADM);
+}
+
+// Same as _otaInstall, but into a file. A file that fails its checks is removed and the
+// old one is left alone.
+//
+int SimpleIOT::_fileInstall(const SimpleIOTOTARequest* request)
+{
+SimpleIOTOTAVerifier verifier;
+SimpleIOTOTAResume resume;
+SimpleIOTOTAInflater inflater;
+SimpleIOTOTAFile file;
+SimpleIOTOTAJob job = { request, &verifier, NULL, &resume, &inflater, NULL, &file, request->gzip, false, 0, 0 };
+int ret = -1;
+
+  this->_fwUpdateTotalLength = 0;
+  this->_fwUpdateCurrentLength = 0;
+  this->_fwUpdatePercent = 0;
+
+  // begin() is called again by each download, this just checks the path and the filesystem
+  //
+  if (file.begin(request->path, 0) != 0) {
+    return -1;
+  }
+  verifier.begin(request->md5, request->sha256, request->signature, request->signatureLength, request->key);
+  if (!verifier.checking()) {
+    Serial.println("SimpleIOT: WARNING: No hash for this update, it won't be verified");
+  }
+  memset(&resume, 0, sizeof(resume));
+
+  for (int attempt = 0; attempt <= OTA_RESUME_RETRIES; attempt++) {
+    if (attempt > 0) {
+      delay(OTA_RETRY_DELAY_MS);
+    }
+    ret = this->_otaDownload(request->url.c_str(), &job);
+    if (ret <= 0) {
+      break;
+    }
+  }
+  inflater.end();
+  if (ret == 0 && job.compressed && !inflater.done()) {
+    Serial.println("SimpleIOT: ERROR: Compressed file is truncated");
+    ret = -1;
+  }
+  if (ret == 0 && verifier.finish() != 0) {
+    Serial.println("SimpleIOT: ERROR: File failed verification, keeping the old one");
+    ret = -1;
+  }
+  if (ret != 0) {
+    file.abort();
+    return -1;
+  }
+  return file.finish();
+}
+
+// One GET of the image, from the resume point if there is one. Returns 0 when the whole image
+// is in flash, 1 if the download was cut off and can be retried from the saved point, and -1
+// if it can't go on.
+//
+int SimpleIOT::_otaDownload(const char* url, SimpleIOTOTAJob* job)
+{
+SimpleIOTSecureClient secureClient;     // declared first so it outlives the HTTPClient
+HTTPClient client;
+SimpleIOTOTAWriter writer;
+SimpleIOTOTAResume* resume = job->resume;
+const char* headers[] = { "ETag" };
+
+  // Same parsed root CA as the IOT connection. The download server doesn't need the
+  // device certificate.
+  //
+  secureClient.setCredentials(&this->_credentials, false);
+  secureClient.setSessionResumption(false);
+  client.begin(secureClient, url);
+  client.collectHeaders(headers, 1);
+
+  // We read the raw stream, so keep the server from sending it chunked. Without a
+  // Content-Length, the end of the file is where the server closes the connection.
+  //
+  client.useHTTP10(true);
+
+  // If-Range makes the server send the whole file instead if it has changed since
+  //
+  bool resuming = resume->offset > 0 && resume->etag[0] != '\0';
+  if (resuming) {
+    client.addHeader("Range", "bytes=" + String(resume->offset) + "-");
+    client.addHeader("If-Range", resume->etag);
+  }
+
+  int resp = client.GET();
+  #ifdef _DEBUG
+    Serial.print("Response: ");
+    Serial.println(resp);
+  #endif
+
+  if (resp <= 0) {
+    client.end();
+    return 1;
+  }
+  if (resp != HTTP_CODE_OK && !(resuming && resp == HTTP_CODE_PARTIAL_CONTENT)) {
+    Serial.println("ERROR: Cannot download firmware file");
+    client.end();
+    return -1;
+  }
+
+  // get length of document (is -1 when Server sends no Content-Length header)
+  //
+  int len = client.getSize();
+
+  if (resp == HTTP_CODE_PARTIAL_CONTENT) {
+    if (job->file ? !job->file->started() : !job->flash->started()) {
+      if (_otaBegin(job, resume->offset) != 0) {
+        client.end();
+        return -1;
+      }
+      job->verifier->restoreState(&resume->hash);
+    }
+    this->_fwUpdateTotalLength = resume->total;
+    this->_fwUpdateCurrentLength = resume->offset;
+    this->_otaStartBytes = resume->offset;
+  } else {
+    // A fresh start, either the first try or the file changed under us
+    //
+    if (_otaBegin(job, 0) != 0) {
+      client.end();
+      return -1;
+    }
+    job->verifier->begin(job->request->md5, job->request->sha256, job->request->signature,
+                         job->request->signatureLength, job->request->key);
+    String etag = client.header("ETag");
+    strncpy(resume->etag, etag.c_str(), SIMPLEIOT_OTA_ETAG_SIZE - 1);
+    resume->etag[SIMPLEIOT_OTA_ETAG_SIZE - 1] = '\0';
+    resume->total = len > 0 ? len : 0;
+    resume->offset = 0;
+    job->received = 0;
+    job->savedOffset = 0;
+    job->compressed = false;
+    if (job->patcher && job->patcher->begin(_otaImageSink, job) != 0) {
+      client.end();
+      return -1;
+    }
+    this->_fwUpdateTotalLength = len;
+    this->_fwUpdateCurrentLength = 0;
+    this->_otaStartBytes = 0;
+  }
+  resume->partition = job->file ? 0 : job->flash->partition()->address;
+  Serial.printf("FW Size: %d\n",this->_fwUpdateTotalLength);
+  this->_otaStartMs = millis();
+  this->_otaLastProgressMs = 0;
+
+  if (writer.begin(this->_otaBufferSize, _otaFlashSink, job) != 0) {
+    client.end();
+    return -1;
+  }
+
+  WiFiClient * stream = client.getStreamPtr();
+  unsigned long start = millis();
+  uint64_t got = 0;
+
+  // Read straight into the current buffer. The writer task flashes full buffers while we
+  // go on reading into the other one. We only give up the CPU when the socket is empty,
+  // or to stay under the rate cap.
+  //
+  Serial.println("Updating firmware...");
+  while ((client.connected() || stream->available()) && (len > 0 || len == -1)) {
+    size_t room;
+    uint8_t* buffer = writer.fillBuffer(&room);
+
+    if (!buffer) {
+      break;
+    }
+    if (len > 0 && room > (size_t) len) {
+      room = len;
+    }
+    int c = stream->read(buffer, room);
+    if (c <= 0) {
+      delay(1);
+      continue;
+    }
+    writer.filled(c);
+    this->_updateProgress(c);
+    if (len > 0) {
+      len -= c;
+    }
+    if (this->_otaMaxKBps > 0) {
+      got += c;
+      uint64_t dueMs = got * 1000 / (this->_otaMaxKBps * 1024);
+      unsigned long elapsed = millis() - start;
+      if (dueMs > elapsed) {
+        delay(dueMs - elapsed);
+      }
+    }
+  }
+
+  int ret = writer.flush();
+  this->_otaWriteMs += writer.writeUs() / 1000;
+  writer.end();
+  client.end();
+
+  if (ret != 0) {
+    Serial.println("SimpleIOT: ERROR: Flash write failed");
+    return -1;
+  }
+  // A background OTA sends its final report from loop()
+  //
+  if (job->received == resume->total && resume->total > 0) {
+    if (!this->_otaAsync) {
+      this->_reportProgress(true);
+    }
+    return 0;
+  }
+  if (resume->total == 0 && job->received > 0) {
+    // No length given, so the end of the stream is the end of the file. If it was really cut
+    // off, the hash check or the image check catches it.
+    //
+    this->_fwUpdateTotalLength = this->_fwUpdateCurrentLength;
+    if (!this->_otaAsync) {
+      this->_reportProgress(true);
+    }
+    return 0;
+  }
+
+  // Cut off. Everything read so far is in flash, so the next try starts from here.
+  //
+  _otaResumeSave(job);
+  return resume->total > 0 && resume->etag[0] != '\0' ? 1 : -1;
+}
+
+
+void SimpleIOT::_updateProgress(size_t len)
+{
+  this->_fwUpdateCurrentLength += len;
+
+  // A background OTA reports from loop() instead
+  //
+  if (!this->_otaAsync) {
+    this->_reportProgress(false);
+  }
+}
+
+// Progress goes out at most once per interval, and only when the percentage has moved (or
+// every interval if the size isn't known). All integer math. force sends the final 100%.
+//
+void SimpleIOT::_reportProgress(bool force)
+{
+  unsigned long now = millis();
+  int current = this->_fwUpdateCurrentLength;
+  int total = this->_fwUpdateTotalLength;
+  int percent = total > 0 ? (int) ((int64_t) current * 100 / total) : -1;
+
+  if (!this->_otaCallback && !this->_otaProgressCallback) {
+    return;
+  }
+  if (!force && (now - this->_otaLastProgressMs < this->_otaProgressIntervalMs ||
+                 (percent >= 0 && percent == this->_fwUpdatePercent))) {
+    return;
+  }
+  this->_otaLastProgressMs = now;
+  this->_fwUpdatePercent = percent;
+
+  if (this->_otaCallback) {
+    this->_otaCallback(current, total, percent);
+  }
+  if (this->_otaProgressCallback) {
+    SimpleIOTOTAProgress progress;
+    unsigned long elapsed = now - this->_otaStartMs;
+
+    progress.current = current;
+    progress.total = total;
+    progress.percent = percent;
+    progress.kbps = elapsed > 0 ? (unsigned long) ((uint64_t) (current - this->_otaStartBytes) * 1000 / 1024 / elapsed) : 0;
+    progress.etaSecs = total > 0 && progress.kbps > 0 ? (long) ((total - current) / 1024 / progress.kbps) : -1;
+    this->_otaProgressCallback(this, &progress);
+  }
+}
+
+void SimpleIOT::_finishUpdate()
+{
+  this->_updateReceived(); // We send the update received message to the server so it marks the record properly
+
+  Serial.printf("\nUpdate Success, Total Size: %u\nRebooting...\n", this->_fwUpdateCurrentLength);
+  // Restart ESP32 to see changes 
+  
+  delay(DELAY_MS_BEFORE_RESTART);            // then we wait a little before restarting to let the updateReceived call get through
+  ESP.restart();
+}
+
+void SimpleIOT::_doUpdate(char* op, bool force)
+{
+DynamicJsonDocument root(SimpleIOTInternalBufferSize);
+
+  root["project"] = this->_project;
+  root["serial"] = this->_serialNumber;
+  root["version"] = this->_fwVersion;
+  root["op"] = op;
+  if (force) {
+    root["force"] = true;
   }
 
   _sendRawMessage(op, root, MESSAGE_ADM);
@@ -670,3 +3786,139 @@ void SimpleIOT::updateInstalled()
 {
   this->_doUpdate((char *) "installed");
 }
+
+void SimpleIOT::setOTAConfirmTimeout(unsigned long timeoutSecs)
+{
+  this->_otaConfirmTimeoutMs = timeoutSecs * 1000UL;
+}
+
+// Called from config(). Works out whether we're new firmware on probation, old firmware
+// that was rolled back to, or old firmware with an update installed and waiting for a restart.
+//
+void SimpleIOT::_otaCheckPending()
+{
+Preferences prefs;
+bool loaded = false;
+
+  if (prefs.begin(SIMPLEIOT_NVS_NAMESPACE, true)) {
+    loaded = prefs.getBytes(SIMPLEIOT_NVS_PENDING_KEY, &this->_otaPending, sizeof(SimpleIOTOTAPending)) == sizeof(SimpleIOTOTAPending) &&
+             this->_otaPending.magic == SIMPLEIOT_PENDING_MAGIC;
+    prefs.end();
+  }
+  if (!loaded) {
+    return;
+  }
+  this->_otaPending.version[SIMPLEIOT_OTA_VERSION_SIZE - 1] = '\0';
+
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  if (running->address == this->_otaPending.target) {
+    // Waking from deep sleep isn't a restart, the app asked for it
+    //
+    if (esp_reset_reason() != ESP_RST_DEEPSLEEP) {
+      this->_otaPending.restarts++;
+    }
+    strncpy(this->_otaPending.version, this->_fwVersion, SIMPLEIOT_OTA_VERSION_SIZE - 1);
+    if (this->_otaPending.restarts > SIMPLEIOT_OTA_CONFIRM_RESTARTS) {
+      this->_otaRollback(SIMPLEIOT_OTA_ROLLBACK_RESTARTS);
+      return;
+    }
+    _otaPendingSave(&this->_otaPending);
+    this->_otaProbation = true;
+    Serial.printf("SimpleIOT: New firmware on probation, start %d\n", this->_otaPending.restarts);
+    return;
+  }
+
+  if (running->address != this->_otaPending.previous) {
+    _otaPendingClear();       // neither image, something else was flashed since
+    return;
+  }
+  if (this->_otaPending.rollback == SIMPLEIOT_OTA_ROLLBACK_NONE) {
+    const esp_partition_t* boot = esp_ota_get_boot_partition();
+    if (boot && boot->address == this->_otaPending.target) {
+      return;                 // installed, but the app hasn't restarted into it yet
+    }
+    this->_otaPending.rollback = SIMPLEIOT_OTA_ROLLBACK_BOOTLOADER;
+  }
+  Serial.println("SimpleIOT: Update to " + String(this->_otaPending.version) + " was rolled back");
+  this->_otaRollbackReport = true;
+}
+
+// Called from loop() while on probation or with a rollback to report
+//
+void SimpleIOT::_otaConfirmStep()
+{
+  if (this->_otaRollbackReport) {
+    if (this->_ready && this->_otaReportRollback() == 0) {
+      this->_otaRollbackReport = false;
+      _otaPendingClear();
+    }
+    return;
+  }
+
+  // If the heartbeat can't be sent, wait a little before the next try rather than trying
+  // on every loop() until the deadline
+  //
+  if (this->_ready && (!this->_otaConfirmFailed || millis() - this->_otaConfirmTriedMs >= OTA_CONFIRM_RETRY_MS)) {
+    if (this->sendHeartbeat() == 0) {
+      this->_otaProbation = false;
+      _otaPendingClear();
+#ifdef CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE
+      esp_ota_mark_app_valid_cancel_rollback();
+#endif
+      Serial.println("SimpleIOT: New firmware confirmed");
+      this->updateInstalled();
+      return;
+    }
+    this->_otaConfirmFailed = true;
+    this->_otaConfirmTriedMs = millis();
+  }
+
+  // millis() started from 0 at this boot. Earlier wakes are in awakeMs.
+  //
+  if (this->_otaPending.awakeMs + millis() > this->_otaConfirmTimeoutMs) {
+    Serial.println("SimpleIOT: ERROR: New firmware didn't connect in time");
+    this->_otaRollback(SIMPLEIOT_OTA_ROLLBACK_TIMEOUT);
+  }
+}
+
+// Go back to the image that was running before the update. Doesn't return unless the old
+// image can't be booted, in which case we stay on this one.
+//
+void SimpleIOT::_otaRollback(uint8_t reason)
+{
+  const esp_partition_t* previous = _otaPartitionAt(this->_otaPending.previous);
+
+  this->_otaProbation = false;
+  this->_otaPending.rollback = reason;
+  _otaPendingSave(&this->_otaPending);
+
+#ifdef CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE
+  // If the bootloader still has us as pending-verify, this also marks the image bad so it's
+  // never booted again. Otherwise it returns and we switch partitions ourselves.
+  //
+  esp_ota_mark_app_invalid_rollback_and_reboot();
+#endif
+  if (!previous || esp_ota_set_boot_partition(previous) != ESP_OK) {
+    Serial.println("SimpleIOT: ERROR: Can't roll back, previous firmware isn't bootable");
+    _otaPendingClear();
+    return;
+  }
+  Serial.println("SimpleIOT: Rolling back to the previous firmware. Rebooting...");
+  delay(DELAY_MS_BEFORE_RESTART);
+  ESP.restart();
+}
+
+int SimpleIOT::_otaReportRollback()
+{
+DynamicJsonDocument root(SimpleIOTInternalBufferSize);
+const char* reasons[] = { "none", "timeout", "restarts", "bootloader" };
+
+  root["project"] = this->_project;
+  root["serial"] = this->_serialNumber;
+  root["version"] = this->_fwVersion;
+  root["op"] = "rollback";
+  root["failed_version"] = this->_otaPending.version;
+  root["reason"] = reasons[this->_otaPending.rollback <= SIMPLEIOT_OTA_ROLLBACK_BOOTLOADER ? this->_otaPending.rollback : 0];
+
+  return _sendRawMessage("rollback", root, MESSAGE_ADM);
+}
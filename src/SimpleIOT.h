@@ -6,9 +6,8 @@
  *  Dependency on MQTTClient library from: https://github.com/256dpi/arduino-mqtt
  *  and on ArduinoJson from https://arduinojson.org/
  *
- *  Also on AWSGreenGrassIOT, but that library doesn't seem to be available publicly
- *  so it has to be installed separately from:
- *    https://github.com/aws-samples/arduino-aws-greengrass-iot.git
+ *  Greengrass discovery is done by the library itself (see _discover), so there is no longer
+ *  a dependency on the AWSGreenGrassIoT library.
  *  
  *  Search in the libraries for MQTT and install install the latest by Joel Gaehwiler.
  *  Also, search for ArduinoJSON.
@@ -24,12 +23,24 @@
 #include <ArduinoMqttClient.h>
 #include <Update.h>
 #include <ArduinoJson.h>
-#include <AWSGreenGrassIoT.h>
+#include <Preferences.h>
+#include "SimpleIOTSecureClient.h"
+#include "SimpleIOTOTA.h"
 
 
 #define INTERNAL_STATIC_BUFFER_SIZE 100
 #define INTERNAL_TOPIC_BUFFER_SIZE  200
 
+// Attribute state table and pending (unsent) queue. These are what get saved in the
+// binary state snapshot, so keep them small -- every slot costs RAM and NVS space.
+//
+#define SIMPLEIOT_MAX_ATTRIBUTES    32
+#define SIMPLEIOT_MAX_PENDING       16
+#define SIMPLEIOT_ATTR_NAME_SIZE    32
+#define SIMPLEIOT_ATTR_VALUE_SIZE   48
+#define SIMPLEIOT_STATE_VERSION     1
+#define SIMPLEIOT_RTC_STATE_SIZE    2048    // room for the snapshot in RTC memory (duty-cycle mode)
+
 #define _DEBUG 1
 
 class SimpleIOT; // forward decl
@@ -73,6 +84,108 @@ typedef enum {
 } SimpleIOTDiagType;
 
 
+// Connection states. config() returns right away and the connection is brought up one
+// step at a time from inside loop(). The states before IOT_CONN_READY are also the
+// phases whose duration is recorded for each connect.
+//
+typedef enum {
+  IOT_CONN_IDLE,
+  IOT_CONN_WIFI,          // waiting for WiFi association and DHCP
+  IOT_CONN_CONNECT,       // Greengrass discovery if needed, TLS handshake and MQTT CONNECT
+  IOT_CONN_SUBSCRIBE,     // subscribing to the monitor, update, diag and admin topics
+  IOT_CONN_READY,
+  IOT_CONN_FAILED         // waiting to retry
+} SimpleIOTConnState;
+
+// Finer-grained breakdown of a connect, recorded in microseconds. IOT_PHASE_DISCOVERY is only
+// non-zero on a gateway connect that had to run Greengrass discovery.
+//
+typedef enum {
+  IOT_PHASE_WIFI_ASSOC,   // WiFi.begin to association with the access point
+  IOT_PHASE_DHCP,         // association to getting an IP address
+  IOT_PHASE_DNS,
+  IOT_PHASE_TCP,
+  IOT_PHASE_TLS,
+  IOT_PHASE_MQTT_CONNECT, // CONNECT to CONNACK
+  IOT_PHASE_DISCOVERY,    // Greengrass cloud discovery
+  IOT_PHASE_SUBSCRIBE,
+  IOT_PHASE_COUNT
+} SimpleIOTConnPhase;
+
+// Which way the device is connected. A gateway device with failover on can move between them.
+//
+typedef enum {
+  IOT_PATH_DIRECT,        // straight to AWS IOT
+  IOT_PATH_GATEWAY,       // through the local Greengrass core
+  IOT_PATH_COUNT
+} SimpleIOTPath;
+
+// Background OTA progress, see performOTAAsync
+//
+typedef enum {
+  IOT_OTA_IDLE,
+  IOT_OTA_RUNNING,
+  IOT_OTA_INSTALLED,      // new firmware boots on the next restart
+  IOT_OTA_FAILED
+} SimpleIOTOTAState;
+
+// Status values passed to the SimpleIOTReadyCallback when a connect attempt fails, and to
+// the SimpleIOTOTADoneCallback
+//
+#define SIMPLEIOT_ERR_WIFI_TIMEOUT      -1
+#define SIMPLEIOT_ERR_CONNECT           -2
+#define SIMPLEIOT_ERR_GATEWAY_TIMEOUT   -3
+#define SIMPLEIOT_ERR_DISCONNECTED      -4
+#define SIMPLEIOT_ERR_DISCOVERY         -5
+#define SIMPLEIOT_ERR_OTA               -6
+
+// Greengrass core connection info found by discovery. It is kept in NVS and used directly on
+// later boots. Discovery only runs again when none of the saved addresses can be connected to.
+//
+#define SIMPLEIOT_GG_HOST_SIZE          64
+#define SIMPLEIOT_GG_MAX_ADDRESSES      3
+#define SIMPLEIOT_GG_CA_SIZE            2048
+
+typedef struct {
+  char host[SIMPLEIOT_GG_HOST_SIZE];
+  uint16_t port;
+} SimpleIOTGGAddress;
+
+typedef struct {
+  uint32_t magic;
+  uint8_t addressCount;
+  uint8_t addressIndex;                   // the address tried first, the last one that worked
+  SimpleIOTGGAddress addresses[SIMPLEIOT_GG_MAX_ADDRESSES];
+  char ca[SIMPLEIOT_GG_CA_SIZE];          // group CA, PEM
+} SimpleIOTGGCore;
+
+// Reconnect backoff. Each failed attempt doubles the delay up to the cap, and the actual
+// wait is picked at random between half and all of it so a fleet that dropped off at the
+// same moment doesn't come back at the same moment.
+//
+#define SIMPLEIOT_BACKOFF_BASE_MS       1000
+#define SIMPLEIOT_BACKOFF_MAX_MS        120000
+
+#define SIMPLEIOT_MAX_SUBSCRIPTIONS     5
+#define SIMPLEIOT_SUBSCRIBE_BATCH       8       // AWS IOT takes at most 8 filters per SUBSCRIBE
+#define SIMPLEIOT_MQTT_KEEPALIVE_MS     60000
+#define SIMPLEIOT_IDLE_MAX_MS           1000
+#define SIMPLEIOT_OTA_TASK_CORE         0       // the WiFi core, Arduino's loop runs on 1
+#define SIMPLEIOT_OTA_TASK_PRIORITY     1
+#define SIMPLEIOT_OTA_PROGRESS_MS       500
+#define SIMPLEIOT_OTA_CONFIRM_SECS      300     // new firmware must connect within this
+#define SIMPLEIOT_OTA_CONFIRM_RESTARTS  3       // or restart no more than this many times
+#define SIMPLEIOT_CONFIG_PATH           "/config.json"  // where UPDATE_CONFIG goes by default
+#define SIMPLEIOT_CLOCK_VALID           1600000000      // time() below this means the clock isn't set
+
+// Child devices bridged by a hub (BLE or RS-485 sensors and so on). Each child has its own
+// model and serial, so its own topics, but they all share the hub's MQTT connection.
+//
+#define SIMPLEIOT_MAX_CHILDREN          50
+#define SIMPLEIOT_CHILD_ID_SIZE         26      // topic segments are capped at 25 characters
+#define SIMPLEIOT_CHILD_QUEUE_SIZE      64
+#define SIMPLEIOT_CHILD_BATCH_MS        1000
+
 typedef enum {
   IOT_INT,
   IOT_FLOAT,
@@ -81,10 +194,41 @@ typedef enum {
   IOT_BOOLEAN
 } SimpleIOTType;
 
+// Flags kept with each attribute and pending value
+//
+#define SIMPLEIOT_ATTR_HAS_LOCATION 0x01    // latitude/longitude are valid
+#define SIMPLEIOT_ATTR_FROM_CLOUD   0x02    // last value was set from the cloud, not the device
+
+typedef struct {
+  char name[SIMPLEIOT_ATTR_NAME_SIZE];
+  char value[SIMPLEIOT_ATTR_VALUE_SIZE];
+  uint8_t type;                           // SimpleIOTType
+  uint8_t flags;
+  float latitude;
+  float longitude;
+} SimpleIOTAttribute;
+
+// Header of the binary state snapshot. It is followed by the attribute records, then the
+// pending records, each packed as:
+//
+//    [type:1][flags:1][nameLen:1][valueLen:1][lat:4][lng:4][name][value]
+//
+// The lat/lng fields are only present if SIMPLEIOT_ATTR_HAS_LOCATION is set. The crc
+// covers everything after the header.
+//
+typedef struct __attribute__((packed)) {
+  uint32_t magic;
+  uint16_t version;
+  uint8_t attributeCount;
+  uint8_t pendingCount;
+  uint32_t crc;
+} SimpleIOTStateHeader;
+
 // Callback handler signatures
 //
 
-// Called when IOT connection has been established and everything is ready to go
+// Called when IOT connection has been established and everything is ready to go. Also called
+// with a non-zero status (one of SIMPLEIOT_ERR_*) if a connect attempt fails.
 //
 typedef void (*SimpleIOTReadyCallback)(SimpleIOT *iot,
                     int status,
@@ -97,6 +241,25 @@ typedef void (*SimpleIOTDataCallback)(SimpleIOT *iot,
                     String value,
                     SimpleIOTType type);
 
+// Data from the cloud for a child device. child is the handle addChild() returned.
+//
+typedef void (*SimpleIOTChildDataCallback)(SimpleIOT *iot,
+                    int child,
+                    String name,
+                    String value,
+                    SimpleIOTType type);
+
+typedef struct {
+  char model[SIMPLEIOT_CHILD_ID_SIZE];
+  char serial[SIMPLEIOT_CHILD_ID_SIZE];
+  SimpleIOTChildDataCallback onData;
+} SimpleIOTChild;
+
+typedef struct {
+  uint8_t child;
+  SimpleIOTAttribute attr;
+} SimpleIOTChildValue;
+
 // When an update request is received, this is called with the version, URL of payload
 // and an optional update type.
 //
@@ -105,13 +268,41 @@ typedef void (*SimpleIOTTriggerUpdateCallback)(SimpleIOT *iot,
                     String downloadUrl,
                     SimpleIOTUpdateType updateType);
 
+// Called when a config or file update has been written (status 0), or has failed and the
+// old file was left in place (SIMPLEIOT_ERR_OTA).
+//
+typedef void (*SimpleIOTFileUpdateCallback)(SimpleIOT *iot,
+                    const char* path,
+                    SimpleIOTUpdateType updateType,
+                    int status);
+
 // If provided, this function will be called with the progress of the update
-// download.
+// download. total and percent are -1 if the server didn't send the size.
 //
 typedef void (*SimpleIOTOTACallback)(int currentDownload,
                     int totalDownload,
                     int percent);
 
+// Fuller progress report for setOTAProgressCallback. total, percent and etaSecs are -1 when
+// the server didn't send the size.
+//
+typedef struct {
+  int current;
+  int total;
+  int percent;
+  unsigned long kbps;
+  long etaSecs;
+} SimpleIOTOTAProgress;
+
+typedef void (*SimpleIOTOTAProgressCallback)(SimpleIOT *iot,
+                    const SimpleIOTOTAProgress* progress);
+
+// Called from loop() when a background OTA finishes. status is 0 if the new firmware is
+// installed and will run after the next restart, SIMPLEIOT_ERR_OTA if it failed.
+//
+typedef void (*SimpleIOTOTADoneCallback)(SimpleIOT *iot,
+                    int status);
+
 // Called when a diagnostic request is received from the cloud.
 //
 typedef const char* (*SimpleIOTDiagCallback)(SimpleIOT *iot,
@@ -119,6 +310,21 @@ typedef const char* (*SimpleIOTDiagCallback)(SimpleIOT *iot,
                     String data,
                     SimpleIOTDiagType diagType);
 
+// In duty-cycle mode, called on each wake to take a sample. Values passed to set() in here are
+// queued and sent on the next report.
+//
+typedef void (*SimpleIOTSampleCallback)(SimpleIOT *iot);
+
+// Passed to idle(). Polled while idling; return true to have idle() return early, e.g. when a
+// sensor or serial port has data waiting.
+//
+typedef bool (*SimpleIOTWakeCallback)(SimpleIOT *iot);
+
+// Stands in for Greengrass cloud discovery. Fill in the addresses, addressCount, and group CA
+// and return 0, or return non-zero if the core can't be found.
+//
+typedef int (*SimpleIOTDiscoveryHandler)(SimpleIOT *iot, SimpleIOTGGCore *core);
+
 // Internal structs to use for calling back handlers. We keep a pointer to the SimpleIOT instance
 // in place so we can pass it back to C-only handler.
 
@@ -161,7 +367,8 @@ public:
                              const char* keyPem,
                              bool withGateway=false); // set to true if device goes through a gateway
 
-    // And this one to initialize and connect.
+    // And this one to initialize and connect. This returns right away; the connection is
+    // brought up from inside loop() and onReady is called once it's done.
     //
     void config(const char* project,
                             const char* model,
@@ -189,9 +396,170 @@ public:
     int set(const char* name, double value, float latitude, float longitude);
     int set(const char* name, bool value, float latitude, float longitude);
 
-    // Called by loop to give time for networking layer
+    // Child devices. addChild returns a handle for the child, or -1 if there's no room. Children
+    // can be added before or after config(). setChild queues the value; if the same child and
+    // name are set again before it goes out, only the latest value is sent. Queued values
+    // for all children go out together from loop() once per batch window.
+    //
+    int addChild(const char* model, const char* serial, SimpleIOTChildDataCallback onData = NULL);
+    int childCount() { return _childCount; }
+    const char* childSerial(int child);
+    void setChildBatchWindow(unsigned long ms) { _childBatchMs = ms; }
+
+    int setChild(int child, const char* name, const char* value);
+    int setChild(int child, const char* name, int value);
+    int setChild(int child, const char* name, float value);
+    int setChild(int child, const char* name, double value);
+    int setChild(int child, const char* name, bool value);
+
+    // Last known value of an attribute, either set locally or received from the cloud.
+    // Returns NULL if the name has never been seen.
+    //
+    const char* get(const char* name);
+
+    // Save the attribute table and pending queue to NVS as a binary snapshot. The snapshot
+    // is restored automatically inside config(). Once the pending values have been sent they
+    // are removed from the saved snapshot. clearState erases the saved snapshot, the
+    // in-memory attribute table, and the pending queue. Both return 0 on success.
+    //
+    int saveState();
+    int clearState();
+
+    // Write the current snapshot into a caller-provided buffer. Returns the number of bytes
+    // needed, which may be larger than bufferSize (in which case nothing useful is written).
+    //
+    size_t stateSnapshot(uint8_t* buffer, size_t bufferSize);
+
+    // Called by loop to give time for networking layer. Until the connection is ready, each
+    // call also advances the connect sequence by one step. It never sleeps. Only work that is
+    // due is done, and the return value is the number of milliseconds until something else
+    // comes due (connect retry, heartbeat, child batch, keepalive, and so on). Data from the
+    // cloud can turn up at any time, so call it again sooner if you can.
+    //
+    unsigned long loop();
+
+    // Old form: runs loop() and then delays. Kept so existing sketches build unchanged.
+    //
+    void loop(float delayMs);
+
+    // Sleep until the next deadline returned by loop(), until data arrives from the cloud, or
+    // until wake returns true, but no longer than maxMs. Returns the milliseconds slept.
+    //
+    unsigned long idle(unsigned long maxMs = SIMPLEIOT_IDLE_MAX_MS, SimpleIOTWakeCallback wake = NULL);
+
+    // Periodic SYS heartbeat with device health (uptime, heap, RSSI, queue depth, publish and
+    // reconnect counters). 0 turns it off, which is the default. The interval adapts: when
+    // app data has gone out since the last heartbeat it's stretched (the data already shows
+    // the device is alive), and after a publish error or reconnect it's shortened.
+    //
+    void setHeartbeat(unsigned long intervalSecs);
+
+    // Returns 0 if the heartbeat went out, -1 if it couldn't be sent or the connection isn't
+    // ready yet
+    //
+    int sendHeartbeat();
+
+    // Duty-cycle mode for battery devices. Call before config(). The device deep sleeps
+    // between wakes and onSample is called on each wake. Every samplesPerReport wakes (so once
+    // per reportIntervalSecs) it connects, sends everything queued, and goes back to sleep.
+    // In this mode config() does not return on wakes that only sample.
+    //
+    void setDutyCycle(unsigned long reportIntervalSecs, SimpleIOTSampleCallback onSample,
+                      int samplesPerReport = 1);
+
+    // Milliseconds the radio was on during the last report cycle, and wakes since power-on.
+    //
+    unsigned long lastRadioOnTime();
+    unsigned long wakeCount();
+
+    // WiFi fast connect. After a good connect, the access point's BSSID and channel are kept
+    // in RTC memory (and NVS, so they survive a power cycle) and used on the next connect
+    // to skip the scan. If reuseLease is set, the last DHCP lease is also reused as a static
+    // configuration to skip DHCP. If the fast connect doesn't succeed quickly we fall back to
+    // a normal scan and DHCP. Fast connect is on by default, lease reuse is off. Call before config().
+    //
+    void setWiFiFastConnect(bool enable, bool reuseLease = false);
+
+    // TLS session resumption. On by default: reconnects offer the last session so they can
+    // skip the full certificate handshake. Set acrossDeepSleep to also keep the session in
+    // RTC memory. Call before config().
+    //
+    void setTLSSessionResumption(bool enable, bool acrossDeepSleep = false);
+
+    // Certificates and key as DER blobs instead of the PEM strings given to create(). Pass NULL
+    // for the PEM arguments to create() when using this. DER is parsed in place with no base64
+    // decoding, so the arrays must stay around (const arrays in flash are fine). Used for
+    // direct connections, Greengrass discovery and the core connection alike, and for OTA
+    // downloads. Call before config().
+    //
+    void setCredentialsDER(const uint8_t* caDer, size_t caLength,
+                           const uint8_t* certDer, size_t certLength,
+                           const uint8_t* keyDer, size_t keyLength);
+
+    // Convert the PEM credentials to DER once and keep them in NVS, so later boots skip the
+    // PEM decoding. Off by default. Call before config().
+    //
+    void setCredentialCache(bool enable);
+
+    // Persistent MQTT session. The client ID is fixed (model-serial) and the broker keeps our
+    // subscriptions and any QoS 1 messages sent while we're offline. If the broker still has
+    // the session when we reconnect, subscribing is skipped. Off by default. Call before config().
+    //
+    void setPersistentSession(bool enable);
+    bool sessionResumed() { return _sessionResumed; }
+
+    // Gateway mode only. Replace cloud discovery with the app's own handler, for example to
+    // use a fixed core address or for testing without the cloud. Call before config().
+    //
+    void setDiscoveryHandler(SimpleIOTDiscoveryHandler handler);
+
+    // Forget the saved Greengrass core so the next connect runs discovery again
+    //
+    void clearGatewayCache();
+
+    // Gateway failover. The endpoints are tried in order: each saved core address, then AWS
+    // IOT directly. While connected directly, the core is checked every failbackCheckSecs and
+    // the device moves back to it once it answers. Values set() during a switch are queued
+    // and sent on the new path. Off by default. Call before config().
+    //
+    void setGatewayFailover(bool enable, unsigned long failbackCheckSecs = 300);
+    SimpleIOTPath currentPath() { return _path; }
+
+    // Seconds spent connected on each path since boot
+    //
+    unsigned long pathTime(SimpleIOTPath path);
+
+    // TLS statistics since boot. tlsHandshakeTime is in microseconds, for the last connect.
+    // The resumption hit rate is tlsResumedCount() / tlsHandshakeCount().
+    //
+    unsigned long tlsHandshakeTime();
+    unsigned long tlsHandshakeCount();
+    unsigned long tlsResumedCount();
+
+    // Connection progress. phaseTime returns how many milliseconds the last connect spent in
+    // the given phase (IOT_CONN_WIFI, IOT_CONN_CONNECT, or IOT_CONN_SUBSCRIBE).
+    //
+    SimpleIOTConnState connectionState() { return _connState; }
+    bool isReady() { return _ready; }
+    unsigned long phaseTime(SimpleIOTConnState phase);
+
+    // Microseconds spent in each phase of the last connect. A SYS 'connect' message with the
+    // same breakdown is also sent each time the connection becomes ready.
+    //
+    unsigned long phaseMicros(SimpleIOTConnPhase phase);
+
+    // Round-trip time through the broker, AWS IOT or the Greengrass core, in microseconds.
+    // sendRoundTripProbe publishes a small message on one of the device's own diag topics;
+    // once loop() has received it back, roundTripTime is updated. Useful for comparing a
+    // local gateway against a direct cloud connection.
+    //
+    int sendRoundTripProbe();
+    unsigned long roundTripTime() { return _rttUs; }
+    unsigned long roundTripCount() { return _rttCount; }
+
+    // How many times the connection has been lost and brought back since boot
     //
-    void loop(float delayMs=200);
+    unsigned long reconnectCount() { return _reconnectCount; }
 
     // Allow getter to secure wifi in case main app needs to use it
     //
@@ -202,6 +570,87 @@ public:
     //
     void performOTA(const char* url, SimpleIOTOTACallback otaCallback = NULL);
 
+    // Same as performOTA, but the download runs in its own task and this returns right away.
+    // The app keeps running and loop() keeps MQTT going. Progress and the done callback are
+    // called from loop(). Once the new firmware is installed, the app picks when to restart
+    // (ESP.restart()). Returns 0, or -1 if an OTA is already running or the task can't start.
+    //
+    int performOTAAsync(const char* url, SimpleIOTOTACallback otaCallback = NULL,
+                        SimpleIOTOTADoneCallback onDone = NULL);
+    SimpleIOTOTAState otaState() { return _otaState; }
+
+    // Progress with throughput and time remaining, sent no more often than minIntervalMs.
+    // The callback passed to performOTA is rate limited the same way.
+    //
+    void setOTAProgressCallback(SimpleIOTOTAProgressCallback onProgress,
+                                unsigned long minIntervalMs = SIMPLEIOT_OTA_PROGRESS_MS);
+
+    // Where the background OTA task runs, and a cap on its download rate so it doesn't take
+    // all of the link. 0 means no cap. The cap also applies to performOTA.
+    //
+    void setOTATask(int core = SIMPLEIOT_OTA_TASK_CORE, int priority = SIMPLEIOT_OTA_TASK_PRIORITY,
+                    unsigned long maxKBps = 0);
+
+    // Size of each of the two download buffers, 4 to 16 KB. One fills from the network while
+    // the other is written to flash. Larger buffers mean fewer, longer flash writes.
+    //
+    void setOTABufferSize(size_t bytes);
+
+    // Throughput of the last OTA download in KB/s, and how long the download and the flash
+    // writes took in milliseconds. The writes overlap the download, so they don't add up.
+    //
+    unsigned long otaKBps() { return _otaKBps; }
+    unsigned long otaDownloadMs() { return _otaDownloadMs; }
+    unsigned long otaWriteMs() { return _otaWriteMs; }
+
+    // Expected hashes for the next performOTA, as hex strings, and an optional base64
+    // signature of the image's SHA-256. These are picked up from the update message, so apps
+    // only need this when they get the download URL some other way. The image is hashed as it
+    // downloads and is only installed if everything given matches.
+    //
+    void setOTAHash(const char* md5, const char* sha256 = NULL, const char* signature = NULL);
+
+    // Pin the public key (PEM) that updates must be signed with. Once set, unsigned updates
+    // are refused. Returns 0 or -1 if the key can't be parsed.
+    //
+    int setOTASigningKey(const char* publicKeyPem);
+
+    // Delta update for the next performOTA: a patch against baseVersion, made with
+    // extras/simpleiot_delta.py. It's only used when baseVersion is the running firmware
+    // version, and the full image URL passed to performOTA is the fallback. Like the hashes,
+    // this is normally picked up from the update message.
+    //
+    void setOTADelta(const char* url, const char* baseVersion);
+
+    // Milliseconds spent hashing and checking the last OTA image, apart from the download
+    //
+    unsigned long otaVerifyMs() { return _otaVerifyMs; }
+
+    // Download a config or data file (display images, model parameters and so on) to path
+    // on LittleFS, which the app must have mounted. The file is checked against the hashes
+    // from the update message like a firmware image, and only replaces the old one once it's
+    // complete. Returns 0 or -1, and the file update callback is called either way.
+    //
+    int performFileUpdate(const char* url, const char* path, SimpleIOTUpdateType type = UPDATE_FILE,
+                          SimpleIOTOTACallback otaCallback = NULL);
+
+    // Same, but on the background OTA task like performOTAAsync, so loop() keeps MQTT going.
+    // Update messages handled by the SDK use this. The file update callback is called from
+    // loop() when it's done. Returns 0, or -1 if an OTA is already running.
+    //
+    int performFileUpdateAsync(const char* url, const char* path, SimpleIOTUpdateType type = UPDATE_FILE,
+                               SimpleIOTOTACallback otaCallback = NULL);
+
+    // Once this is set, UPDATE_CONFIG and UPDATE_FILE messages are handled by the SDK
+    // without waking the trigger update callback, and onFileUpdate is told about each file
+    // that changed. Call before config() so the update topic is subscribed.
+    //
+    void setFileUpdateCallback(SimpleIOTFileUpdateCallback onFileUpdate);
+
+    // The file the last update message was for. Empty for firmware updates.
+    //
+    const char* updatePath() { return _otaPath; }
+
     // You can call this explicitly at boot time to issue an async 'check' request.
     // If there is a matching update, it will be returned via the SimpleIOTTriggerUpdateCallback
     // callback handler in the config call. At that point, you can prompt the user aand call the performOTA
@@ -210,13 +659,25 @@ public:
     void checkForUpdate(bool force = false);
 
     // Call this to confirm update has been installed. This will mark the upadte
-    // as complete for this device.
+    // as complete for this device. New firmware installed by performOTA does this by itself
+    // once it has proven itself, see setOTAConfirmTimeout.
     //
     void updateInstalled();
 
+    // After an update, the new firmware is on probation. It's kept once it reaches MQTT ready
+    // and sends a heartbeat within timeoutSecs of time awake (added up over duty-cycle wakes),
+    // and updateInstalled() is sent for it. If it doesn't, or it restarts more than
+    // SIMPLEIOT_OTA_CONFIRM_RESTARTS times first, the previous firmware is put back and
+    // reports the rollback once it connects.
+    //
+    void setOTAConfirmTimeout(unsigned long timeoutSecs);
+    bool otaOnProbation() { return _otaProbation; }
+    bool otaRolledBack() { return _otaRollbackReport; }
+
     // For internal use, but it can't be declared private
     //
     void _invokeCallback(const char* topic, const char* buffer, const unsigned int length);
+    void _wifiEvent(WiFiEvent_t event);
     //int diag(const char* diagID, const char* result);
 
   protected:
@@ -246,8 +707,55 @@ public:
     char* _fwVersion;
     char* _monitorTopic;
     char* _diagTopic;
+    char* _adminTopic;
     char* _triggerUpdateTopic;
     char* _clientId;
+
+    SimpleIOTConnState _connState;
+    unsigned long _phaseStartMs;
+    unsigned long _phaseMs[IOT_CONN_READY];
+    unsigned long _phaseUs[IOT_PHASE_COUNT];
+    unsigned long _subscribeStartUs;
+    unsigned long _rttSeq;
+    unsigned long _rttSentUs;              // 0 when no probe is outstanding
+    unsigned long _rttUs;
+    unsigned long _rttCount;
+    volatile unsigned long _wifiBeginUs;      // these are set from the WiFi event task
+    volatile unsigned long _wifiAssocUs;
+    volatile unsigned long _wifiGotIpUs;
+    const char* _subscribeTopics[SIMPLEIOT_MAX_SUBSCRIPTIONS];
+    int _subscribeCount;
+    int _subscribeIndex;
+    int _subscribedCount;                   // topics the broker has for the current session
+    bool _persistentSession;
+    bool _sessionResumed;
+    uint16_t _packetId;                     // for the SUBSCRIBEs and PUBLISHes we build ourselves
+    uint16_t _subackId;                     // SUBACK we're waiting for, 0 if none
+    int _subackLast;                        // _subscribeIndex once it's in
+    unsigned long _subackStartMs;
+    uint8_t _rxHeader[5];                   // the packet _readPacket is part way through
+    size_t _rxHeaderLength;
+    size_t _rxLength;
+    size_t _rxGot;
+    uint8_t* _rxBody;
+
+    SimpleIOTChild* _children;              // allocated by the first addChild
+    int _childCount;
+    SimpleIOTChildValue* _childQueue;
+    int _childQueueCount;
+    unsigned long _childQueueStartMs;       // when the oldest queued value was set
+    unsigned long _childBatchMs;
+    unsigned long _loopDeadlineMs;          // millis() when loop() next has work to do
+    unsigned long _heartbeatIntervalMs;
+    unsigned long _lastHeartbeatMs;
+    unsigned long _lastAppPublishMs;
+    unsigned long _publishCount;
+    unsigned long _publishFailCount;
+    bool _errorSinceHeartbeat;
+
+    int _retryCount;                // failed attempts since the last successful connect
+    unsigned long _retryDelayMs;
+    unsigned long _reconnectCount;
     
     SimpleIOTReadyCallbackStruct _readyCallback;
     SimpleIOTDataCallbackStruct _dataCallback;
@@ -257,14 +765,92 @@ public:
 
     char _monitorTopicBuffer[INTERNAL_TOPIC_BUFFER_SIZE + 1];
     char _triggerUpdateTopicBuffer[INTERNAL_TOPIC_BUFFER_SIZE + 1];
-    int _fwUpdateTotalLength;       //total size of firmware to download
-    int _fwUpdateCurrentLength;     //current size of written firmware
+    char _fleetUpdateTopicBuffer[INTERNAL_TOPIC_BUFFER_SIZE + 1];   // updates for the whole model
+    char _diagTopicBuffer[INTERNAL_TOPIC_BUFFER_SIZE + 1];
+    char _adminTopicBuffer[INTERNAL_TOPIC_BUFFER_SIZE + 1];
+    char _clientIdBuffer[INTERNAL_STATIC_BUFFER_SIZE + 1];
+
+    SimpleIOTAttribute _attributes[SIMPLEIOT_MAX_ATTRIBUTES];
+    int _attributeCount;
+    SimpleIOTAttribute _pending[SIMPLEIOT_MAX_PENDING];   // ring buffer of values not yet sent
+    int _pendingHead;
+    int _pendingCount;
+    bool _pendingSaved;                     // the NVS snapshot may still hold pending values
+    volatile int _fwUpdateTotalLength;       //total size of firmware to download
+    volatile int _fwUpdateCurrentLength;     //current size of written firmware
     int _fwUpdatePercent;           //Percent downloaded
-
-    WiFiClientSecure* _wifiClient;
+    size_t _otaBufferSize;
+    unsigned long _otaKBps;
+    unsigned long _otaDownloadMs;
+    unsigned long _otaWriteMs;
+    unsigned long _otaVerifyMs;
+    char _otaMd5[SIMPLEIOT_OTA_MD5_SIZE];
+    char _otaSha256[SIMPLEIOT_OTA_SHA256_SIZE];
+    uint8_t _otaSignature[SIMPLEIOT_OTA_SIGNATURE_SIZE];
+    size_t _otaSignatureLength;
+    mbedtls_pk_context _otaSigningKey;
+    bool _haveOtaSigningKey;
+    bool _otaGzip;                          // update message says the image is gzipped
+    String _otaDeltaUrl;
+    SimpleIOTOTARequest _otaRequest;        // the update in progress, read by the OTA task
+    volatile SimpleIOTOTAState _otaState;
+    bool _otaAsync;
+    bool _otaReported;
+    SimpleIOTOTADoneCallback _otaDoneCallback;
+    TaskHandle_t _otaTask;
+    int _otaTaskCore;
+    int _otaTaskPriority;
+    unsigned long _otaMaxKBps;
+    SimpleIOTOTAProgressCallback _otaProgressCallback;
+    unsigned long _otaProgressIntervalMs;
+    unsigned long _otaLastProgressMs;
+    unsigned long _otaStartMs;
+    int _otaStartBytes;
+    char _otaDeltaBase[SIMPLEIOT_OTA_VERSION_SIZE];
+    char _otaVersion[SIMPLEIOT_OTA_VERSION_SIZE];   // from the update message
+    char _otaPath[SIMPLEIOT_OTA_PATH_SIZE];         // same, for config and file updates
+    SimpleIOTUpdateType _otaFileType;               // of the file update in _otaRequest
+    SimpleIOTFileUpdateCallback _fileUpdateCallback;
+    SimpleIOTOTAPending _otaPending;
+    bool _otaProbation;                     // running new firmware that isn't confirmed yet
+    bool _otaRollbackReport;                // rolled back, not yet reported
+    unsigned long _otaConfirmTimeoutMs;
+    bool _otaConfirmFailed;                 // the last confirm heartbeat couldn't be sent
+    unsigned long _otaConfirmTriedMs;
+
+    bool _tlsResume;
+    bool _tlsResumeRtc;
+    bool _wifiFastConnect;
+    bool _wifiReuseLease;
+    bool _wifiFastAttempt;          // current WiFi attempt is using the cached settings
+    unsigned long _wifiBeginMs;
+    unsigned long _radioOnStartMs;
+
+    unsigned long _dutyIntervalSecs;
+    int _dutySamplesPerReport;
+    SimpleIOTSampleCallback _dutySampleCallback;
+    bool _dutyReported;                     // everything queued has been acknowledged
+    uint16_t _pubackId;                     // report batch waiting for its PUBACK, 0 if none
+    int _pubackCount;                       // values in that batch, from the head of the queue
+    unsigned long _pubackStartMs;
+
+    SimpleIOTCredentials _credentials;      // parsed once, shared by the IOT and OTA connections
+    bool _haveDerCredentials;
+    SimpleIOTSecureClient* _wifiClient;
     MqttClient* _mqttClient;
-    AWSGreenGrassIoT* _greengrass;
-    static SimpleIOT* _iot_singleton;  // have to do this to avoid forking and modifying AWSGreenGrassIoT
+    static SimpleIOT* _iot_singleton;  // so the C-style callbacks can find the instance
+
+    SimpleIOTGGCore* _ggCore;               // gateway mode only
+    bool _ggCoreValid;
+    uint8_t _ggFailures;                    // saved addresses that failed since the last good connect
+    SimpleIOTCredentials _ggCredentials;    // the group CA the core's certificate is checked against
+    SimpleIOTDiscoveryHandler _discoveryHandler;
+    SimpleIOTPath _path;
+    bool _failover;
+    unsigned long _failbackCheckMs;
+    unsigned long _lastFailbackCheckMs;
+    unsigned long _pathMs[IOT_PATH_COUNT];
+    unsigned long _pathReadyMs;             // when the current path became ready
 
 
     // Private methods
@@ -282,8 +868,74 @@ public:
     int _sendRawMessage(const char* op,
                         DynamicJsonDocument payload,
                         SimpleIOTMessageType msgtype=MESSAGE_APP);
-    int _publish(char* buffer, char* payload);
-    void _updateFirmware(uint8_t *data, size_t len);
+    int _publish(char* buffer, char* payload, unsigned long* sentUs = NULL);
+    void _startConnect();
+    void _beginWiFi(bool useCache);
+    void _saveWiFiCache();
+    void _connectStep();
+    void _setConnState(SimpleIOTConnState state);
+    void _connectFailed(int status, const char* message);
+    bool _isConnected();
+    void _connectionLost();
+    int _setValue(const char* name, const char* value, SimpleIOTType type);
+    int _setValue(const char* name, const char* value, SimpleIOTType type, float lat, float lng);
+    SimpleIOTAttribute* _recordAttribute(const char* name, const char* value, SimpleIOTType type,
+                        uint8_t flags, float lat, float lng);
+    int _queuePending(const char* name, const char* value, SimpleIOTType type,
+                        uint8_t flags, float lat, float lng);
+    void _flushPending();
+    void _pendingSent();
+    bool _restoreState();
+    bool _loadSnapshot(const uint8_t* buffer, size_t size);
+    bool _dutyCycleWake();
+    void _dutyCycleSleep();
+    void _dutyCycleStep();
+    void _sendDutyCycleReport();
+    int _sendPendingBatch();
+    int _pubackCheck();
+    void _heartbeatStep();
+    unsigned long _heartbeatInterval();
+    unsigned long _nextDeadline();
+    int _discover();
+    int _cloudDiscover(SimpleIOTGGCore* core);
+    bool _loadGatewayCache();
+    void _saveGatewayCache();
+    const char* _subscribeTopic(int index, char* buffer);
+    int _subscribeBatch();
+    int _subscribeCheck();
+    int _readAck(uint8_t type, uint16_t packetId, uint8_t** body, size_t* bodyLength);
+    int _readPacket(uint8_t* header, size_t* headerLength, uint8_t** body, size_t* bodyLength);
+    void _resetPacket();
+    int _setChildValue(int child, const char* name, const char* value, SimpleIOTType type);
+    void _childTopic(char* buffer, const char* prefix, int child, const char* suffix);
+    int _findChild(const char* topic);
+    void _flushChildren();
+    void _childStep();
+    void _setPath(SimpleIOTPath path);
+    void _leavePath();
+    bool _gatewayAlive();
+    void _failbackStep();
+    void _sendConnectReport();
+    void _sendDiagResult(const char* diagId, const char* result);
+    void _returnState(const char* diagId);
+    void _otaSnapshot(const char* url);
+    int _otaPerform(const SimpleIOTOTARequest* request);
+    int _otaInstall(const SimpleIOTOTARequest* request, bool delta);
+    int _fileInstall(const SimpleIOTOTARequest* request);
+    int _otaStartTask();
+    void _fileUpdateDone(int status);
+    int _reportFileUpdate(int status);
+    bool _updateWanted(DynamicJsonDocument& jdoc, SimpleIOTUpdateType type);
+    static void _otaTaskMain(void* arg);
+    void _otaStep();
+    int _otaDownload(const char* url, SimpleIOTOTAJob* job);
+    void _updateProgress(size_t len);
+    void _reportProgress(bool force);
+    void _finishUpdate();
+    void _otaCheckPending();
+    void _otaConfirmStep();
+    void _otaRollback(uint8_t reason);
+    int _otaReportRollback();
     void _doUpdate(char* op, bool force = false);
     void _updateReceived();      // this marks the update as having been received.
 
@@ -0,0 +1,842 @@
+/*
+ * © 2022 Amazon Web Services, Inc. or its affiliates. All Rights Reserved.
+ *
+ * SimpleIOT Arduino Client Library -- firmware download pipeline
+ */
+
+#include "SimpleIOTOTA.h"
+#include <rom/crc.h>
+
+#define SIMPLEIOT_OTA_WRITER_STACK      6144      // NVS writes for the resume point happen here too
+#define SIMPLEIOT_OTA_WRITER_PRIORITY   2
+#define SIMPLEIOT_OTA_FLUSH_TIMEOUT_MS 30000
+
+#define GZIP_ID1              0x1F
+#define GZIP_ID2              0x8B
+#define GZIP_DEFLATE          8
+#define GZIP_FHCRC            0x02
+#define GZIP_FEXTRA           0x04
+#define GZIP_FNAME            0x08
+#define GZIP_FCOMMENT         0x10
+#define GZIP_HEADER_SIZE      10
+#define GZIP_TRAILER_SIZE     8
+
+SimpleIOTOTAWriter::SimpleIOTOTAWriter()
+{
+  for (int i = 0; i < SIMPLEIOT_OTA_BUFFER_COUNT; i++) {
+    this->_buffers[i] = NULL;
+  }
+  this->_bufferSize = 0;
+  this->_current = NULL;
+  this->_fill = 0;
+  this->_full = NULL;
+  this->_free = NULL;
+  this->_done = NULL;
+  this->_task = NULL;
+  this->_sink = NULL;
+  this->_context = NULL;
+  this->_failed = false;
+  this->_writeUs = 0;
+}
+
+SimpleIOTOTAWriter::~SimpleIOTOTAWriter()
+{
+  this->end();
+}
+
+int SimpleIOTOTAWriter::begin(size_t bufferSize, SimpleIOTOTASink sink, void* context)
+{
+  this->end();
+  this->_bufferSize = bufferSize;
+  this->_sink = sink;
+  this->_context = context;
+  this->_failed = false;
+  this->_writeUs = 0;
+
+  this->_full = xQueueCreate(SIMPLEIOT_OTA_BUFFER_COUNT + 1, sizeof(Chunk));
+  this->_free = xQueueCreate(SIMPLEIOT_OTA_BUFFER_COUNT, sizeof(uint8_t*));
+  this->_done = xSemaphoreCreateBinary();
+  if (!this->_full || !this->_free || !this->_done) {
+    this->end();
+    return -1;
+  }
+  for (int i = 0; i < SIMPLEIOT_OTA_BUFFER_COUNT; i++) {
+    this->_buffers[i] = (uint8_t*) malloc(bufferSize);
+    if (!this->_buffers[i]) {
+      Serial.printf("SimpleIOT: ERROR: No memory for %u byte OTA buffers\n", bufferSize);
+      this->end();
+      return -1;
+    }
+    xQueueSend(this->_free, &this->_buffers[i], 0);
+  }
+
+  // Flash writes go on the other core from the network code (the task calling us) when
+  // there is one
+  //
+  BaseType_t core = portNUM_PROCESSORS > 1 ? 1 - xPortGetCoreID() : tskNO_AFFINITY;
+  if (xTaskCreatePinnedToCore(_writerTask, "simpleiot_ota", SIMPLEIOT_OTA_WRITER_STACK, this,
+                              SIMPLEIOT_OTA_WRITER_PRIORITY, &this->_task, core) != pdPASS) {
+    this->_task = NULL;
+    this->end();
+    return -1;
+  }
+  return 0;
+}
+
+uint8_t* SimpleIOTOTAWriter::fillBuffer(size_t* room)
+{
+  if (this->_failed) {
+    return NULL;
+  }
+  if (!this->_current) {
+    xQueueReceive(this->_free, &this->_current, portMAX_DELAY);
+    this->_fill = 0;
+  }
+  *room = this->_bufferSize - this->_fill;
+  return this->_current + this->_fill;
+}
+
+void SimpleIOTOTAWriter::filled(size_t length)
+{
+  this->_fill += length;
+  if (this->_fill >= this->_bufferSize) {
+    this->_handOff();
+  }
+}
+
+void SimpleIOTOTAWriter::_handOff()
+{
+  Chunk chunk = { this->_current, this->_fill };
+
+  xQueueSend(this->_full, &chunk, portMAX_DELAY);
+  this->_current = NULL;
+  this->_fill = 0;
+}
+
+int SimpleIOTOTAWriter::flush()
+{
+  if (!this->_task) {
+    return -1;
+  }
+  if (this->_current && this->_fill > 0) {
+    this->_handOff();
+  }
+
+  // Once every buffer is back on the free queue, nothing is left to write
+  //
+  uint8_t* held[SIMPLEIOT_OTA_BUFFER_COUNT];
+  int count = 0;
+
+  if (this->_current) {
+    held[count++] = this->_current;
+    this->_current = NULL;
+  }
+  while (count < SIMPLEIOT_OTA_BUFFER_COUNT) {
+    if (xQueueReceive(this->_free, &held[count], pdMS_TO_TICKS(SIMPLEIOT_OTA_FLUSH_TIMEOUT_MS)) != pdTRUE) {
+      this->_failed = true;
+      break;
+    }
+    count++;
+  }
+  for (int i = 0; i < count; i++) {
+    xQueueSend(this->_free, &held[i], 0);
+  }
+  return this->_failed ? -1 : 0;
+}
+
+void SimpleIOTOTAWriter::end()
+{
+  if (this->_task) {
+    Chunk stop = { NULL, 0 };
+
+    xQueueSend(this->_full, &stop, portMAX_DELAY);
+    xSemaphoreTake(this->_done, portMAX_DELAY);
+    this->_task = NULL;
+  }
+  for (int i = 0; i < SIMPLEIOT_OTA_BUFFER_COUNT; i++) {
+    free(this->_buffers[i]);
+    this->_buffers[i] = NULL;
+  }
+  if (this->_full) {
+    vQueueDelete(this->_full);
+    this->_full = NULL;
+  }
+  if (this->_free) {
+    vQueueDelete(this->_free);
+    this->_free = NULL;
+  }
+  if (this->_done) {
+    vSemaphoreDelete(this->_done);
+    this->_done = NULL;
+  }
+  this->_current = NULL;
+  this->_fill = 0;
+}
+
+void SimpleIOTOTAWriter::_writerTask(void* arg)
+{
+  ((SimpleIOTOTAWriter*) arg)->_run();
+  vTaskDelete(NULL);
+}
+
+void SimpleIOTOTAWriter::_run()
+{
+  Chunk chunk;
+
+  while (xQueueReceive(this->_full, &chunk, portMAX_DELAY) == pdTRUE && chunk.data) {
+    // After a failure keep taking buffers back so the reader never blocks on us
+    //
+    if (!this->_failed) {
+      unsigned long start = micros();
+      if (this->_sink(this->_context, chunk.data, chunk.length) != 0) {
+        this->_failed = true;
+      }
+      this->_writeUs += micros() - start;
+    }
+    xQueueSend(this->_free, &chunk.data, portMAX_DELAY);
+  }
+  xSemaphoreGive(this->_done);
+}
+
+SimpleIOTOTAFlash::SimpleIOTOTAFlash()
+{
+  this->_partition = NULL;
+  this->_offset = 0;
+  this->_erasedTo = 0;
+}
+
+int SimpleIOTOTAFlash::begin(size_t offset)
+{
+  this->_partition = esp_ota_get_next_update_partition(NULL);
+  if (!this->_partition) {
+    Serial.println("SimpleIOT: ERROR: No OTA partition");
+    return -1;
+  }
+  if (offset > this->_partition->size) {
+    offset = 0;
+  }
+  this->_offset = offset;
+
+  // The sector holding the resume point was erased before it was written, and everything
+  // past the resume point in it is still blank
+  //
+  this->_erasedTo = (offset + SIMPLEIOT_OTA_SECTOR_SIZE - 1) / SIMPLEIOT_OTA_SECTOR_SIZE * SIMPLEIOT_OTA_SECTOR_SIZE;
+  return 0;
+}
+
+int SimpleIOTOTAFlash::write(const uint8_t* data, size_t length)
+{
+  if (!this->_partition || this->_offset + length > this->_partition->size) {
+    return -1;
+  }
+  while (this->_erasedTo < this->_offset + length) {
+    if (esp_partition_erase_range(this->_partition, this->_erasedTo, SIMPLEIOT_OTA_SECTOR_SIZE) != ESP_OK) {
+      return -1;
+    }
+    this->_erasedTo += SIMPLEIOT_OTA_SECTOR_SIZE;
+  }
+  if (esp_partition_write(this->_partition, this->_offset, data, length) != ESP_OK) {
+    return -1;
+  }
+  this->_offset += length;
+  return 0;
+}
+
+int SimpleIOTOTAFlash::finish()
+{
+  if (!this->_partition) {
+    return -1;
+  }
+
+  // This also checks the image header and the SHA-256 the build appends to it
+  //
+  esp_err_t err = esp_ota_set_boot_partition(this->_partition);
+  if (err != ESP_OK) {
+    Serial.printf("SimpleIOT: ERROR: New image not bootable: %s\n", esp_err_to_name(err));
+    return -1;
+  }
+  return 0;
+}
+
+SimpleIOTOTAFile::SimpleIOTOTAFile()
+{
+  this->_path[0] = '\0';
+  this->_tempPath[0] = '\0';
+}
+
+SimpleIOTOTAFile::~SimpleIOTOTAFile()
+{
+  this->abort();
+}
+
+int SimpleIOTOTAFile::begin(const char* path, size_t offset)
+{
+  if (!path || *path != '/' || strlen(path) >= SIMPLEIOT_OTA_PATH_SIZE) {
+    Serial.println("SimpleIOT: ERROR: Bad update file path");
+    return -1;
+  }
+  if (this->_file) {
+    this->_file.close();
+  }
+  if (path != this->_path) {
+    strcpy(this->_path, path);       // a retry passes path() back in
+  }
+  snprintf(this->_tempPath, sizeof(this->_tempPath), "%s%s", path, SIMPLEIOT_OTA_TEMP_SUFFIX);
+
+  this->_file = LittleFS.open(this->_tempPath, offset > 0 ? FILE_APPEND : FILE_WRITE, true);
+  if (!this->_file) {
+    Serial.println("SimpleIOT: ERROR: Can't open " + String(this->_tempPath));
+    return -1;
+  }
+  if (this->_file.size() != offset) {
+    this->abort();
+    return -1;
+  }
+  return 0;
+}
+
+int SimpleIOTOTAFile::write(const uint8_t* data, size_t length)
+{
+  if (!this->_file || this->_file.write(data, length) != length) {
+    return -1;             // most likely the filesystem is full
+  }
+  return 0;
+}
+
+int SimpleIOTOTAFile::finish()
+{
+  if (!this->_file) {
+    return -1;
+  }
+  this->_file.close();
+
+  // LittleFS replaces an existing target in the rename itself
+  //
+  if (!LittleFS.rename(this->_tempPath, this->_path)) {
+    Serial.println("SimpleIOT: ERROR: Can't replace " + String(this->_path));
+    LittleFS.remove(this->_tempPath);
+    return -1;
+  }
+  this->_tempPath[0] = '\0';
+  return 0;
+}
+
+void SimpleIOTOTAFile::abort()
+{
+  if (this->_file) {
+    this->_file.close();
+  }
+  if (this->_tempPath[0] != '\0') {
+    LittleFS.remove(this->_tempPath);
+    this->_tempPath[0] = '\0';
+  }
+}
+
+SimpleIOTOTAVerifier::SimpleIOTOTAVerifier()
+{
+  mbedtls_md5_init(&this->_md5);
+  mbedtls_sha256_init(&this->_sha256);
+  this->_expectedMd5[0] = '\0';
+  this->_expectedSha256[0] = '\0';
+  this->_signature = NULL;
+  this->_signatureLength = 0;
+  this->_key = NULL;
+  this->_useMd5 = false;
+  this->_useSha256 = false;
+  this->_verifyUs = 0;
+}
+
+SimpleIOTOTAVerifier::~SimpleIOTOTAVerifier()
+{
+  mbedtls_md5_free(&this->_md5);
+  mbedtls_sha256_free(&this->_sha256);
+}
+
+void SimpleIOTOTAVerifier::begin(const char* md5, const char* sha256, const uint8_t* signature,
+                                 size_t signatureLength, mbedtls_pk_context* key)
+{
+  strncpy(this->_expectedMd5, md5 ? md5 : "", SIMPLEIOT_OTA_MD5_SIZE - 1);
+  this->_expectedMd5[SIMPLEIOT_OTA_MD5_SIZE - 1] = '\0';
+  strncpy(this->_expectedSha256, sha256 ? sha256 : "", SIMPLEIOT_OTA_SHA256_SIZE - 1);
+  this->_expectedSha256[SIMPLEIOT_OTA_SHA256_SIZE - 1] = '\0';
+  this->_signature = signature;
+  this->_signatureLength = signatureLength;
+  this->_key = key;
+  this->_verifyUs = 0;
+
+  // The signature is over the SHA-256, so a pinned key always needs it
+  //
+  this->_useMd5 = this->_expectedMd5[0] != '\0';
+  this->_useSha256 = this->_expectedSha256[0] != '\0' || key != NULL;
+  if (this->_useMd5) {
+    mbedtls_md5_starts_ret(&this->_md5);
+  }
+  if (this->_useSha256) {
+    mbedtls_sha256_starts_ret(&this->_sha256, 0);
+  }
+}
+
+void SimpleIOTOTAVerifier::update(const uint8_t* data, size_t length)
+{
+  unsigned long start = micros();
+
+  if (this->_useMd5) {
+    mbedtls_md5_update_ret(&this->_md5, data, length);
+  }
+  if (this->_useSha256) {
+    mbedtls_sha256_update_ret(&this->_sha256, data, length);
+  }
+  this->_verifyUs += micros() - start;
+}
+
+void SimpleIOTOTAVerifier::saveState(SimpleIOTOTAHashState* state)
+{
+  // Clone first. With the hardware SHA engine the running state may only be in the engine,
+  // and cloning copies it out into a software context.
+  //
+  memcpy(&state->md5, &this->_md5, sizeof(state->md5));
+  mbedtls_sha256_init(&state->sha256);
+  mbedtls_sha256_clone(&state->sha256, &this->_sha256);
+}
+
+void SimpleIOTOTAVerifier::restoreState(const SimpleIOTOTAHashState* state)
+{
+  memcpy(&this->_md5, &state->md5, sizeof(this->_md5));
+  mbedtls_sha256_free(&this->_sha256);
+  memcpy(&this->_sha256, &state->sha256, sizeof(this->_sha256));
+}
+
+static void _toHex(const uint8_t* data, size_t length, char* out)
+{
+  static const char digits[] = "0123456789abcdef";
+
+  for (size_t i = 0; i < length; i++) {
+    out[i * 2] = digits[data[i] >> 4];
+    out[i * 2 + 1] = digits[data[i] & 0x0F];
+  }
+  out[length * 2] = '\0';
+}
+
+int SimpleIOTOTAVerifier::finish()
+{
+  unsigned long start = micros();
+  int ret = 0;
+
+  if (this->_useMd5) {
+    uint8_t digest[16];
+    char hex[SIMPLEIOT_OTA_MD5_SIZE];
+
+    mbedtls_md5_finish_ret(&this->_md5, digest);
+    _toHex(digest, sizeof(digest), hex);
+    if (strcasecmp(hex, this->_expectedMd5) != 0) {
+      Serial.printf("SimpleIOT: ERROR: MD5 mismatch, got %s expected %s\n", hex, this->_expectedMd5);
+      ret = -1;
+    }
+  }
+  if (this->_useSha256) {
+    uint8_t digest[32];
+    char hex[SIMPLEIOT_OTA_SHA256_SIZE];
+
+    mbedtls_sha256_finish_ret(&this->_sha256, digest);
+    _toHex(digest, sizeof(digest), hex);
+    if (this->_expectedSha256[0] && strcasecmp(hex, this->_expectedSha256) != 0) {
+      Serial.printf("SimpleIOT: ERROR: SHA-256 mismatch, got %s\n", hex);
+      ret = -1;
+    }
+    if (this->_key) {
+      if (!this->_signature || this->_signatureLength == 0) {
+        Serial.println("SimpleIOT: ERROR: Update is not signed");
+        ret = -1;
+      } else if (mbedtls_pk_verify(this->_key, MBEDTLS_MD_SHA256, digest, sizeof(digest),
+                                   this->_signature, this->_signatureLength) != 0) {
+        Serial.println("SimpleIOT: ERROR: Bad update signature");
+        ret = -1;
+      }
+    }
+  }
+  this->_verifyUs += micros() - start;
+  return ret;
+}
+
+SimpleIOTOTAInflater::SimpleIOTOTAInflater()
+{
+  this->_decompressor = NULL;
+  this->_window = NULL;
+  this->_windowPos = 0;
+  this->_sink = NULL;
+  this->_context = NULL;
+  this->_state = HEADER;
+  this->_flags = 0;
+  this->_count = 0;
+  this->_skip = 0;
+  this->_crc = 0;
+  this->_size = 0;
+}
+
+SimpleIOTOTAInflater::~SimpleIOTOTAInflater()
+{
+  this->end();
+}
+
+bool SimpleIOTOTAInflater::isGzip(const uint8_t* data, size_t length)
+{
+  return length >= 3 && data[0] == GZIP_ID1 && data[1] == GZIP_ID2 && data[2] == GZIP_DEFLATE;
+}
+
+int SimpleIOTOTAInflater::begin(SimpleIOTOTASink sink, void* context)
+{
+  this->end();
+  this->_decompressor = (tinfl_decompressor*) malloc(sizeof(tinfl_decompressor));
+  this->_window = (uint8_t*) malloc(TINFL_LZ_DICT_SIZE);
+  if (!this->_decompressor || !this->_window) {
+    Serial.println("SimpleIOT: ERROR: No memory to inflate OTA image");
+    this->end();
+    return -1;
+  }
+  tinfl_init(this->_decompressor);
+  this->_windowPos = 0;
+  this->_sink = sink;
+  this->_context = context;
+  this->_state = HEADER;
+  this->_flags = 0;
+  this->_count = 0;
+  this->_skip = 0;
+  this->_crc = 0;
+  this->_size = 0;
+  return 0;
+}
+
+void SimpleIOTOTAInflater::end()
+{
+  free(this->_decompressor);
+  this->_decompressor = NULL;
+  free(this->_window);
+  this->_window = NULL;
+}
+
+// Move past optional header fields that aren't there
+//
+void SimpleIOTOTAInflater::_skipAbsent()
+{
+  if (this->_state == EXTRA_LENGTH && !(this->_flags & GZIP_FEXTRA)) {
+    this->_state = NAME;
+  }
+  if (this->_state == NAME && !(this->_flags & GZIP_FNAME)) {
+    this->_state = COMMENT;
+  }
+  if (this->_state == COMMENT && !(this->_flags & GZIP_FCOMMENT)) {
+    this->_state = HEADER_CRC;
+  }
+  if (this->_state == HEADER_CRC) {
+    this->_skip = 2;
+    if (!(this->_flags & GZIP_FHCRC)) {
+      this->_state = BODY;
+    }
+  }
+}
+
+// Walk the gzip header a byte at a time. The state is BODY once the deflate data starts.
+//
+int SimpleIOTOTAInflater::_headerByte(uint8_t b)
+{
+  switch (this->_state) {
+    case HEADER:
+      this->_bytes[this->_count++] = b;
+      if (this->_count == GZIP_HEADER_SIZE) {
+        if (!isGzip(this->_bytes, this->_count)) {
+          Serial.println("SimpleIOT: ERROR: Not a gzip image");
+          return -1;
+        }
+        this->_flags = this->_bytes[3];
+        this->_count = 0;
+        this->_state = EXTRA_LENGTH;
+        this->_skipAbsent();
+      }
+      break;
+
+    case EXTRA_LENGTH:
+      this->_bytes[this->_count++] = b;
+      if (this->_count == 2) {
+        this->_skip = this->_bytes[0] | (this->_bytes[1] << 8);
+        this->_state = this->_skip > 0 ? EXTRA : NAME;
+        this->_skipAbsent();
+      }
+      break;
+
+    case EXTRA:
+      if (--this->_skip == 0) {
+        this->_state = NAME;
+        this->_skipAbsent();
+      }
+      break;
+
+    case NAME:
+      if (b == 0) {
+        this->_state = COMMENT;
+        this->_skipAbsent();
+      }
+      break;
+
+    case COMMENT:
+      if (b == 0) {
+        this->_state = HEADER_CRC;
+        this->_skipAbsent();
+      }
+      break;
+
+    case HEADER_CRC:
+      if (--this->_skip == 0) {
+        this->_state = BODY;
+      }
+      break;
+
+    default:
+      break;
+  }
+  return 0;
+}
+
+int SimpleIOTOTAInflater::write(const uint8_t* data, size_t length)
+{
+  while (length > 0) {
+    switch (this->_state) {
+      case BODY:
+        if (this->_inflate(&data, &length) != 0) {
+          return -1;
+        }
+        break;
+
+      case TRAILER:
+        this->_bytes[this->_count++] = *data++;
+        length--;
+        if (this->_count == GZIP_TRAILER_SIZE) {
+          uint32_t crc = this->_bytes[0] | (this->_bytes[1] << 8) | (this->_bytes[2] << 16) | ((uint32_t) this->_bytes[3] << 24);
+          uint32_t size = this->_bytes[4] | (this->_bytes[5] << 8) | (this->_bytes[6] << 16) | ((uint32_t) this->_bytes[7] << 24);
+
+          if (crc != this->_crc || size != this->_size) {
+            Serial.println("SimpleIOT: ERROR: gzip CRC or length mismatch");
+            return -1;
+          }
+          this->_state = DONE;
+        }
+        break;
+
+      case DONE:
+        return 0;             // anything after the trailer is ignored
+
+      default:
+        if (this->_headerByte(*data) != 0) {
+          return -1;
+        }
+        data++;
+        length--;
+        break;
+    }
+  }
+  return 0;
+}
+
+int SimpleIOTOTAInflater::_inflate(const uint8_t** data, size_t* length)
+{
+  while (true) {
+    size_t in = *length;
+    size_t out = TINFL_LZ_DICT_SIZE - this->_windowPos;
+    tinfl_status status = tinfl_decompress(this->_decompressor, *data, &in, this->_window,
+                                           this->_window + this->_windowPos, &out, TINFL_FLAG_HAS_MORE_INPUT);
+
+    *data += in;
+    *length -= in;
+    if (out > 0) {
+      const uint8_t* produced = this->_window + this->_windowPos;
+
+      this->_crc = crc32_le(this->_crc, produced, out);
+      this->_size += out;
+      if (this->_sink(this->_context, produced, out) != 0) {
+        return -1;
+      }
+      this->_windowPos = (this->_windowPos + out) & (TINFL_LZ_DICT_SIZE - 1);
+    }
+    if (status < TINFL_STATUS_DONE) {
+      Serial.printf("SimpleIOT: ERROR: Bad compressed data (%d)\n", status);
+      return -1;
+    }
+    if (status == TINFL_STATUS_DONE) {
+      this->_state = TRAILER;
+      this->_count = 0;
+      return 0;
+    }
+    if (status == TINFL_STATUS_NEEDS_MORE_INPUT && *length == 0) {
+      return 0;
+    }
+  }
+}
+
+static uint32_t _le32(const uint8_t* p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+SimpleIOTOTAPatcher::SimpleIOTOTAPatcher()
+{
+  this->_base = NULL;
+  this->_copyBuffer = NULL;
+  this->_sink = NULL;
+  this->_context = NULL;
+  this->_state = HEADER;
+  this->_count = 0;
+  this->_op = 0;
+  this->_remaining = 0;
+  this->_targetSize = 0;
+  this->_produced = 0;
+  this->_baseSize = 0;
+}
+
+SimpleIOTOTAPatcher::~SimpleIOTOTAPatcher()
+{
+  this->end();
+}
+
+int SimpleIOTOTAPatcher::begin(SimpleIOTOTASink sink, void* context)
+{
+  this->end();
+  this->_base = esp_ota_get_running_partition();
+  if (!this->_base || esp_partition_get_sha256(this->_base, this->_baseSha256) != ESP_OK) {
+    Serial.println("SimpleIOT: ERROR: Can't hash the running firmware");
+    return -1;
+  }
+  this->_baseSize = ESP.getSketchSize();      // the length of the image that was hashed
+  this->_copyBuffer = (uint8_t*) malloc(SIMPLEIOT_OTA_COPY_CHUNK);
+  if (!this->_copyBuffer) {
+    return -1;
+  }
+  this->_sink = sink;
+  this->_context = context;
+  this->_state = HEADER;
+  this->_count = 0;
+  this->_produced = 0;
+  return 0;
+}
+
+void SimpleIOTOTAPatcher::end()
+{
+  free(this->_copyBuffer);
+  this->_copyBuffer = NULL;
+}
+
+int SimpleIOTOTAPatcher::_header()
+{
+  if (_le32(this->_bytes) != SIMPLEIOT_OTA_PATCH_MAGIC) {
+    Serial.println("SimpleIOT: ERROR: Not a delta patch");
+    return -1;
+  }
+  if (_le32(this->_bytes + 4) != this->_baseSize ||
+      memcmp(this->_bytes + 8, this->_baseSha256, sizeof(this->_baseSha256)) != 0) {
+    Serial.println("SimpleIOT: Delta patch is for a different base image");
+    return -1;
+  }
+  this->_targetSize = _le32(this->_bytes + 40);
+  return 0;
+}
+
+int SimpleIOTOTAPatcher::_emit(const uint8_t* data, size_t length)
+{
+  if (this->_produced + length > this->_targetSize) {
+    Serial.println("SimpleIOT: ERROR: Delta patch overruns the image");
+    return -1;
+  }
+  this->_produced += length;
+  return this->_sink(this->_context, data, length);
+}
+
+int SimpleIOTOTAPatcher::_copy(uint32_t offset, uint32_t length)
+{
+  if (offset + length > this->_base->size || offset + length < offset) {
+    return -1;
+  }
+  while (length > 0) {
+    size_t chunk = min(length, (uint32_t) SIMPLEIOT_OTA_COPY_CHUNK);
+
+    if (esp_partition_read(this->_base, offset, this->_copyBuffer, chunk) != ESP_OK ||
+        this->_emit(this->_copyBuffer, chunk) != 0) {
+      return -1;
+    }
+    offset += chunk;
+    length -= chunk;
+  }
+  return 0;
+}
+
+int SimpleIOTOTAPatcher::write(const uint8_t* data, size_t length)
+{
+  while (length > 0) {
+    switch (this->_state) {
+      case HEADER:
+        this->_bytes[this->_count++] = *data++;
+        length--;
+        if (this->_count == SIMPLEIOT_OTA_PATCH_HEADER_SIZE) {
+          if (this->_header() != 0) {
+            return -1;
+          }
+          this->_state = OP;
+        }
+        break;
+
+      case OP:
+        this->_op = *data++;
+        length--;
+        this->_count = 0;
+        if (this->_op == SIMPLEIOT_OTA_PATCH_END) {
+          if (this->_produced != this->_targetSize) {
+            Serial.println("SimpleIOT: ERROR: Delta patch is short");
+            return -1;
+          }
+          this->_state = DONE;
+        } else if (this->_op == SIMPLEIOT_OTA_PATCH_COPY || this->_op == SIMPLEIOT_OTA_PATCH_ADD) {
+          this->_state = ARGS;
+        } else {
+          Serial.printf("SimpleIOT: ERROR: Bad delta op %u\n", this->_op);
+          return -1;
+        }
+        break;
+
+      case ARGS: {
+        size_t needed = this->_op == SIMPLEIOT_OTA_PATCH_COPY ? 8 : 4;
+
+        this->_bytes[this->_count++] = *data++;
+        length--;
+        if (this->_count < needed) {
+          break;
+        }
+        if (this->_op == SIMPLEIOT_OTA_PATCH_COPY) {
+          if (this->_copy(_le32(this->_bytes), _le32(this->_bytes + 4)) != 0) {
+            return -1;
+          }
+          this->_state = OP;
+        } else {
+          this->_remaining = _le32(this->_bytes);
+          this->_state = this->_remaining > 0 ? ADD_DATA : OP;
+        }
+        break;
+      }
+
+      case ADD_DATA: {
+        size_t chunk = min((size_t) this->_remaining, length);
+
+        if (this->_emit(data, chunk) != 0) {
+          return -1;
+        }
+        data += chunk;
+        length -= chunk;
+        this->_remaining -= chunk;
+        if (this->_remaining == 0) {
+          this->_state = OP;
+        }
+        break;
+      }
+
+      case DONE:
+        return 0;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,384 @@
+/*
+ *  © 2022 Amazon Web Services, Inc. or its affiliates. All Rights Reserved.
+ *
+ *  SimpleIOT Arduino client library.
+ *
+ *  Firmware download pipeline. The image is read from the network into one large buffer
+ *  while the previous buffer is written to flash by a separate task, so the download and
+ *  the flash writes overlap instead of taking turns.
+ *
+ *  The image is hashed as it goes by, so checking it doesn't need a second pass over flash.
+ *
+ *  Images are written straight to the next OTA partition at a given offset rather than
+ *  through Update, so an interrupted download can pick up where it left off.
+ *
+ *  gzip-compressed images are inflated on the fly with the miniz inflater in ROM.
+ *
+ *  Delta updates are a list of COPY and ADD operations against the running firmware. COPY
+ *  reads from the running partition, ADD carries new bytes, and the result is streamed into
+ *  the new partition. extras/simpleiot_delta.py makes and checks the patches.
+ *
+ *  Config and file updates go through the same pipeline into a file on LittleFS instead.
+ */
+
+#ifndef __SIMPLEIOT_OTA_H__
+#define __SIMPLEIOT_OTA_H__
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <mbedtls/md5.h>
+#include <mbedtls/sha256.h>
+#include <mbedtls/pk.h>
+#include <esp_partition.h>
+#include <esp_ota_ops.h>
+#include <rom/miniz.h>
+#include <LittleFS.h>
+
+#define SIMPLEIOT_OTA_BUFFER_SIZE       8192
+#define SIMPLEIOT_OTA_BUFFER_MIN        4096
+#define SIMPLEIOT_OTA_BUFFER_MAX        16384
+#define SIMPLEIOT_OTA_BUFFER_COUNT      2
+#define SIMPLEIOT_OTA_MD5_SIZE          33      // hex plus terminator
+#define SIMPLEIOT_OTA_SHA256_SIZE       65
+#define SIMPLEIOT_OTA_SIGNATURE_SIZE    512     // room for RSA-4096
+#define SIMPLEIOT_OTA_SECTOR_SIZE       4096
+#define SIMPLEIOT_OTA_ETAG_SIZE         72
+#define SIMPLEIOT_OTA_VERSION_SIZE      24
+#define SIMPLEIOT_OTA_PATCH_MAGIC       0x50444953      // "SIDP"
+#define SIMPLEIOT_OTA_PATCH_HEADER_SIZE 44              // magic, base size, base SHA-256, target size
+#define SIMPLEIOT_OTA_PATCH_END         0x00
+#define SIMPLEIOT_OTA_PATCH_COPY        0x01            // base offset, length
+#define SIMPLEIOT_OTA_PATCH_ADD         0x02            // length, then the bytes
+#define SIMPLEIOT_OTA_COPY_CHUNK        1024
+#define SIMPLEIOT_OTA_PATH_SIZE         64
+#define SIMPLEIOT_OTA_TEMP_SUFFIX       ".tmp"
+
+// Why an update was rolled back, kept in SimpleIOTOTAPending
+//
+#define SIMPLEIOT_OTA_ROLLBACK_NONE         0
+#define SIMPLEIOT_OTA_ROLLBACK_TIMEOUT      1   // didn't connect and send a heartbeat in time
+#define SIMPLEIOT_OTA_ROLLBACK_RESTARTS     2   // restarted too many times before that
+#define SIMPLEIOT_OTA_ROLLBACK_BOOTLOADER   3   // the bootloader went back to the old image
+
+// Where the filled buffers go. Returns 0, or -1 to fail the download.
+//
+typedef int (*SimpleIOTOTASink)(void* context, const uint8_t* data, size_t length);
+
+class SimpleIOTOTAWriter {
+
+public:
+    SimpleIOTOTAWriter();
+    ~SimpleIOTOTAWriter();
+
+    // Allocates the buffers and starts the writer task. Returns 0 or -1 if out of memory.
+    //
+    int begin(size_t bufferSize, SimpleIOTOTASink sink, void* context);
+
+    // The buffer to read into and how much room is left in it. Blocks while both buffers are
+    // still being written. Returns NULL if a write has failed.
+    //
+    uint8_t* fillBuffer(size_t* room);
+
+    // length bytes were read into fillBuffer(). A full buffer is handed to the writer task.
+    //
+    void filled(size_t length);
+
+    // Hand off whatever is in the current buffer and wait for every write to finish.
+    // Returns 0 or -1 if any write failed.
+    //
+    int flush();
+    void end();
+
+    bool failed() { return _failed; }
+    unsigned long writeUs() { return _writeUs; }
+
+private:
+    typedef struct {
+      uint8_t* data;
+      size_t length;
+    } Chunk;
+
+    uint8_t* _buffers[SIMPLEIOT_OTA_BUFFER_COUNT];
+    size_t _bufferSize;
+    uint8_t* _current;
+    size_t _fill;
+    QueueHandle_t _full;
+    QueueHandle_t _free;
+    SemaphoreHandle_t _done;
+    TaskHandle_t _task;
+    SimpleIOTOTASink _sink;
+    void* _context;
+    volatile bool _failed;
+    volatile unsigned long _writeUs;
+
+    static void _writerTask(void* arg);
+    void _run();
+    void _handOff();
+};
+
+// Hash state part way through an image, saved with the resume point. The SHA-256 context is
+// always the software form, so it can be picked up again after a reboot.
+//
+typedef struct {
+  mbedtls_md5_context md5;
+  mbedtls_sha256_context sha256;
+} SimpleIOTOTAHashState;
+
+// Where an interrupted download got to. Kept in NVS and written every so often while the
+// image downloads, so it always matches what is really in flash.
+//
+typedef struct {
+  uint32_t magic;
+  uint32_t key;                             // CRC of the URL path and expected hashes
+  uint32_t partition;                       // flash address of the target partition
+  uint32_t total;
+  uint32_t offset;                          // bytes written to flash and hashed
+  char etag[SIMPLEIOT_OTA_ETAG_SIZE];
+  SimpleIOTOTAHashState hash;
+} SimpleIOTOTAResume;
+
+// An installed update on probation. Written to NVS once the new image is set to boot, and
+// cleared when it has connected and sent a heartbeat, or after a rollback has been reported.
+//
+typedef struct {
+  uint32_t magic;
+  uint32_t previous;                        // flash address of the image it replaced
+  uint32_t target;                          // flash address of the new image
+  uint32_t awakeMs;                         // time on probation before this boot, over deep sleeps
+  uint8_t restarts;                         // times the new image started without confirming
+  uint8_t rollback;                         // SIMPLEIOT_OTA_ROLLBACK_*
+  char version[SIMPLEIOT_OTA_VERSION_SIZE]; // version of the new image
+} SimpleIOTOTAPending;
+
+// Firmware image writes to the next OTA partition. Each sector is erased just before the
+// first write into it. Nothing changes what boots until finish().
+//
+class SimpleIOTOTAFlash {
+
+public:
+    SimpleIOTOTAFlash();
+
+    // Start writing at offset, which is 0 for a new image or the resume point. Returns 0 or
+    // -1 if there is no OTA partition.
+    //
+    int begin(size_t offset);
+    int write(const uint8_t* data, size_t length);
+
+    // Check the image and make it the boot partition. Returns 0 or -1.
+    //
+    int finish();
+
+    bool started() { return _partition != NULL; }
+    size_t offset() { return _offset; }
+    const esp_partition_t* partition() { return _partition; }
+
+private:
+    const esp_partition_t* _partition;
+    size_t _offset;
+    size_t _erasedTo;
+};
+
+// Config and file updates. The download goes to a temp file next to the target, which is
+// renamed over the target only once it's all in and checked, so readers of the file see
+// either the old one or the new one, never part of it. LittleFS must already be mounted.
+//
+class SimpleIOTOTAFile {
+
+public:
+    SimpleIOTOTAFile();
+    ~SimpleIOTOTAFile();
+
+    // Returns 0, or -1 if the path is too long or the temp file can't be opened. With an
+    // offset, the temp file is appended to and must already hold exactly that many bytes.
+    //
+    int begin(const char* path, size_t offset);
+    int write(const uint8_t* data, size_t length);
+
+    // Rename the temp file over the target. Returns 0 or -1.
+    //
+    int finish();
+
+    // Close and remove the temp file, leaving the target as it was
+    //
+    void abort();
+
+    bool started() { return _file; }
+    const char* path() { return _path; }
+
+private:
+    File _file;
+    char _path[SIMPLEIOT_OTA_PATH_SIZE];
+    char _tempPath[SIMPLEIOT_OTA_PATH_SIZE + sizeof(SIMPLEIOT_OTA_TEMP_SUFFIX)];
+};
+
+// Incremental MD5 and SHA-256 of an image, checked against the expected values when it's
+// all in. If a public key is given, the SHA-256 must also carry a valid signature from it
+// (RSA PKCS#1 v1.5 or ECDSA). Only the checks that have expected values are run.
+//
+class SimpleIOTOTAVerifier {
+
+public:
+    SimpleIOTOTAVerifier();
+    ~SimpleIOTOTAVerifier();
+
+    // md5 and sha256 are hex strings, either can be NULL or empty. signature is raw bytes.
+    //
+    void begin(const char* md5, const char* sha256, const uint8_t* signature, size_t signatureLength,
+               mbedtls_pk_context* key);
+    void update(const uint8_t* data, size_t length);
+
+    // Returns 0 if every check passed, -1 if any failed
+    //
+    int finish();
+
+    bool checking() { return _useMd5 || _useSha256; }
+
+    // Save and restore the running hashes, for resuming a download after begin()
+    //
+    void saveState(SimpleIOTOTAHashState* state);
+    void restoreState(const SimpleIOTOTAHashState* state);
+
+    // Time spent hashing and checking, in microseconds
+    //
+    unsigned long verifyUs() { return _verifyUs; }
+
+private:
+    mbedtls_md5_context _md5;
+    mbedtls_sha256_context _sha256;
+    char _expectedMd5[SIMPLEIOT_OTA_MD5_SIZE];
+    char _expectedSha256[SIMPLEIOT_OTA_SHA256_SIZE];
+    const uint8_t* _signature;
+    size_t _signatureLength;
+    mbedtls_pk_context* _key;
+    bool _useMd5;
+    bool _useSha256;
+    unsigned long _verifyUs;
+};
+
+// Inflates a gzip stream and passes the output on to a sink. Memory is bounded by the 32 KB
+// deflate window plus the decompressor state, about 43 KB in all, allocated by begin().
+// The CRC-32 and length in the gzip trailer are checked at the end.
+//
+class SimpleIOTOTAInflater {
+
+public:
+    SimpleIOTOTAInflater();
+    ~SimpleIOTOTAInflater();
+
+    static bool isGzip(const uint8_t* data, size_t length);
+
+    int begin(SimpleIOTOTASink sink, void* context);
+    void end();
+
+    // Feed compressed bytes. Returns 0, or -1 on bad data or if the sink fails.
+    //
+    int write(const uint8_t* data, size_t length);
+
+    // True once the whole stream, trailer included, has been read and checked
+    //
+    bool done() { return _state == DONE; }
+
+private:
+    typedef enum { HEADER, EXTRA_LENGTH, EXTRA, NAME, COMMENT, HEADER_CRC, BODY, TRAILER, DONE } State;
+
+    tinfl_decompressor* _decompressor;
+    uint8_t* _window;
+    size_t _windowPos;
+    SimpleIOTOTASink _sink;
+    void* _context;
+    State _state;
+    uint8_t _flags;
+    uint8_t _bytes[10];                     // fixed header or trailer being collected
+    size_t _count;
+    size_t _skip;
+    uint32_t _crc;
+    uint32_t _size;
+
+    int _headerByte(uint8_t b);
+    void _skipAbsent();
+    int _inflate(const uint8_t** data, size_t* length);
+};
+
+// Applies a delta patch against the running firmware, passing the new image to a sink. All
+// numbers in the patch are little-endian uint32. The patch names the SHA-256 of the image it
+// was made from, and is refused if that isn't what is running.
+//
+class SimpleIOTOTAPatcher {
+
+public:
+    SimpleIOTOTAPatcher();
+    ~SimpleIOTOTAPatcher();
+
+    // Hashes the running image, so this takes a moment. The patch header has to match both
+    // the hash and the size of it, the same checks simpleiot_delta.py makes. Returns 0 or -1.
+    //
+    int begin(SimpleIOTOTASink sink, void* context);
+    void end();
+
+    // Feed patch bytes. Returns 0, or -1 on a bad patch, wrong base, or if the sink fails.
+    //
+    int write(const uint8_t* data, size_t length);
+
+    // True once the END op has been seen and the whole new image has gone to the sink
+    //
+    bool done() { return _state == DONE; }
+
+private:
+    typedef enum { HEADER, OP, ARGS, ADD_DATA, DONE } State;
+
+    const esp_partition_t* _base;
+    uint8_t _baseSha256[32];
+    uint32_t _baseSize;
+    uint8_t* _copyBuffer;
+    SimpleIOTOTASink _sink;
+    void* _context;
+    State _state;
+    uint8_t _bytes[SIMPLEIOT_OTA_PATCH_HEADER_SIZE];
+    size_t _count;
+    uint8_t _op;
+    uint32_t _remaining;
+    uint32_t _targetSize;
+    uint32_t _produced;
+
+    int _header();
+    int _copy(uint32_t offset, uint32_t length);
+    int _emit(const uint8_t* data, size_t length);
+};
+
+// What one update was asked to do, copied from the OTA settings when it starts. The download
+// only reads this, so an update message that arrives meanwhile can't change the URL or the
+// expected hashes under it.
+//
+typedef struct {
+  String url;
+  String deltaUrl;                          // empty unless a delta applies to the running version
+  char path[SIMPLEIOT_OTA_PATH_SIZE];       // config and file updates only, empty for firmware
+  char version[SIMPLEIOT_OTA_VERSION_SIZE];
+  char md5[SIMPLEIOT_OTA_MD5_SIZE];
+  char sha256[SIMPLEIOT_OTA_SHA256_SIZE];
+  uint8_t signature[SIMPLEIOT_OTA_SIGNATURE_SIZE];
+  size_t signatureLength;
+  mbedtls_pk_context* key;                  // NULL if no signing key is pinned
+  bool gzip;
+} SimpleIOTOTARequest;
+
+// One OTA download. Handed to the flash writer task as the sink context.
+//
+typedef struct {
+  const SimpleIOTOTARequest* request;
+  SimpleIOTOTAVerifier* verifier;
+  SimpleIOTOTAFlash* flash;
+  SimpleIOTOTAResume* resume;
+  SimpleIOTOTAInflater* inflater;
+  SimpleIOTOTAPatcher* patcher;             // NULL unless this is a delta download
+  SimpleIOTOTAFile* file;                   // set for config and file updates, instead of flash
+  bool gzip;                                // the update message said it's compressed
+  bool compressed;                          // this download is being inflated
+  uint32_t received;                        // bytes of the download handed to the sink
+  uint32_t savedOffset;
+} SimpleIOTOTAJob;
+
+#endif
@@ -0,0 +1,707 @@
+/*
+ * © 2022 Amazon Web Services, Inc. or its affiliates. All Rights Reserved.
+ *
+ * SimpleIOT Arduino Client Library -- TLS client with session resumption
+ */
+
+#include "SimpleIOTSecureClient.h"
+#include <WiFi.h>
+#include <lwip/sockets.h>
+#include <Preferences.h>
+#include <mbedtls/asn1.h>
+#include <rom/crc.h>
+
+#define SIMPLEIOT_TLS_RTC_MAGIC        0x534C5453    // "STLS"
+#define SIMPLEIOT_TLS_SOCKET_TIMEOUT_MS 30000
+
+#define SIMPLEIOT_CRED_NVS_NAMESPACE   "simpleiot"
+#define SIMPLEIOT_CRED_NVS_KEY         "creds"
+#define SIMPLEIOT_CRED_CACHE_MAGIC     0x44524543    // "CRED"
+#define SIMPLEIOT_CRED_KEY_DER_SIZE    2560          // big enough for an RSA-4096 or EC key
+
+// Header of the DER cache blob in NVS. The CA chain, device certificate and key follow it.
+//
+typedef struct {
+  uint32_t magic;
+  uint32_t crc;
+  uint16_t caLength;
+  uint16_t certLength;
+  uint16_t keyLength;
+  uint16_t reserved;
+} SimpleIOTCredCacheHeader;
+
+// Session kept across deep sleep. RTC memory is zeroed on a cold boot, so a zero magic
+// means there's nothing saved.
+//
+typedef struct {
+  uint32_t magic;
+  uint16_t port;
+  uint16_t length;
+  char host[SIMPLEIOT_TLS_HOST_SIZE];
+  uint8_t data[SIMPLEIOT_TLS_SESSION_SIZE];
+} SimpleIOTRtcSession;
+
+RTC_DATA_ATTR static SimpleIOTRtcSession _rtcSession;
+
+
+// Parse a DER certificate chain that's just the certificates back to back. Each one is
+// an ASN.1 SEQUENCE, so its outer length tells us where the next one starts.
+//
+static int _parseDerChain(mbedtls_x509_crt* chain, const uint8_t* der, size_t length, bool inPlace)
+{
+  const uint8_t* end = der + length;
+
+  while (der < end) {
+    unsigned char* p = (unsigned char*) der;
+    size_t len = 0;
+
+    int ret = mbedtls_asn1_get_tag(&p, end, &len, MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE);
+    if (ret != 0) {
+      return ret;
+    }
+    size_t total = (p - der) + len;
+
+    ret = inPlace ? mbedtls_x509_crt_parse_der_nocopy(chain, der, total)
+                  : mbedtls_x509_crt_parse_der(chain, der, total);
+    if (ret != 0) {
+      return ret;
+    }
+    der += total;
+  }
+  return 0;
+}
+
+SimpleIOTCredentials::SimpleIOTCredentials()
+{
+  this->_ca = NULL;
+  this->_caLength = 0;
+  this->_cert = NULL;
+  this->_certLength = 0;
+  this->_key = NULL;
+  this->_keyLength = 0;
+  this->_isPem = false;
+  this->_nvsCache = false;
+  this->_loaded = false;
+  this->_fromCache = false;
+  this->_loadUs = 0;
+  mbedtls_x509_crt_init(&this->_caChain);
+  mbedtls_x509_crt_init(&this->_clientCert);
+  mbedtls_pk_init(&this->_clientKey);
+}
+
+SimpleIOTCredentials::~SimpleIOTCredentials()
+{
+  this->unload();
+}
+
+void SimpleIOTCredentials::setPem(const char* caPem, const char* certPem, const char* keyPem)
+{
+  this->unload();
+  this->_ca = (const uint8_t*) caPem;
+  this->_caLength = caPem ? strlen(caPem) + 1 : 0;       // mbedtls wants the terminator counted
+  this->_cert = (const uint8_t*) certPem;
+  this->_certLength = certPem ? strlen(certPem) + 1 : 0;
+  this->_key = (const uint8_t*) keyPem;
+  this->_keyLength = keyPem ? strlen(keyPem) + 1 : 0;
+  this->_isPem = true;
+}
+
+void SimpleIOTCredentials::setDer(const uint8_t* caDer, size_t caLength,
+                                  const uint8_t* certDer, size_t certLength,
+                                  const uint8_t* keyDer, size_t keyLength)
+{
+  this->unload();
+  this->_ca = caDer;
+  this->_caLength = caLength;
+  this->_cert = certDer;
+  this->_certLength = certLength;
+  this->_key = keyDer;
+  this->_keyLength = keyLength;
+  this->_isPem = false;
+}
+
+void SimpleIOTCredentials::unload()
+{
+  mbedtls_x509_crt_free(&this->_caChain);
+  mbedtls_x509_crt_free(&this->_clientCert);
+  mbedtls_pk_free(&this->_clientKey);
+  mbedtls_x509_crt_init(&this->_caChain);
+  mbedtls_x509_crt_init(&this->_clientCert);
+  mbedtls_pk_init(&this->_clientKey);
+  this->_loaded = false;
+}
+
+int SimpleIOTCredentials::load()
+{
+  if (this->_loaded) {
+    return 0;
+  }
+
+  unsigned long start = micros();
+  uint32_t crc = 0;
+  int ret;
+
+  this->_fromCache = false;
+  if (this->_isPem && this->_nvsCache) {
+    crc = this->_sourceCrc();
+    this->_fromCache = this->_loadCache(crc);
+  }
+  if (!this->_fromCache) {
+    ret = this->_parse(this->_ca, this->_caLength, this->_cert, this->_certLength,
+                       this->_key, this->_keyLength, this->_isPem, !this->_isPem);
+    if (ret != 0) {
+      this->unload();
+      return ret;
+    }
+    if (this->_isPem && this->_nvsCache) {
+      this->_saveCache(crc);
+    }
+  }
+  this->_loaded = true;
+  this->_loadUs = micros() - start;
+
+  #ifdef _DEBUG
+    Serial.printf("SimpleIOT: Credentials loaded in %lu us%s\n", this->_loadUs,
+                  this->_fromCache ? " from NVS cache" : "");
+  #endif
+  return 0;
+}
+
+int SimpleIOTCredentials::_parse(const uint8_t* ca, size_t caLength, const uint8_t* cert, size_t certLength,
+                                 const uint8_t* key, size_t keyLength, bool pem, bool inPlace)
+{
+  int ret;
+
+  // A positive return from a PEM parse means some certificates in a chain were skipped.
+  // Same as the stock client, we treat that as OK.
+  //
+  if (ca) {
+    ret = pem ? mbedtls_x509_crt_parse(&this->_caChain, ca, caLength)
+          : _parseDerChain(&this->_caChain, ca, caLength, inPlace);
+    if (ret < 0) {
+      return ret;
+    }
+  }
+  if (cert && key) {
+    ret = pem ? mbedtls_x509_crt_parse(&this->_clientCert, cert, certLength)
+          : _parseDerChain(&this->_clientCert, cert, certLength, inPlace);
+    if (ret < 0) {
+      return ret;
+    }
+    ret = mbedtls_pk_parse_key(&this->_clientKey, key, keyLength, NULL, 0);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+  return 0;
+}
+
+uint32_t SimpleIOTCredentials::_sourceCrc()
+{
+  uint32_t crc = 0;
+
+  if (this->_ca) {
+    crc = crc32_le(crc, this->_ca, this->_caLength);
+  }
+  if (this->_cert) {
+    crc = crc32_le(crc, this->_cert, this->_certLength);
+  }
+  if (this->_key) {
+    crc = crc32_le(crc, this->_key, this->_keyLength);
+  }
+  return crc;
+}
+
+bool SimpleIOTCredentials::_loadCache(uint32_t crc)
+{
+  Preferences prefs;
+  SimpleIOTCredCacheHeader header;
+  bool loaded = false;
+
+  if (!prefs.begin(SIMPLEIOT_CRED_NVS_NAMESPACE, true)) {
+    return false;
+  }
+  size_t size = prefs.getBytesLength(SIMPLEIOT_CRED_NVS_KEY);
+  if (size > sizeof(header)) {
+    uint8_t* buffer = (uint8_t*) malloc(size);
+    if (buffer) {
+      prefs.getBytes(SIMPLEIOT_CRED_NVS_KEY, buffer, size);
+      memcpy(&header, buffer, sizeof(header));
+
+      if (header.magic == SIMPLEIOT_CRED_CACHE_MAGIC && header.crc == crc &&
+          sizeof(header) + header.caLength + header.certLength + header.keyLength == size) {
+        const uint8_t* ca = buffer + sizeof(header);
+        const uint8_t* cert = ca + header.caLength;
+        const uint8_t* key = cert + header.certLength;
+
+        // The buffer is freed below, so the certificates get their own copies
+        //
+        loaded = this->_parse(header.caLength ? ca : NULL, header.caLength,
+                              header.certLength ? cert : NULL, header.certLength,
+                              header.keyLength ? key : NULL, header.keyLength, false, false) == 0;
+        if (!loaded) {
+          this->unload();
+        }
+      }
+      free(buffer);
+    }
+  }
+  prefs.end();
+  return loaded;
+}
+
+void SimpleIOTCredentials::_saveCache(uint32_t crc)
+{
+#ifdef MBEDTLS_PK_WRITE_C
+  SimpleIOTCredCacheHeader header;
+  size_t caLength = 0;
+  size_t certLength = 0;
+  int keyLength = 0;
+
+  for (mbedtls_x509_crt* crt = &this->_caChain; crt && crt->raw.p; crt = crt->next) {
+    caLength += crt->raw.len;
+  }
+  for (mbedtls_x509_crt* crt = &this->_clientCert; crt && crt->raw.p; crt = crt->next) {
+    certLength += crt->raw.len;
+  }
+
+  size_t size = sizeof(header) + caLength + certLength + SIMPLEIOT_CRED_KEY_DER_SIZE;
+  uint8_t* buffer = (uint8_t*) malloc(size);
+  if (!buffer) {
+    return;
+  }
+
+  uint8_t* p = buffer + sizeof(header);
+  for (mbedtls_x509_crt* crt = &this->_caChain; crt && crt->raw.p; crt = crt->next) {
+    memcpy(p, crt->raw.p, crt->raw.len);
+    p += crt->raw.len;
+  }
+  for (mbedtls_x509_crt* crt = &this->_clientCert; crt && crt->raw.p; crt = crt->next) {
+    memcpy(p, crt->raw.p, crt->raw.len);
+    p += crt->raw.len;
+  }
+
+  // mbedtls writes the key at the end of the buffer it's given
+  //
+  if (this->hasClientCert()) {
+    keyLength = mbedtls_pk_write_key_der(&this->_clientKey, p, SIMPLEIOT_CRED_KEY_DER_SIZE);
+    if (keyLength < 0) {
+      free(buffer);
+      return;
+    }
+    memmove(p, p + SIMPLEIOT_CRED_KEY_DER_SIZE - keyLength, keyLength);
+  }
+
+  header.magic = SIMPLEIOT_CRED_CACHE_MAGIC;
+  header.crc = crc;
+  header.caLength = (uint16_t) caLength;
+  header.certLength = (uint16_t) certLength;
+  header.keyLength = (uint16_t) keyLength;
+  header.reserved = 0;
+  memcpy(buffer, &header, sizeof(header));
+
+  Preferences prefs;
+  if (prefs.begin(SIMPLEIOT_CRED_NVS_NAMESPACE, false)) {
+    prefs.putBytes(SIMPLEIOT_CRED_NVS_KEY, buffer, sizeof(header) + caLength + certLength + keyLength);
+    prefs.end();
+  }
+  memset(buffer, 0, size);     // don't leave the private key lying around on the heap
+  free(buffer);
+#endif
+}
+
+
+SimpleIOTSecureClient::SimpleIOTSecureClient()
+{
+  this->_credentials = NULL;
+  this->_trust = NULL;
+  this->_pushback = NULL;
+  this->_pushbackLength = 0;
+  this->_pushbackIndex = 0;
+  this->_firstCount = 0;
+  this->_useClientCert = true;
+  this->_resume = true;
+  this->_resumeRtc = false;
+  this->_haveSession = false;
+  this->_sessionHost[0] = '\0';
+  this->_sessionPort = 0;
+  this->_lastDnsUs = 0;
+  this->_lastTcpUs = 0;
+  this->_lastHandshakeUs = 0;
+  this->_connectedAtUs = 0;
+  this->_handshakeCount = 0;
+  this->_resumedCount = 0;
+  this->_lastResumed = false;
+  mbedtls_ssl_session_init(&this->_session);
+}
+
+SimpleIOTSecureClient::~SimpleIOTSecureClient()
+{
+  mbedtls_ssl_session_free(&this->_session);
+  free(this->_pushback);
+}
+
+void SimpleIOTSecureClient::setCredentials(SimpleIOTCredentials* credentials, bool useClientCert,
+                                           SimpleIOTCredentials* trust)
+{
+  this->_credentials = credentials;
+  this->_trust = trust ? trust : credentials;
+  this->_useClientCert = useClientCert;
+}
+
+void SimpleIOTSecureClient::setSessionResumption(bool enable, bool keepInRtc)
+{
+  this->_resume = enable;
+  this->_resumeRtc = enable && keepInRtc;
+  if (!enable) {
+    this->clearSession();
+  }
+}
+
+void SimpleIOTSecureClient::clearSession()
+{
+  mbedtls_ssl_session_free(&this->_session);
+  mbedtls_ssl_session_init(&this->_session);
+  this->_haveSession = false;
+  _rtcSession.magic = 0;
+}
+
+int SimpleIOTSecureClient::connect(IPAddress ip, uint16_t port)
+{
+  return this->connect(ip.toString().c_str(), port);
+}
+
+// Same sequence as the stock WiFiClientSecure connect (see ssl_client.cpp in the ESP32 core),
+// with the saved session offered before the handshake and picked up again after it.
+//
+int SimpleIOTSecureClient::connect(const char* host, uint16_t port)
+{
+  if (!this->_trust || !this->_trust->hasCA()) {
+    return WiFiClientSecure::connect(host, port);
+  }
+
+  this->stop();
+  this->_firstCount = 0;
+  mbedtls_ssl_init(&sslclient->ssl_ctx);
+  mbedtls_ssl_config_init(&sslclient->ssl_conf);
+  mbedtls_ctr_drbg_init(&sslclient->drbg_ctx);
+  mbedtls_entropy_init(&sslclient->entropy_ctx);
+  mbedtls_x509_crt_init(&sslclient->ca_cert);
+  mbedtls_x509_crt_init(&sslclient->client_cert);
+  mbedtls_pk_init(&sslclient->client_key);
+
+  if (this->_openSocket(host, port) < 0) {
+    Serial.print("SimpleIOT: TLS unable to connect to ");
+    Serial.println(host);
+    this->stop();
+    return 0;
+  }
+
+  unsigned long start = micros();
+  int ret = this->_handshake(host, port);
+  if (ret != 0) {
+    Serial.printf("SimpleIOT: TLS handshake with %s failed: -0x%04x\n", host, -ret);
+    this->_lastError = ret;
+    this->stop();
+    return 0;
+  }
+
+  this->_connectedAtUs = micros();
+  this->_lastHandshakeUs = this->_connectedAtUs - start;
+  this->_handshakeCount++;
+  if (this->_lastResumed) {
+    this->_resumedCount++;
+  }
+  this->_connected = true;
+
+  #ifdef _DEBUG
+    Serial.printf("SimpleIOT: TLS connected to %s. DNS %lu us, TCP %lu us, handshake %lu us (%s), %lu of %lu resumed\n",
+                  host, this->_lastDnsUs, this->_lastTcpUs, this->_lastHandshakeUs, this->_lastResumed ? "resumed" : "full handshake",
+                  this->_resumedCount, this->_handshakeCount);
+  #endif
+  return 1;
+}
+
+int SimpleIOTSecureClient::_openSocket(const char* host, uint16_t port)
+{
+  IPAddress address;
+  struct sockaddr_in serverAddr;
+  struct timeval timeout;
+
+  unsigned long start = micros();
+
+  this->_lastDnsUs = 0;
+  this->_lastTcpUs = 0;
+  if (!WiFi.hostByName(host, address)) {
+    return -1;
+  }
+  this->_lastDnsUs = micros() - start;
+  start = micros();
+
+  int fd = lwip_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (fd < 0) {
+    return -1;
+  }
+
+  memset(&serverAddr, 0, sizeof(serverAddr));
+  serverAddr.sin_family = AF_INET;
+  serverAddr.sin_addr.s_addr = (uint32_t) address;
+  serverAddr.sin_port = htons(port);
+
+  timeout.tv_sec = SIMPLEIOT_TLS_SOCKET_TIMEOUT_MS / 1000;
+  timeout.tv_usec = 0;
+  lwip_setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  lwip_setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  // Non-blocking connect, waited on for at most the client's timeout like ssl_client does.
+  // A blocking one would hold loop() for lwIP's own timeout if the broker is unreachable.
+  //
+  lwip_fcntl(fd, F_SETFL, lwip_fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  if (lwip_connect(fd, (struct sockaddr*) &serverAddr, sizeof(serverAddr)) != 0 && errno != EINPROGRESS) {
+    lwip_close(fd);
+    return -1;
+  }
+
+  int timeoutMs = this->_timeout > 0 ? this->_timeout : SIMPLEIOT_TLS_SOCKET_TIMEOUT_MS;
+  fd_set writable;
+  FD_ZERO(&writable);
+  FD_SET(fd, &writable);
+  timeout.tv_sec = timeoutMs / 1000;
+  timeout.tv_usec = (timeoutMs % 1000) * 1000;
+  if (lwip_select(fd + 1, NULL, &writable, NULL, &timeout) <= 0) {
+    lwip_close(fd);                         // timed out, or select failed
+    return -1;
+  }
+
+  int error = 0;
+  socklen_t length = sizeof(error);
+  if (lwip_getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0) {
+    lwip_close(fd);
+    return -1;
+  }
+  this->_lastTcpUs = micros() - start;
+
+  sslclient->socket = fd;
+  return fd;
+}
+
+int SimpleIOTSecureClient::_handshake(const char* host, uint16_t port)
+{
+  const char* pers = "simpleiot";
+  bool offered = false;
+  int ret;
+
+  ret = mbedtls_ctr_drbg_seed(&sslclient->drbg_ctx, mbedtls_entropy_func, &sslclient->entropy_ctx,
+                              (const unsigned char*) pers, strlen(pers));
+  if (ret != 0) {
+    return ret;
+  }
+  ret = mbedtls_ssl_config_defaults(&sslclient->ssl_conf, MBEDTLS_SSL_IS_CLIENT,
+                                    MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+  if (ret != 0) {
+    return ret;
+  }
+
+  // Parsed once and shared. The sslclient's own cert and key contexts stay empty, so
+  // stop() doesn't free anything that belongs to the credentials.
+  //
+  if ((ret = this->_credentials->load()) != 0 || (ret = this->_trust->load()) != 0) {
+    return ret;
+  }
+  mbedtls_ssl_conf_authmode(&sslclient->ssl_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+  mbedtls_ssl_conf_ca_chain(&sslclient->ssl_conf, this->_trust->caChain(), NULL);
+
+  if (this->_useClientCert && this->_credentials->hasClientCert()) {
+    mbedtls_ssl_conf_own_cert(&sslclient->ssl_conf, this->_credentials->clientCert(),
+                              this->_credentials->clientKey());
+  }
+
+  mbedtls_ssl_conf_rng(&sslclient->ssl_conf, mbedtls_ctr_drbg_random, &sslclient->drbg_ctx);
+#ifdef MBEDTLS_SSL_SESSION_TICKETS
+  mbedtls_ssl_conf_session_tickets(&sslclient->ssl_conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+
+  if ((ret = mbedtls_ssl_setup(&sslclient->ssl_ctx, &sslclient->ssl_conf)) != 0) {
+    return ret;
+  }
+  if ((ret = mbedtls_ssl_set_hostname(&sslclient->ssl_ctx, host)) != 0) {
+    return ret;
+  }
+
+  // Offer the saved session if it was for this same server
+  //
+  if (this->_resume) {
+    bool matches = this->_haveSession && this->_sessionPort == port &&
+                   strncmp(this->_sessionHost, host, SIMPLEIOT_TLS_HOST_SIZE - 1) == 0;
+
+    if (!matches && this->_resumeRtc) {
+      matches = this->_loadRtcSession(host, port);
+    }
+    if (matches && mbedtls_ssl_set_session(&sslclient->ssl_ctx, &this->_session) == 0) {
+      offered = true;
+    }
+  }
+
+  mbedtls_ssl_set_bio(&sslclient->ssl_ctx, &sslclient->socket, mbedtls_net_send, mbedtls_net_recv, NULL);
+
+  unsigned long start = millis();
+  while ((ret = mbedtls_ssl_handshake(&sslclient->ssl_ctx)) != 0) {
+    if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+      return ret;
+    }
+    if (millis() - start > sslclient->handshake_timeout) {
+      return -1;
+    }
+    vTaskDelay(2);
+  }
+
+  this->_lastResumed = false;
+  if (this->_resume) {
+    mbedtls_ssl_session fresh;
+
+    mbedtls_ssl_session_init(&fresh);
+    if (mbedtls_ssl_get_session(&sslclient->ssl_ctx, &fresh) == 0) {
+      // The server echoes the session ID back only when it accepted the one we offered
+      //
+      this->_lastResumed = offered && fresh.id_len > 0 && fresh.id_len == this->_session.id_len &&
+                           memcmp(fresh.id, this->_session.id, fresh.id_len) == 0;
+
+      mbedtls_ssl_session_free(&this->_session);
+      this->_session = fresh;      // takes over the ticket and certificate buffers
+      this->_haveSession = true;
+      this->_sessionPort = port;
+      strncpy(this->_sessionHost, host, SIMPLEIOT_TLS_HOST_SIZE - 1);
+      this->_sessionHost[SIMPLEIOT_TLS_HOST_SIZE - 1] = '\0';
+
+      if (this->_resumeRtc && !this->_lastResumed) {
+        this->_saveRtcSession();
+      }
+    } else {
+      mbedtls_ssl_session_free(&fresh);
+    }
+  }
+  return 0;
+}
+
+bool SimpleIOTSecureClient::_loadRtcSession(const char* host, uint16_t port)
+{
+  if (_rtcSession.magic != SIMPLEIOT_TLS_RTC_MAGIC || _rtcSession.port != port ||
+      _rtcSession.length > SIMPLEIOT_TLS_SESSION_SIZE ||
+      strncmp(_rtcSession.host, host, SIMPLEIOT_TLS_HOST_SIZE - 1) != 0) {
+    return false;
+  }
+
+  mbedtls_ssl_session_free(&this->_session);
+  mbedtls_ssl_session_init(&this->_session);
+  if (mbedtls_ssl_session_load(&this->_session, _rtcSession.data, _rtcSession.length) != 0) {
+    _rtcSession.magic = 0;
+    this->_haveSession = false;
+    return false;
+  }
+  this->_haveSession = true;
+  this->_sessionPort = port;
+  strncpy(this->_sessionHost, host, SIMPLEIOT_TLS_HOST_SIZE - 1);
+  this->_sessionHost[SIMPLEIOT_TLS_HOST_SIZE - 1] = '\0';
+  return true;
+}
+
+void SimpleIOTSecureClient::_saveRtcSession()
+{
+  size_t length = 0;
+
+  _rtcSession.magic = 0;
+  if (mbedtls_ssl_session_save(&this->_session, _rtcSession.data, sizeof(_rtcSession.data), &length) != 0) {
+    return;     // too big to keep, we'll do a full handshake after the next wake
+  }
+  _rtcSession.port = this->_sessionPort;
+  _rtcSession.length = (uint16_t) length;
+  strncpy(_rtcSession.host, this->_sessionHost, SIMPLEIOT_TLS_HOST_SIZE);
+  _rtcSession.magic = SIMPLEIOT_TLS_RTC_MAGIC;
+}
+
+void SimpleIOTSecureClient::stop()
+{
+  this->_pushbackLength = 0;
+  this->_pushbackIndex = 0;
+  WiFiClientSecure::stop();
+}
+
+int SimpleIOTSecureClient::available()
+{
+  return (this->_pushbackLength - this->_pushbackIndex) + WiFiClientSecure::available();
+}
+
+int SimpleIOTSecureClient::peek()
+{
+  if (this->_pushbackIndex < this->_pushbackLength) {
+    return this->_pushback[this->_pushbackIndex];
+  }
+  return WiFiClientSecure::peek();
+}
+
+int SimpleIOTSecureClient::read()
+{
+  uint8_t data;
+
+  return this->read(&data, 1) == 1 ? data : -1;
+}
+
+int SimpleIOTSecureClient::read(uint8_t* buf, size_t size)
+{
+  if (this->_pushbackIndex < this->_pushbackLength) {
+    size_t count = this->_pushbackLength - this->_pushbackIndex;
+    if (count > size) {
+      count = size;
+    }
+    memcpy(buf, this->_pushback + this->_pushbackIndex, count);
+    this->_pushbackIndex += count;
+    if (this->_pushbackIndex == this->_pushbackLength) {
+      this->_pushbackIndex = 0;
+      this->_pushbackLength = 0;
+    }
+    return count;
+  }
+  return this->rawRead(buf, size);
+}
+
+int SimpleIOTSecureClient::rawRead(uint8_t* buf, size_t size)
+{
+  int count = WiFiClientSecure::read(buf, size);
+
+  for (int i = 0; i < count && this->_firstCount < sizeof(this->_firstBytes); i++) {
+    this->_firstBytes[this->_firstCount++] = buf[i];
+  }
+  return count;
+}
+
+bool SimpleIOTSecureClient::unread(const uint8_t* data, size_t length)
+{
+  if (!this->_pushback) {
+    this->_pushback = (uint8_t*) malloc(SIMPLEIOT_TLS_PUSHBACK_SIZE);
+    if (!this->_pushback) {
+      return false;
+    }
+  }
+
+  // Move what's left to the front to make room
+  //
+  if (this->_pushbackIndex > 0) {
+    memmove(this->_pushback, this->_pushback + this->_pushbackIndex, this->_pushbackLength - this->_pushbackIndex);
+    this->_pushbackLength -= this->_pushbackIndex;
+    this->_pushbackIndex = 0;
+  }
+  if (this->_pushbackLength + length > SIMPLEIOT_TLS_PUSHBACK_SIZE) {
+    return false;
+  }
+  memcpy(this->_pushback + this->_pushbackLength, data, length);
+  this->_pushbackLength += length;
+  return true;
+}
+
+// CONNACK is 0x20 0x02 <flags> <return code>. Bit 0 of the flags is session present.
+//
+bool SimpleIOTSecureClient::sessionPresent()
+{
+  return this->_firstCount == sizeof(this->_firstBytes) && (this->_firstBytes[0] & 0xF0) == 0x20 &&
+         this->_firstBytes[3] == 0 && (this->_firstBytes[2] & 0x01) != 0;
+}
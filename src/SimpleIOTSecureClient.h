@@ -0,0 +1,181 @@
+/*
+ *  © 2022 Amazon Web Services, Inc. or its affiliates. All Rights Reserved.
+ *
+ *  SimpleIOT Arduino client library.
+ *
+ *  TLS client used for the IOT and OTA connections. It is a WiFiClientSecure, so it can be
+ *  handed to MqttClient and HTTPClient as-is, but it does its own handshake so the TLS
+ *  session can be kept and offered again on the next connect. A resumed session skips the
+ *  certificate exchange and the public key operations, which is most of the handshake time
+ *  on an ESP32.
+ *
+ *  The session can also be kept in RTC memory so it survives deep sleep.
+ *
+ *  Certificates and the private key are parsed once into a SimpleIOTCredentials object
+ *  and shared by every client that uses them, instead of being decoded again on each
+ *  connect.
+ */
+
+#ifndef __SIMPLEIOT_SECURE_CLIENT_H__
+#define __SIMPLEIOT_SECURE_CLIENT_H__
+
+#include <Arduino.h>
+#include <WiFiClientSecure.h>
+#include <ssl_client.h>
+#include <mbedtls/x509_crt.h>
+#include <mbedtls/pk.h>
+
+// Room for a serialized session (ticket plus the server certificate) kept in RTC memory.
+// Sessions that don't fit are simply not carried across deep sleep.
+//
+#define SIMPLEIOT_TLS_SESSION_SIZE    2048
+#define SIMPLEIOT_TLS_HOST_SIZE       128
+#define SIMPLEIOT_TLS_PUSHBACK_SIZE   2048
+
+// Parsed CA chain, device certificate and private key. Each can be given as a PEM string or
+// as a DER blob (a CA chain in DER is just the certificates back to back). The buffers are
+// kept by reference and must stay around for the life of the object. DER input is parsed in
+// place, so DER arrays in flash don't use any heap for the raw certificates.
+//
+// PEM input can optionally be converted to DER once and cached in NVS. Later boots load the
+// DER from there and skip the base64 decoding. The cache is keyed on a CRC of the PEM text,
+// so changing the credentials invalidates it.
+//
+class SimpleIOTCredentials {
+
+public:
+    SimpleIOTCredentials();
+    ~SimpleIOTCredentials();
+
+    void setPem(const char* caPem, const char* certPem, const char* keyPem);
+    void setDer(const uint8_t* caDer, size_t caLength,
+                const uint8_t* certDer, size_t certLength,
+                const uint8_t* keyDer, size_t keyLength);
+    void setNVSCache(bool enable) { _nvsCache = enable; }
+
+    // Parses everything the first time it's called. Returns 0 or an mbedtls error code.
+    //
+    int load();
+    void unload();
+
+    bool hasCA() { return _ca != NULL; }
+    bool hasClientCert() { return _cert != NULL && _key != NULL; }
+    mbedtls_x509_crt* caChain() { return &_caChain; }
+    mbedtls_x509_crt* clientCert() { return &_clientCert; }
+    mbedtls_pk_context* clientKey() { return &_clientKey; }
+
+    // Microseconds the last load() took, and whether it came from the NVS cache
+    //
+    unsigned long loadUs() { return _loadUs; }
+    bool loadedFromCache() { return _fromCache; }
+
+private:
+    const uint8_t* _ca;
+    size_t _caLength;
+    const uint8_t* _cert;
+    size_t _certLength;
+    const uint8_t* _key;
+    size_t _keyLength;
+    bool _isPem;
+    bool _nvsCache;
+
+    mbedtls_x509_crt _caChain;
+    mbedtls_x509_crt _clientCert;
+    mbedtls_pk_context _clientKey;
+    bool _loaded;
+    bool _fromCache;
+    unsigned long _loadUs;
+
+    int _parse(const uint8_t* ca, size_t caLength, const uint8_t* cert, size_t certLength,
+               const uint8_t* key, size_t keyLength, bool pem, bool inPlace);
+    uint32_t _sourceCrc();
+    bool _loadCache(uint32_t crc);
+    void _saveCache(uint32_t crc);
+};
+
+class SimpleIOTSecureClient : public WiFiClientSecure {
+
+public:
+    SimpleIOTSecureClient();
+    ~SimpleIOTSecureClient();
+
+    // The credentials are shared, not copied. Clients that only need to check the server,
+    // like the OTA download, can leave out the device certificate. If trust is given, the
+    // server is checked against its CA instead, e.g. a Greengrass group CA.
+    //
+    void setCredentials(SimpleIOTCredentials* credentials, bool useClientCert = true,
+                        SimpleIOTCredentials* trust = NULL);
+
+    // Offer the last session on the next connect to the same host and port. If keepInRtc
+    // is set, the session is also saved to RTC memory after each full handshake and picked
+    // up from there after a wake from deep sleep.
+    //
+    void setSessionResumption(bool enable, bool keepInRtc = false);
+    void clearSession();
+
+    using WiFiClientSecure::connect;
+    int connect(const char* host, uint16_t port) override;
+    int connect(IPAddress ip, uint16_t port) override;
+
+    // Timing of the last connect, in microseconds: DNS lookup, TCP connect, and TLS handshake.
+    // connectedAtUs is the micros() value when the handshake finished.
+    //
+    unsigned long lastDnsUs() { return _lastDnsUs; }
+    unsigned long lastTcpUs() { return _lastTcpUs; }
+    unsigned long lastHandshakeUs() { return _lastHandshakeUs; }
+    unsigned long connectedAtUs() { return _connectedAtUs; }
+
+    // MQTT helpers. rawAvailable and rawRead go straight to the TLS stream. Bytes handed to
+    // unread() are returned by the next read() calls ahead of anything still in the stream,
+    // so SimpleIOT can read a packet itself and give back whatever wasn't for it.
+    // sessionPresent looks at the CONNACK, which is the first thing read after a connect.
+    //
+    int available() override;
+    int read() override;
+    int read(uint8_t* buf, size_t size) override;
+    int peek() override;
+    void stop() override;
+    int rawAvailable() { return WiFiClientSecure::available(); }
+    int rawRead(uint8_t* buf, size_t size);
+    bool unread(const uint8_t* data, size_t length);
+    bool sessionPresent();
+
+    // Handshake statistics since boot
+    //
+    unsigned long handshakeCount() { return _handshakeCount; }
+    unsigned long resumedCount() { return _resumedCount; }
+    bool lastResumed() { return _lastResumed; }
+
+private:
+    SimpleIOTCredentials* _credentials;
+    SimpleIOTCredentials* _trust;
+    bool _useClientCert;
+    bool _resume;
+    bool _resumeRtc;
+
+    mbedtls_ssl_session _session;
+    bool _haveSession;
+    char _sessionHost[SIMPLEIOT_TLS_HOST_SIZE];
+    uint16_t _sessionPort;
+
+    uint8_t* _pushback;
+    size_t _pushbackLength;
+    size_t _pushbackIndex;
+    uint8_t _firstBytes[4];
+    size_t _firstCount;
+
+    unsigned long _lastDnsUs;
+    unsigned long _lastTcpUs;
+    unsigned long _lastHandshakeUs;
+    unsigned long _connectedAtUs;
+    unsigned long _handshakeCount;
+    unsigned long _resumedCount;
+    bool _lastResumed;
+
+    int _openSocket(const char* host, uint16_t port);
+    int _handshake(const char* host, uint16_t port);
+    bool _loadRtcSession(const char* host, uint16_t port);
+    void _saveRtcSession();
+};
+
+#endif
@@ -0,0 +1,96 @@
+/*
+ * © 2022 Amazon Web Services, Inc. or its affiliates. All Rights Reserved.
+ *
+ * SimpleIOT Arduino Client Library -- semantic version comparison
+ */
+
+#include "SimpleIOTVersion.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+int SimpleIOTVersion::compare(const char* a, const char* b)
+{
+  unsigned long pa[3], pb[3];
+  char prea[SIMPLEIOT_VERSION_PRE_SIZE], preb[SIMPLEIOT_VERSION_PRE_SIZE];
+
+  _parse(a, pa, prea);
+  _parse(b, pb, preb);
+  for (int i = 0; i < 3; i++) {
+    if (pa[i] != pb[i]) {
+      return pa[i] < pb[i] ? -1 : 1;
+    }
+  }
+  if (prea[0] == '\0' || preb[0] == '\0') {
+    return prea[0] == preb[0] ? 0 : (prea[0] == '\0' ? 1 : -1);
+  }
+  return _comparePrerelease(prea, preb);
+}
+
+// Split a semantic version (1.2.3-rc.1+build) into its numbers and pre-release tag
+//
+void SimpleIOTVersion::_parse(const char* version, unsigned long* parts, char* pre)
+{
+  const char* p = version;
+
+  if (*p == 'v' || *p == 'V') {
+    p++;
+  }
+  for (int i = 0; i < 3; i++) {
+    char* end;
+    parts[i] = 0;
+    if (isdigit((unsigned char) *p)) {
+      parts[i] = strtoul(p, &end, 10);
+      p = end;
+    }
+    if (*p == '.') {
+      p++;
+    }
+  }
+
+  size_t length = 0;
+  if (*p == '-') {
+    p++;
+    length = strcspn(p, "+");
+    if (length > SIMPLEIOT_VERSION_PRE_SIZE - 1) {
+      length = SIMPLEIOT_VERSION_PRE_SIZE - 1;
+    }
+    memcpy(pre, p, length);
+  }
+  pre[length] = '\0';
+}
+
+// Pre-release precedence, per semver: dot-separated identifiers compared in turn, numbers
+// numerically and below any text, and a shorter list first if the rest is equal.
+//
+int SimpleIOTVersion::_comparePrerelease(const char* a, const char* b)
+{
+  while (true) {
+    size_t la = strcspn(a, ".");
+    size_t lb = strcspn(b, ".");
+    bool na = la > 0 && strspn(a, "0123456789") >= la;
+    bool nb = lb > 0 && strspn(b, "0123456789") >= lb;
+    int c;
+
+    if (na && nb) {
+      c = la != lb ? (la < lb ? -1 : 1) : strncmp(a, b, la);
+    } else if (na != nb) {
+      c = na ? -1 : 1;
+    } else {
+      c = strncmp(a, b, la < lb ? la : lb);
+      if (c == 0 && la != lb) {
+        c = la < lb ? -1 : 1;
+      }
+    }
+    if (c != 0) {
+      return c;
+    }
+    a += la;
+    b += lb;
+    if (*a == '\0' || *b == '\0') {
+      return *a == *b ? 0 : (*a == '\0' ? -1 : 1);
+    }
+    a++;
+    b++;
+  }
+}
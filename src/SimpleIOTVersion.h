@@ -0,0 +1,29 @@
+/*
+ *  © 2022 Amazon Web Services, Inc. or its affiliates. All Rights Reserved.
+ *
+ *  SimpleIOT Arduino client library.
+ *
+ *  Semantic version comparison for update messages. Plain C string handling with no Arduino
+ *  dependencies, so it also builds on a host for extras/tests/version_test.cpp.
+ */
+
+#ifndef __SIMPLEIOT_VERSION_H__
+#define __SIMPLEIOT_VERSION_H__
+
+#define SIMPLEIOT_VERSION_PRE_SIZE      24      // longest pre-release tag kept, with terminator
+
+class SimpleIOTVersion {
+
+public:
+    // Less than, equal to or greater than 0 as a is older, the same or newer than b. A
+    // leading 'v' is fine, missing parts count as 0, and build metadata after '+' is ignored.
+    // A release is newer than any of its pre-releases.
+    //
+    static int compare(const char* a, const char* b);
+
+private:
+    static void _parse(const char* version, unsigned long* parts, char* pre);
+    static int _comparePrerelease(const char* a, const char* b);
+};
+
+#endif